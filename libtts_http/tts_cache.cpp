@@ -0,0 +1,328 @@
+#include "tts_cache.h"
+#include <switch.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+#define DEFAULT_CACHE_MB (64)
+#define DEFAULT_DISK_CACHE_MB (512)
+#define DEFAULT_CACHE_TTL_SECS (86400)
+#define FILE_SUFFIX ".ttsc"
+#define FILE_MAGIC "TTSC1\n"
+#define TMP_SUFFIX ".tmp"
+#define MAX_CACHED_HEADERS (256)
+
+std::mutex TtsCache::mutex;
+std::list<std::string> TtsCache::lru;
+std::unordered_map<std::string, TtsCache::Node> TtsCache::entries;
+size_t TtsCache::bytes = 0;
+size_t TtsCache::budget = 0;
+time_t TtsCache::ttl = 0;
+std::string TtsCache::dir;
+std::list<std::string> TtsCache::fileLru;
+std::unordered_map<std::string, TtsCache::File> TtsCache::files;
+size_t TtsCache::diskBytes = 0;
+size_t TtsCache::diskBudget = 0;
+TtsCache::Stats TtsCache::counters = {};
+
+static size_t entry_bytes(const TtsCache::EntryPtr& entry) {
+  size_t n = entry->body.size() + entry->contentType.size();
+  for (const auto& header : entry->headers) n += header.size();
+  return n;
+}
+
+/* files hold the response code, content type, headers and body, each as a length and its bytes */
+static bool put(FILE *f, const std::string& s) {
+  uint32_t len = s.size();
+  return fwrite(&len, sizeof(len), 1, f) == 1 && fwrite(s.data(), 1, len, f) == len;
+}
+
+/* left counts down the bytes still unread, so that a corrupt length can't ask for more than the file holds */
+static bool get(FILE *f, std::string& s, size_t& left) {
+  uint32_t len;
+  if (left < sizeof(len) || fread(&len, sizeof(len), 1, f) != 1) return false;
+  left -= sizeof(len);
+  if (len > left) return false;
+  s.resize(len);
+  left -= len;
+  return fread(&s[0], 1, len, f) == len;
+}
+
+/* written under a name of its own and renamed into place, so that readers only ever see whole files */
+static bool write_file(const std::string& path, const TtsCache::Entry& entry) {
+  static std::atomic<unsigned long> seq(0);
+  std::string tmp = path + "." + std::to_string(getpid()) + "." + std::to_string(seq++) + TMP_SUFFIX;
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) return false;
+
+  bool ok = fwrite(FILE_MAGIC, 1, strlen(FILE_MAGIC), f) == strlen(FILE_MAGIC) &&
+    put(f, std::to_string(entry.responseCode)) && put(f, entry.contentType) &&
+    put(f, std::to_string(entry.headers.size()));
+  for (size_t i = 0; ok && i < entry.headers.size(); i++) ok = put(f, entry.headers[i]);
+  ok = ok && put(f, entry.body);
+
+  if (fclose(f) != 0) ok = false;
+  if (ok && rename(tmp.c_str(), path.c_str()) == 0) return true;
+  unlink(tmp.c_str());
+  return false;
+}
+
+static TtsCache::EntryPtr read_file(const std::string& path) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) return nullptr;
+
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0 || (size_t) st.st_size < strlen(FILE_MAGIC)) {
+    fclose(f);
+    return nullptr;
+  }
+  size_t left = st.st_size - strlen(FILE_MAGIC);
+
+  std::shared_ptr<TtsCache::Entry> entry = std::make_shared<TtsCache::Entry>();
+  char magic[sizeof(FILE_MAGIC)] = "";
+  std::string code, count;
+  bool ok = fread(magic, 1, strlen(FILE_MAGIC), f) == strlen(FILE_MAGIC) && 0 == strcmp(magic, FILE_MAGIC) &&
+    get(f, code, left) && get(f, entry->contentType, left) && get(f, count, left);
+  if (ok) {
+    entry->responseCode = atol(code.c_str());
+
+    /* every header takes at least its length, so a count the file can't hold is corrupt */
+    unsigned long n = strtoul(count.c_str(), nullptr, 10);
+    ok = n <= MAX_CACHED_HEADERS && n * sizeof(uint32_t) <= left;
+    if (ok) entry->headers.resize(n);
+    for (auto& header : entry->headers) ok = ok && get(f, header, left);
+    ok = ok && get(f, entry->body, left);
+  }
+  fclose(f);
+  return ok ? entry : nullptr;
+}
+
+void TtsCache::_init() {
+  static std::once_flag once;
+  std::call_once(once, []() {
+    const char* mb = std::getenv("TTS_CACHE_MB");
+    const char* diskMb = std::getenv("TTS_CACHE_DISK_MB");
+    const char* ttlSecs = std::getenv("TTS_CACHE_TTL_SECS");
+    budget = static_cast<size_t>(mb ? std::max(atoi(mb), 0) : DEFAULT_CACHE_MB) * 1024 * 1024;
+    diskBudget = static_cast<size_t>(diskMb ? std::max(atoi(diskMb), 0) : DEFAULT_DISK_CACHE_MB) * 1024 * 1024;
+    ttl = ttlSecs ? std::max(atoi(ttlSecs), 0) : DEFAULT_CACHE_TTL_SECS;
+
+    /* alongside the modules' own tts-cache-files, which hold audio handed out to callers */
+    const char* baseDir = std::getenv("JAMBONZ_TMP_CACHE_FOLDER");
+    if (!baseDir) baseDir = "/tmp/";
+    dir = std::string(baseDir) + "tts-cache";
+    if (diskBudget > 0 && mkdir(dir.c_str(), S_IRWXU | S_IRWXG) != 0 && errno != EEXIST) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "TtsCache: failed to create folder %s, disk cache disabled\n", dir.c_str());
+      diskBudget = 0;
+    }
+
+    /* pick up what earlier runs left, oldest first */
+    DIR *d = diskBudget > 0 ? opendir(dir.c_str()) : nullptr;
+    if (d) {
+      std::vector<std::pair<time_t, std::pair<std::string, size_t>>> found;
+      struct dirent *ent;
+      while ((ent = readdir(d))) {
+        std::string name(ent->d_name);
+        size_t suffix = name.size() - strlen(FILE_SUFFIX);
+        struct stat st;
+
+        /* left behind by a run that stopped mid-write */
+        if (name.size() > strlen(TMP_SUFFIX) && name.compare(name.size() - strlen(TMP_SUFFIX), std::string::npos, TMP_SUFFIX) == 0) {
+          unlink((dir + SWITCH_PATH_SEPARATOR + name).c_str());
+          continue;
+        }
+        if (name.size() <= strlen(FILE_SUFFIX) || name.compare(suffix, std::string::npos, FILE_SUFFIX) != 0) continue;
+        if (stat((dir + SWITCH_PATH_SEPARATOR + name).c_str(), &st) != 0) continue;
+        found.push_back(std::make_pair(st.st_mtime, std::make_pair(name.substr(0, suffix), (size_t) st.st_size)));
+      }
+      closedir(d);
+      std::sort(found.begin(), found.end());
+      for (const auto& it : found) {
+        fileLru.push_front(it.second.first);
+        files[it.second.first] = File{it.second.second, it.first, fileLru.begin()};
+        diskBytes += it.second.second;
+      }
+      evictFiles(diskBudget);
+    }
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "TtsCache: memory budget %lu bytes, disk budget %lu bytes in %s holding %lu files\n",
+      budget, diskBudget, dir.c_str(), files.size());
+  });
+}
+
+std::string TtsCache::key(const std::string& module, const std::string& url, const std::vector<std::string>& headers,
+  const std::string& body) {
+  std::string material = module + '\0' + url + '\0';
+  for (const auto& header : headers) material += header + '\n';
+  material += '\0' + body;
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char*>(material.data()), material.size(), digest);
+
+  static const char* hex = "0123456789abcdef";
+  std::string key;
+  for (unsigned char c : digest) {
+    key += hex[c >> 4];
+    key += hex[c & 0x0f];
+  }
+  return key;
+}
+
+std::string TtsCache::path(const std::string& key) {
+  return dir + SWITCH_PATH_SEPARATOR + key + FILE_SUFFIX;
+}
+
+TtsCache::EntryPtr TtsCache::lookup(const std::string& key) {
+  _init();
+  time_t stored;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key);
+    if (it != entries.end() && !expired(it->second.stored)) {
+      lru.splice(lru.begin(), lru, it->second.lru);
+      counters.hits++;
+      return it->second.entry;
+    }
+    auto file = files.find(key);
+    if (file == files.end() || expired(file->second.stored)) {
+      forget(key);
+      counters.misses++;
+      return nullptr;
+    }
+    fileLru.splice(fileLru.begin(), fileLru, file->second.lru);
+    stored = file->second.stored;
+  }
+
+  /* read outside the lock, so that a slow disk holds up only this lookup */
+  EntryPtr entry = read_file(path(key));
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!entry) {
+    auto file = files.find(key);
+    if (file != files.end()) {
+      diskBytes -= file->second.bytes;
+      fileLru.erase(file->second.lru);
+      files.erase(file);
+    }
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "TtsCache::lookup: unreadable file %s dropped\n", path(key).c_str());
+    unlink(path(key).c_str());
+    counters.misses++;
+    return nullptr;
+  }
+  remember(key, entry, stored);
+  counters.diskHits++;
+  return entry;
+}
+
+bool TtsCache::expired(time_t stored) {
+  return ttl > 0 && time(nullptr) - stored >= ttl;
+}
+
+/* drops an entry from both tiers; called with the mutex held */
+void TtsCache::forget(const std::string& key) {
+  auto it = entries.find(key);
+  if (it != entries.end()) {
+    bytes -= it->second.bytes;
+    lru.erase(it->second.lru);
+    entries.erase(it);
+  }
+  auto file = files.find(key);
+  if (file != files.end()) {
+    diskBytes -= file->second.bytes;
+    fileLru.erase(file->second.lru);
+    files.erase(file);
+    unlink(path(key).c_str());
+  }
+}
+
+/* called with the mutex held */
+void TtsCache::remember(const std::string& key, EntryPtr entry, time_t stored) {
+  size_t n = entry_bytes(entry);
+  if (n > budget / 4) return;
+
+  auto it = entries.find(key);
+  if (it != entries.end()) {
+    bytes -= it->second.bytes;
+    lru.erase(it->second.lru);
+    entries.erase(it);
+  }
+  evict(budget - n);
+
+  lru.push_front(key);
+  entries[key] = Node{entry, n, stored, lru.begin()};
+  bytes += n;
+}
+
+void TtsCache::insert(const std::string& key, EntryPtr entry) {
+  _init();
+  if (!entry || entry->body.empty() || !admits(entry_bytes(entry))) return;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    remember(key, entry, time(nullptr));
+    counters.inserts++;
+    if (0 == diskBudget || files.count(key)) return;
+  }
+
+  size_t n = entry_bytes(entry);
+  if (n > diskBudget / 4 || !write_file(path(key), *entry)) return;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (files.count(key)) return;
+  evictFiles(diskBudget - n);
+  fileLru.push_front(key);
+  files[key] = File{n, time(nullptr), fileLru.begin()};
+  diskBytes += n;
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "TtsCache::insert: %s, %lu bytes, cache now holds %lu bytes in memory, %lu on disk\n",
+    key.c_str(), n, bytes, diskBytes);
+}
+
+bool TtsCache::admits(size_t n) {
+  _init();
+
+  /* a single entry may take up to a quarter of a tier, so that one long prompt can't flush everything else */
+  return n <= std::max(budget, diskBudget) / 4;
+}
+
+/* called with the mutex held */
+void TtsCache::evict(size_t target) {
+  while (bytes > target && !lru.empty()) {
+    auto it = entries.find(lru.back());
+    bytes -= it->second.bytes;
+    entries.erase(it);
+    lru.pop_back();
+    counters.evictions++;
+  }
+}
+
+/* called with the mutex held */
+void TtsCache::evictFiles(size_t target) {
+  while (diskBytes > target && !fileLru.empty()) {
+    auto it = files.find(fileLru.back());
+    diskBytes -= it->second.bytes;
+    if (unlink(path(fileLru.back()).c_str()) != 0 && errno != ENOENT) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "TtsCache::evictFiles: error removing %s: %s\n",
+        path(fileLru.back()).c_str(), strerror(errno));
+    }
+    files.erase(it);
+    fileLru.pop_back();
+    counters.evictions++;
+  }
+}
+
+TtsCache::Stats TtsCache::stats() {
+  _init();
+  std::lock_guard<std::mutex> lock(mutex);
+  Stats s = counters;
+  s.entries = entries.size();
+  s.bytes = bytes;
+  s.budget = budget;
+  s.files = files.size();
+  s.diskBytes = diskBytes;
+  s.diskBudget = diskBudget;
+  return s;
+}
@@ -0,0 +1,104 @@
+#ifndef __TTS_CACHE_H__
+#define __TTS_CACHE_H__
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+#include <unordered_map>
+
+/**
+ * content-addressed cache of TTS responses, shared by the modules using the http engine.
+ *
+ * Entries are keyed by a hash of the module, url, request headers and request body, which between
+ * them carry the vendor, credentials, voice, model, text and audio format asked for, so that one
+ * account's audio is never served to another's requests.  They hold the response as it was
+ * received, its encoded body and those of its headers that describe the audio rather than the
+ * request that fetched it.  A hit is replayed through the module's own callbacks, so it is decoded,
+ * resampled and reported just like a fresh response.
+ *
+ * Recently used entries are held in memory, an LRU bounded by TTS_CACHE_MB (default 64), over a
+ * directory of files bounded by TTS_CACHE_DISK_MB (default 512) that survives restarts.  Setting
+ * either to 0 disables that tier.  Entries older than TTS_CACHE_TTL_SECS (default 86400) are
+ * dropped when next looked up, which bounds how long a revoked key can still be answered.
+ */
+class TtsCache {
+public:
+  struct Entry {
+    long responseCode;
+    std::string contentType;
+    std::vector<std::string> headers;   // as received, starting with the status line
+    std::string body;
+  };
+  typedef std::shared_ptr<const Entry> EntryPtr;
+
+  struct Stats {
+    uint64_t hits;
+    uint64_t diskHits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+    size_t files;
+    size_t diskBytes;
+    size_t diskBudget;
+  };
+
+  static std::string key(const std::string& module, const std::string& url, const std::vector<std::string>& headers,
+    const std::string& body);
+
+  // returns the cached response or nullptr, reading it in from disk if it is not held in memory
+  static EntryPtr lookup(const std::string& key);
+
+  // adds a response to both tiers, evicting the least recently used ones to stay within their budgets
+  static void insert(const std::string& key, EntryPtr entry);
+
+  // whether a response of this many bytes would be accepted, so it is only collected while it might be
+  static bool admits(size_t bytes);
+
+  static Stats stats();
+
+private:
+  struct Node {
+    EntryPtr entry;
+    size_t bytes;
+    time_t stored;
+    std::list<std::string>::iterator lru;
+  };
+
+  struct File {
+    size_t bytes;
+    time_t stored;
+    std::list<std::string>::iterator lru;
+  };
+
+  static void _init();
+  static void evict(size_t target);
+  static void evictFiles(size_t target);
+  static std::string path(const std::string& key);
+  static void remember(const std::string& key, EntryPtr entry, time_t stored);
+  static bool expired(time_t stored);
+  static void forget(const std::string& key);
+
+  static std::mutex mutex;
+  static std::list<std::string> lru;
+  static std::unordered_map<std::string, Node> entries;
+  static size_t bytes;
+  static size_t budget;
+  static time_t ttl;
+
+  static std::string dir;
+  static std::list<std::string> fileLru;
+  static std::unordered_map<std::string, File> files;
+  static size_t diskBytes;
+  static size_t diskBudget;
+
+  static Stats counters;
+};
+
+#endif
@@ -0,0 +1,204 @@
+#include "tts_g711.h"
+
+#define ULAW_BIAS (0x84)
+#define ALAW_AMI_MASK (0x55)
+
+/* encoding depends only on a sample's top 14 bits for u-law, and its top 12 for a-law */
+#define ULAW_ENCODE_SHIFT (2)
+#define ALAW_ENCODE_SHIFT (4)
+
+typedef struct
+{
+  int16_t ulawDecode[256];
+  int16_t alawDecode[256];
+
+  /* padded so that the AVX2 kernel can gather each entry as the low byte of a 32 bit word */
+  uint8_t ulawEncode[(1 << (16 - ULAW_ENCODE_SHIFT)) + 3];
+  uint8_t alawEncode[(1 << (16 - ALAW_ENCODE_SHIFT)) + 3];
+} G711Tables_t;
+
+/* the conversions from FreeSWITCH's g711.h, from which the tables are built */
+static inline int top_bit(unsigned int bits) {
+  return 31 - __builtin_clz(bits);
+}
+
+static int16_t ulaw_to_linear_ref(uint8_t ulaw) {
+  ulaw = ~ulaw;
+  int t = (((ulaw & 0x0F) << 3) + ULAW_BIAS) << (((int) ulaw & 0x70) >> 4);
+  return (int16_t) ((ulaw & 0x80) ? (ULAW_BIAS - t) : (t - ULAW_BIAS));
+}
+
+static int16_t alaw_to_linear_ref(uint8_t alaw) {
+  alaw ^= ALAW_AMI_MASK;
+  int i = ((alaw & 0x0F) << 4);
+  int seg = (((int) alaw & 0x70) >> 4);
+  if (seg) i = (i + 0x108) << (seg - 1);
+  else i += 8;
+  return (int16_t) ((alaw & 0x80) ? i : -i);
+}
+
+static uint8_t linear_to_ulaw_ref(int linear) {
+  int mask;
+  if (linear < 0) {
+    linear = ULAW_BIAS - linear - 1;
+    mask = 0x7F;
+  }
+  else {
+    linear = ULAW_BIAS + linear;
+    mask = 0xFF;
+  }
+  int seg = top_bit(linear | 0xFF) - 7;
+  if (seg >= 8) return (uint8_t) (0x7F ^ mask);
+  return (uint8_t) (((seg << 4) | ((linear >> (seg + 3)) & 0x0F)) ^ mask);
+}
+
+static uint8_t linear_to_alaw_ref(int linear) {
+  int mask;
+  if (linear >= 0) {
+    mask = ALAW_AMI_MASK | 0x80;
+  }
+  else {
+    mask = ALAW_AMI_MASK;
+    linear = -linear - 1;
+  }
+  int seg = top_bit(linear | 0xFF) - 7;
+  if (seg >= 8) return (uint8_t) (0x7F ^ mask);
+  return (uint8_t) (((seg << 4) | ((linear >> (seg ? (seg + 3) : 4)) & 0x0F)) ^ mask);
+}
+
+static const G711Tables_t& tables() {
+  static const G711Tables_t t = []() {
+    G711Tables_t t = {};
+    for (int i = 0; i < 256; i++) {
+      t.ulawDecode[i] = ulaw_to_linear_ref((uint8_t) i);
+      t.alawDecode[i] = alaw_to_linear_ref((uint8_t) i);
+    }
+    for (int i = 0; i < (1 << (16 - ULAW_ENCODE_SHIFT)); i++) {
+      t.ulawEncode[i] = linear_to_ulaw_ref((int16_t) (i << ULAW_ENCODE_SHIFT));
+    }
+    for (int i = 0; i < (1 << (16 - ALAW_ENCODE_SHIFT)); i++) {
+      t.alawEncode[i] = linear_to_alaw_ref((int16_t) (i << ALAW_ENCODE_SHIFT));
+    }
+    return t;
+  }();
+  return t;
+}
+
+static void ulaw_decode_scalar(int16_t* dst, const uint8_t* src, size_t len) {
+  const int16_t* table = tables().ulawDecode;
+  for (size_t i = 0; i < len; i++) dst[i] = table[src[i]];
+}
+
+static void alaw_decode_scalar(int16_t* dst, const uint8_t* src, size_t len) {
+  const int16_t* table = tables().alawDecode;
+  for (size_t i = 0; i < len; i++) dst[i] = table[src[i]];
+}
+
+static void ulaw_encode_scalar(uint8_t* dst, const int16_t* src, size_t len) {
+  const uint8_t* table = tables().ulawEncode;
+  for (size_t i = 0; i < len; i++) dst[i] = table[(uint16_t) src[i] >> ULAW_ENCODE_SHIFT];
+}
+
+static void alaw_encode_scalar(uint8_t* dst, const int16_t* src, size_t len) {
+  const uint8_t* table = tables().alawEncode;
+  for (size_t i = 0; i < len; i++) dst[i] = table[(uint16_t) src[i] >> ALAW_ENCODE_SHIFT];
+}
+
+/*
+ * The vector decoders work on 16 bit lanes, each holding a code byte.  A segment's samples are its
+ * biased mantissa shifted left by the segment number, held in bits 4 to 6 of the code, so the shift
+ * is made one bit of the segment at a time, each kept only in the lanes with that bit set.  No step
+ * overflows 16 bits: u-law tops out at 32124 + 0x84, and a-law at 64512 before its final halving.
+ */
+#if defined(USE_AVX2)
+#include <immintrin.h>
+
+static inline __m256i shift_by_segment(__m256i t, __m256i code) {
+  const __m256i bit0 = _mm256_set1_epi16(0x10), bit1 = _mm256_set1_epi16(0x20), bit2 = _mm256_set1_epi16(0x40);
+  t = _mm256_blendv_epi8(t, _mm256_slli_epi16(t, 1), _mm256_cmpeq_epi16(_mm256_and_si256(code, bit0), bit0));
+  t = _mm256_blendv_epi8(t, _mm256_slli_epi16(t, 2), _mm256_cmpeq_epi16(_mm256_and_si256(code, bit1), bit1));
+  return _mm256_blendv_epi8(t, _mm256_slli_epi16(t, 4), _mm256_cmpeq_epi16(_mm256_and_si256(code, bit2), bit2));
+}
+
+static inline __m256i sign_mask(__m256i code) {
+  const __m256i sign = _mm256_set1_epi16(0x80);
+  return _mm256_cmpeq_epi16(_mm256_and_si256(code, sign), sign);
+}
+
+void g711_ulaw_decode(int16_t* dst, const uint8_t* src, size_t len) {
+  const __m256i invert = _mm256_set1_epi16(0xFF), mantissa = _mm256_set1_epi16(0x0F), bias = _mm256_set1_epi16(ULAW_BIAS);
+  size_t i = 0;
+  for (; i + 15 < len; i += 16) {
+    __m256i code = _mm256_xor_si256(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + i))), invert);
+    __m256i t = _mm256_add_epi16(_mm256_slli_epi16(_mm256_and_si256(code, mantissa), 3), bias);
+    t = shift_by_segment(t, code);
+    __m256i value = _mm256_blendv_epi8(_mm256_sub_epi16(t, bias), _mm256_sub_epi16(bias, t), sign_mask(code));
+    _mm256_storeu_si256((__m256i*)(dst + i), value);
+  }
+  ulaw_decode_scalar(dst + i, src + i, len - i);
+}
+
+void g711_alaw_decode(int16_t* dst, const uint8_t* src, size_t len) {
+  const __m256i ami = _mm256_set1_epi16(ALAW_AMI_MASK), mantissa = _mm256_set1_epi16(0x0F), segment = _mm256_set1_epi16(0x70);
+  size_t i = 0;
+  for (; i + 15 < len; i += 16) {
+    __m256i code = _mm256_xor_si256(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + i))), ami);
+    __m256i m = _mm256_slli_epi16(_mm256_and_si256(code, mantissa), 4);
+
+    /* segment 0 is linear; the others carry an implied leading bit and shift by one less than their number */
+    __m256i t = _mm256_srli_epi16(shift_by_segment(_mm256_add_epi16(m, _mm256_set1_epi16(0x108)), code), 1);
+    __m256i zero = _mm256_cmpeq_epi16(_mm256_and_si256(code, segment), _mm256_setzero_si256());
+    t = _mm256_blendv_epi8(t, _mm256_add_epi16(m, _mm256_set1_epi16(8)), zero);
+
+    __m256i value = _mm256_blendv_epi8(_mm256_sub_epi16(_mm256_setzero_si256(), t), t, sign_mask(code));
+    _mm256_storeu_si256((__m256i*)(dst + i), value);
+  }
+  alaw_decode_scalar(dst + i, src + i, len - i);
+}
+
+/* gathers the table entries for 8 samples, and packs their low bytes down to 8 codes */
+static inline void encode_gather(uint8_t* dst, const int16_t* src, const uint8_t* table, int shift) {
+  __m256i idx = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)src));
+  idx = _mm256_srl_epi32(idx, _mm_cvtsi32_si128(shift));
+  __m256i codes = _mm256_i32gather_epi32((const int*)table, idx, 1);
+  codes = _mm256_shuffle_epi8(codes, _mm256_setr_epi8(
+    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+  codes = _mm256_permutevar8x32_epi32(codes, _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1));
+  _mm_storel_epi64((__m128i*)dst, _mm256_castsi256_si128(codes));
+}
+
+void g711_ulaw_encode(uint8_t* dst, const int16_t* src, size_t len) {
+  const uint8_t* table = tables().ulawEncode;
+  size_t i = 0;
+  for (; i + 7 < len; i += 8) encode_gather(dst + i, src + i, table, ULAW_ENCODE_SHIFT);
+  ulaw_encode_scalar(dst + i, src + i, len - i);
+}
+
+void g711_alaw_encode(uint8_t* dst, const int16_t* src, size_t len) {
+  const uint8_t* table = tables().alawEncode;
+  size_t i = 0;
+  for (; i + 7 < len; i += 8) encode_gather(dst + i, src + i, table, ALAW_ENCODE_SHIFT);
+  alaw_encode_scalar(dst + i, src + i, len - i);
+}
+
+#else
+
+/* without AVX2 the 256 entry tables beat working the segments out 8 samples at a time with SSE2 */
+void g711_ulaw_decode(int16_t* dst, const uint8_t* src, size_t len) {
+  ulaw_decode_scalar(dst, src, len);
+}
+
+void g711_alaw_decode(int16_t* dst, const uint8_t* src, size_t len) {
+  alaw_decode_scalar(dst, src, len);
+}
+
+void g711_ulaw_encode(uint8_t* dst, const int16_t* src, size_t len) {
+  ulaw_encode_scalar(dst, src, len);
+}
+
+void g711_alaw_encode(uint8_t* dst, const int16_t* src, size_t len) {
+  alaw_encode_scalar(dst, src, len);
+}
+
+#endif
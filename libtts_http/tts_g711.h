@@ -0,0 +1,29 @@
+#ifndef __TTS_G711_H__
+#define __TTS_G711_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * G.711 u-law and a-law conversion over whole spans, bit exact with FreeSWITCH's own g711.h.
+ *
+ * Both directions are table driven, and built with AVX2 they run vectorised: decoding works out
+ * 16 samples' segment shifts at a time in registers, and encoding gathers 8 samples' codes from a
+ * table indexed by their significant bits.  Destinations are written in place, so callers can
+ * decode straight into the free space of their own buffers.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void g711_ulaw_decode(int16_t* dst, const uint8_t* src, size_t len);
+void g711_alaw_decode(int16_t* dst, const uint8_t* src, size_t len);
+void g711_ulaw_encode(uint8_t* dst, const int16_t* src, size_t len);
+void g711_alaw_encode(uint8_t* dst, const int16_t* src, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,945 @@
+#include "tts_http.h"
+#include "tts_cache.h"
+
+#include <map>
+#include <list>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <strings.h>
+#include <algorithm>
+
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+
+#define DEFAULT_THREADS (1)
+#define MAX_THREADS (16)
+#define DEFAULT_TIMEOUT_SECS (10L)
+
+/* connection pool defaults, see TTS_HTTP_* in the README */
+#define DEFAULT_WARM_CONNECTIONS (1)
+#define DEFAULT_MAX_STREAMS (100)
+#define DEFAULT_KEEPALIVE_SECS (30)
+#define DEFAULT_WARM_IDLE_SECS (3600)
+#define MAX_CACHED_CONNECTIONS (64)
+#define WARM_TIMEOUT_SECS (5L)
+
+/* shared responses are held for late requesters up to this size, and replayed in curl sized chunks */
+#define MAX_SHARED_BYTES (4 * 1024 * 1024)
+#define REPLAY_CHUNK_SIZE (16384)
+
+struct Loop;
+
+/**
+ * a scheme, host and port that transfers are made to, on the loop serving it.  Origins live as
+ * long as their loop, because the connections opened to them point back at them.
+ */
+typedef struct
+{
+  struct Loop *loop;
+  std::string url;
+  std::chrono::steady_clock::time_point lastUsed;
+  bool pinned;          // listed in TTS_HTTP_WARM_URLS, so warmed whether used or not
+  int connections;      // open, whether in use or idle in the multi handle's cache
+  uint64_t pings;
+} Origin_t;
+
+/* a transfer in progress, found through the easy handle's CURLINFO_PRIVATE */
+typedef struct
+{
+  std::string module;   // empty for the engine's own keepalive requests
+  std::string url;
+  CURL *easy;
+  TtsHttp::Callback_t done;
+} Transfer_t;
+
+/**
+ * a shared transfer in flight: the response so far, so that requests joining late can catch up,
+ * and the sinks it is being delivered to.  The transfer runs on its own copy of the first
+ * requester's handle, which lives as long as the flight.
+ */
+typedef struct Flight
+{
+  ~Flight() {
+    if (easy) curl_easy_cleanup(easy);
+    if (hdr_list) curl_slist_free_all(hdr_list);
+  }
+
+  struct Loop *loop;
+  std::string module;
+  std::string key;
+  CURL *easy;
+  struct curl_slist *hdr_list;
+  std::vector<std::string> headers;
+  std::string body;
+  bool replayable;      // all of the response so far is held
+  std::list<TtsHttp::Sink> sinks;
+} Flight_t;
+
+/**
+ * an event loop driving one curl multi handle on a thread of its own.  Apart from starting and
+ * stopping it, everything in here is only touched on that thread.
+ */
+typedef struct Loop
+{
+  Loop() : timer(io_service), warmTimer(io_service), multi(nullptr), still_running(0) {}
+
+  boost::asio::io_service io_service;
+  boost::asio::deadline_timer timer;
+  boost::asio::deadline_timer warmTimer;
+  std::map<curl_socket_t, boost::asio::ip::tcp::socket *> socket_map;
+  std::set<Transfer_t *> transfers;
+  std::map<std::string, Origin_t> origins;
+  std::map<std::string, std::shared_ptr<Flight_t>> flights;
+  CURLM *multi;
+  int still_running;
+  std::thread thread;
+} Loop_t;
+
+/* totals for the transfers made by one module; times in milliseconds */
+typedef struct
+{
+  uint64_t transfers;
+  uint64_t failures;
+  uint64_t reused;
+  uint64_t hits;        // answered from the cache
+  uint64_t shared;      // answered by joining an identical transfer in flight
+  double nameLookup;
+  double connect;
+  double appConnect;
+  double firstByte;
+  double maxFirstByte;
+  double total;
+} ModuleStats_t;
+
+/* registration: the modules using the engine, and the names of the apis they added, which must outlive them */
+static std::mutex mutex;
+static std::set<std::string> modules;
+static std::set<std::string> apiNames;
+static std::vector<std::unique_ptr<Loop_t>> loops;
+
+/* DNS cache and TLS sessions shared by all the loops */
+static CURLSH *share = nullptr;
+static std::mutex shareLocks[CURL_LOCK_DATA_LAST];
+
+static std::mutex statsMutex;
+static std::map<std::string, ModuleStats_t> moduleStats;
+static std::atomic<size_t> active(0);
+
+/* connection pool settings, read when the engine starts */
+static int warmConnections = DEFAULT_WARM_CONNECTIONS;
+static int keepaliveSecs = DEFAULT_KEEPALIVE_SECS;
+static int warmIdleSecs = DEFAULT_WARM_IDLE_SECS;
+
+static void timer_cb(const boost::system::error_code & error, Loop_t *loop);
+static void warm_cb(const boost::system::error_code & error, Loop_t *loop);
+
+static int envInt(const char* name, int defaultValue, int min) {
+  const char* val = std::getenv(name);
+  return val && *val ? std::max(atoi(val), min) : defaultValue;
+}
+
+static int mcode_test(const char *where, CURLMcode code) {
+  if(CURLM_OK != code) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mcode_test ERROR: %s returns %s:%d\n", where, curl_multi_strerror(code), code);
+    return -1;
+  }
+  return 0 ;
+}
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+  shareLocks[data].lock();
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+  shareLocks[data].unlock();
+}
+
+static void record(const std::string& module, const TtsHttp::Result& result) {
+  std::lock_guard<std::mutex> lock(statsMutex);
+  ModuleStats_t& s = moduleStats[module];
+  s.transfers++;
+  if (result.code != CURLE_OK || result.responseCode >= 400) s.failures++;
+  if (result.reused) s.reused++;
+  s.nameLookup += result.nameLookup * 1000;
+  s.connect += result.connect * 1000;
+  s.appConnect += result.appConnect * 1000;
+  s.firstByte += result.startTransfer * 1000;
+  s.maxFirstByte = std::max(s.maxFirstByte, result.startTransfer * 1000);
+  s.total += result.total * 1000;
+}
+
+static void count(const std::string& module, uint64_t ModuleStats_t::*counter) {
+  std::lock_guard<std::mutex> lock(statsMutex);
+  moduleStats[module].*counter += 1;
+}
+
+/* how a transfer went, so far if it is still in progress */
+static TtsHttp::Result resultOf(CURL *easy, CURLcode code) {
+  TtsHttp::Result result = {};
+  char *ct = NULL;
+  long connects = 0;
+
+  result.code = code;
+  curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &result.responseCode);
+  curl_easy_getinfo(easy, CURLINFO_CONTENT_TYPE, &ct);
+  curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME, &result.nameLookup);
+  curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME, &result.connect);
+  curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME, &result.appConnect);
+  curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME, &result.startTransfer);
+  curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME, &result.total);
+  curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+  result.contentType = ct;
+  result.reused = 0 == connects;
+  return result;
+}
+
+/* Check for completed transfers, and hand them back to the modules that made them */
+static void check_multi_info(Loop_t *loop) {
+  CURLMsg *msg;
+  int msgs_left;
+
+  while((msg = curl_multi_info_read(loop->multi, &msgs_left))) {
+    if(msg->msg == CURLMSG_DONE) {
+      CURL *easy = msg->easy_handle;
+      Transfer_t *transfer = nullptr;
+      TtsHttp::Result result = resultOf(easy, msg->data.result);
+      curl_easy_getinfo(easy, CURLINFO_PRIVATE, &transfer);
+
+      curl_multi_remove_handle(loop->multi, easy);
+      loop->transfers.erase(transfer);
+      active--;
+
+      if (!transfer->module.empty()) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG,
+          "tts_http: %s response %ld, %s connection, dns %.1fms, connect %.1fms, tls %.1fms, first byte %.1fms, total %.1fms\n",
+          transfer->module.c_str(), result.responseCode, result.reused ? "reused" : "new",
+          result.nameLookup * 1000, result.connect * 1000, result.appConnect * 1000, result.startTransfer * 1000, result.total * 1000);
+
+        record(transfer->module, result);
+      }
+      transfer->done(result);
+      delete transfer;
+    }
+  }
+}
+
+/* delivers a response held in memory to a sink, as curl would have; returns false if the sink stopped taking it */
+static bool replay(const TtsHttp::Sink& sink, const std::vector<std::string>& headers, const std::string& body) {
+  std::vector<char> chunk;
+  for (const auto& header : headers) {
+    chunk.assign(header.begin(), header.end());
+    sink.header(chunk.data(), chunk.size());
+  }
+  for (size_t pos = 0; pos < body.size(); pos += REPLAY_CHUNK_SIZE) {
+    size_t len = std::min(body.size() - pos, (size_t) REPLAY_CHUNK_SIZE);
+    chunk.assign(body.begin() + pos, body.begin() + pos + len);
+    if (sink.body(chunk.data(), len) != len) return false;
+  }
+  return true;
+}
+
+/* CURLOPT_HEADERFUNCTION of a shared transfer */
+static size_t flight_header(char *buffer, size_t size, size_t nitems, Flight_t *f) {
+  size_t len = size * nitems;
+  if (f->replayable) f->headers.push_back(std::string(buffer, len));
+  for (auto& sink : f->sinks) sink.header(buffer, len);
+  return len;
+}
+
+/* CURLOPT_WRITEFUNCTION of a shared transfer */
+static size_t flight_body(char *ptr, size_t size, size_t nmemb, Flight_t *f) {
+  size_t len = size * nmemb;
+  if (f->replayable && f->body.size() + len > MAX_SHARED_BYTES) {
+    f->replayable = false;
+    std::string().swap(f->body);
+    f->headers.clear();
+  }
+  if (f->replayable) f->body.append(ptr, len);
+
+  for (auto it = f->sinks.begin(); it != f->sinks.end();) {
+    if (it->body(ptr, len) == len) {
+      ++it;
+      continue;
+    }
+    TtsHttp::Sink sink = *it;
+    it = f->sinks.erase(it);
+    sink.done(resultOf(f->easy, CURLE_WRITE_ERROR));
+  }
+  if (!f->sinks.empty()) return len;
+
+  /* no one is left to deliver to, so abort the transfer, and don't let anyone else join it */
+  auto it = f->loop->flights.find(f->key);
+  if (it != f->loop->flights.end() && it->second.get() == f) f->loop->flights.erase(it);
+  return 0;
+}
+
+/**
+ * the response headers worth keeping with a cached response: those describing the audio, along
+ * with the status lines.  Headers such as request ids and latencies belong to the request that
+ * fetched it, and would be reported as if they were a later requester's own.
+ */
+static std::vector<std::string> cacheable_headers(const std::vector<std::string>& headers) {
+  static const char* kept[] = {"content-type", "content-length", "content-encoding"};
+  std::vector<std::string> result;
+  for (const auto& header : headers) {
+    size_t colon = header.find(':');
+    bool keep = colon == std::string::npos;
+    for (size_t i = 0; !keep && i < sizeof(kept) / sizeof(kept[0]); i++) {
+      keep = colon == strlen(kept[i]) && 0 == strncasecmp(header.c_str(), kept[i], colon);
+    }
+    if (keep) result.push_back(header);
+  }
+  return result;
+}
+
+/* hands a shared transfer's outcome to its sinks, and caches the response if it was a success */
+static void complete(Loop_t *loop, std::shared_ptr<Flight_t> f, const TtsHttp::Result& result) {
+  auto it = loop->flights.find(f->key);
+  if (it != loop->flights.end() && it->second == f) loop->flights.erase(it);
+
+  if (result.code == CURLE_OK && result.responseCode == 200 && f->replayable && TtsCache::admits(f->body.size())) {
+    std::shared_ptr<TtsCache::Entry> entry = std::make_shared<TtsCache::Entry>();
+    entry->responseCode = result.responseCode;
+    if (result.contentType) entry->contentType = result.contentType;
+    entry->headers = cacheable_headers(f->headers);
+    entry->body.swap(f->body);
+    TtsCache::insert(f->key, entry);
+  }
+
+  std::list<TtsHttp::Sink> sinks;
+  sinks.swap(f->sinks);
+  for (auto& sink : sinks) sink.done(result);
+}
+
+static void remsock(int *f) {
+  if(f) {
+    free(f);
+  }
+}
+
+/* Called by asio when there is an action on a socket */
+static void event_cb(Loop_t *loop, curl_socket_t s, int action, const boost::system::error_code & error, int *fdp) {
+  int f = *fdp;
+
+  // Socket already POOL REMOVED.
+  if (f == CURL_POLL_REMOVE) {
+    remsock(fdp);
+    return;
+  }
+
+  if(loop->socket_map.find(s) == loop->socket_map.end()) {
+    return;
+  }
+
+  /* make sure the event matches what are wanted */
+  if(f == action || f == CURL_POLL_INOUT) {
+    if(error) {
+      action = CURL_CSELECT_ERR;
+    }
+    CURLMcode rc = curl_multi_socket_action(loop->multi, s, action, &loop->still_running);
+
+    mcode_test("event_cb: curl_multi_socket_action", rc);
+    check_multi_info(loop);
+
+    if(loop->still_running <= 0) {
+      loop->timer.cancel();
+    }
+
+    /* keep on watching.
+      * the socket may have been closed and/or fdp may have been changed
+      * in curl_multi_socket_action(), so check them both */
+    if(!error && loop->socket_map.find(s) != loop->socket_map.end() &&
+        (f == action || f == CURL_POLL_INOUT)) {
+      boost::asio::ip::tcp::socket *tcp_socket = loop->socket_map.find(s)->second;
+
+      if(action == CURL_POLL_IN) {
+        tcp_socket->async_read_some(boost::asio::null_buffers(),
+                                    boost::bind(&event_cb, loop, s,
+                                                action, boost::placeholders::_1, fdp));
+      }
+      if(action == CURL_POLL_OUT) {
+        tcp_socket->async_write_some(boost::asio::null_buffers(),
+                                      boost::bind(&event_cb, loop, s,
+                                                  action, boost::placeholders::_1, fdp));
+      }
+    }
+  }
+}
+
+/* socket functions */
+static void setsock(int *fdp, curl_socket_t s, CURL *e, int act, int oldact, Loop_t *loop) {
+  std::map<curl_socket_t, boost::asio::ip::tcp::socket *>::iterator it = loop->socket_map.find(s);
+
+  if(it == loop->socket_map.end()) {
+    return;
+  }
+
+  boost::asio::ip::tcp::socket * tcp_socket = it->second;
+
+  *fdp = act;
+
+  if(act == CURL_POLL_IN || act == CURL_POLL_INOUT) {
+    if(oldact != CURL_POLL_IN && oldact != CURL_POLL_INOUT) {
+      tcp_socket->async_read_some(boost::asio::null_buffers(),
+                                  boost::bind(&event_cb, loop, s,
+                                  CURL_POLL_IN, boost::placeholders::_1, fdp));
+    }
+  }
+  if(act == CURL_POLL_OUT || act == CURL_POLL_INOUT) {
+    if(oldact != CURL_POLL_OUT && oldact != CURL_POLL_INOUT) {
+      tcp_socket->async_write_some(boost::asio::null_buffers(),
+                                    boost::bind(&event_cb, loop, s,
+                                    CURL_POLL_OUT, boost::placeholders::_1, fdp));
+    }
+  }
+}
+
+static void addsock(curl_socket_t s, CURL *easy, int action, Loop_t *loop) {
+  /* fdp is used to store current action */
+  int *fdp = (int *) calloc(sizeof(int), 1);
+
+  setsock(fdp, s, easy, action, 0, loop);
+  curl_multi_assign(loop->multi, s, fdp);
+}
+
+static int sock_cb(CURL *e, curl_socket_t s, int what, void *cbp, void *sockp) {
+  Loop_t *loop = (Loop_t *) cbp;
+  int *actionp = (int *) sockp;
+
+  if(what == CURL_POLL_REMOVE) {
+    *actionp = what;
+  }
+  else {
+    if(!actionp) {
+      addsock(s, e, what, loop);
+    }
+    else {
+      setsock(actionp, s, e, what, *actionp, loop);
+    }
+  }
+  return 0;
+}
+
+/* Called by asio when our timeout expires */
+static void timer_cb(const boost::system::error_code & error, Loop_t *loop) {
+  if(!error) {
+    CURLMcode rc = curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &loop->still_running);
+    mcode_test("timer_cb: curl_multi_socket_action", rc);
+    check_multi_info(loop);
+  }
+}
+
+static int multi_timer_cb(CURLM *multi, long timeout_ms, Loop_t *loop) {
+
+  /* cancel running timer */
+  loop->timer.cancel();
+
+  if(timeout_ms >= 0) {
+    // from libcurl 7.88.1-10+deb12u4 does not allow call curl_multi_socket_action or curl_multi_perform in curl_multi callback directly
+    loop->timer.expires_from_now(boost::posix_time::millisec(timeout_ms ? timeout_ms : 1));
+    loop->timer.async_wait(boost::bind(&timer_cb, boost::placeholders::_1, loop));
+  }
+
+  return 0;
+}
+
+/* CURLOPT_OPENSOCKETFUNCTION */
+static curl_socket_t opensocket(void *clientp, curlsocktype purpose, struct curl_sockaddr *address) {
+  Origin_t *origin = (Origin_t *) clientp;
+  Loop_t *loop = origin->loop;
+  curl_socket_t sockfd = CURL_SOCKET_BAD;
+
+  /* restrict to IPv4 */
+  if(purpose == CURLSOCKTYPE_IPCXN && address->family == AF_INET) {
+    /* create a tcp socket object */
+    boost::asio::ip::tcp::socket *tcp_socket = new boost::asio::ip::tcp::socket(loop->io_service);
+
+    /* open it and get the native handle*/
+    boost::system::error_code ec;
+    tcp_socket->open(boost::asio::ip::tcp::v4(), ec);
+
+    if(ec) {
+      /* An error occurred */
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't open socket [%d][%s]\n", ec.value(), ec.message().c_str());
+      delete tcp_socket;
+    }
+    else {
+      sockfd = tcp_socket->native_handle();
+
+      /* save it for monitoring */
+      loop->socket_map.insert(std::pair<curl_socket_t, boost::asio::ip::tcp::socket *>(sockfd, tcp_socket));
+      origin->connections++;
+    }
+  }
+  return sockfd;
+}
+
+/* CURLOPT_CLOSESOCKETFUNCTION */
+static int close_socket(void *clientp, curl_socket_t item) {
+  Origin_t *origin = (Origin_t *) clientp;
+  Loop_t *loop = origin->loop;
+
+  std::map<curl_socket_t, boost::asio::ip::tcp::socket *>::iterator it = loop->socket_map.find(item);
+  if(it != loop->socket_map.end()) {
+    delete it->second;
+    loop->socket_map.erase(it);
+    origin->connections--;
+  }
+  return 0;
+}
+
+static void threadFunc(Loop_t *loop) {
+  /* to make sure the event loop doesn't terminate when there is no work to do */
+  boost::asio::io_service::work work(loop->io_service);
+
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "tts_http threadFunc - starting\n");
+
+  for(;;) {
+
+    try {
+      loop->io_service.run() ;
+      break ;
+    }
+    catch( std::exception& e) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "tts_http threadFunc - Error: %s\n", e.what());
+    }
+  }
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "tts_http threadFunc - ending\n");
+}
+
+// runs fn on the loop's thread and waits for it
+static void runOnLoop(Loop_t *loop, std::function<void()> fn) {
+  std::promise<void> done;
+  loop->io_service.post([&fn, &done]() {
+    fn();
+    done.set_value();
+  });
+  done.get_future().wait();
+}
+
+/* the loop serving a url's host, so that requests to a host share its connections */
+static Loop_t* loopFor(const std::string& url) {
+  size_t start = url.find("://");
+  start = start == std::string::npos ? 0 : start + 3;
+  size_t end = url.find_first_of(":/?#", start);
+  std::string host = url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+  return loops[std::hash<std::string>()(host) % loops.size()].get();
+}
+
+/* the origin a url is on, created the first time it is seen */
+static Origin_t* originFor(Loop_t *loop, const std::string& url) {
+  size_t start = url.find("://");
+  start = start == std::string::npos ? 0 : start + 3;
+  std::string key = url.substr(0, url.find_first_of("/?#", start));
+
+  auto it = loop->origins.find(key);
+  if (it == loop->origins.end()) {
+    Origin_t origin = {loop, key + "/", std::chrono::steady_clock::time_point(), false, 0, 0};
+    it = loop->origins.insert(std::make_pair(key, origin)).first;
+  }
+  return &it->second;
+}
+
+/* on the loop's thread: points the transfer's sockets at its origin, and hands it to curl */
+static void startTransfer(Loop_t *loop, Transfer_t *transfer) {
+  Origin_t *origin = originFor(loop, transfer->url);
+  if (!transfer->module.empty()) origin->lastUsed = std::chrono::steady_clock::now();
+
+  curl_easy_setopt(transfer->easy, CURLOPT_PRIVATE, transfer);
+  curl_easy_setopt(transfer->easy, CURLOPT_OPENSOCKETDATA, origin);
+  curl_easy_setopt(transfer->easy, CURLOPT_CLOSESOCKETDATA, origin);
+
+  CURLMcode rc = curl_multi_add_handle(loop->multi, transfer->easy);
+  if (mcode_test("startTransfer: curl_multi_add_handle", rc) != 0) {
+    TtsHttp::Result result = {};
+    result.code = CURLE_FAILED_INIT;
+    active--;
+    transfer->done(result);
+    delete transfer;
+    return;
+  }
+  loop->transfers.insert(transfer);
+
+  /* note that the add_handle() will set a time-out to trigger very soon so
+     that the necessary socket_action() call will be called by this app */
+}
+
+/**
+ * sends a HEAD request to the origin, so that its idle connection is not closed by the server or
+ * aged out by curl.  With fresh set the request opens a connection of its own, topping the pool up.
+ */
+static void ping(Loop_t *loop, Origin_t *origin, bool fresh) {
+  CURL *easy = TtsHttp::createEasyHandle(nullptr);
+  if (!easy) return;
+
+  const bool disable_http_2 = switch_true(std::getenv("DISABLE_HTTP2_FOR_TTS_STREAMING"));
+  curl_easy_setopt(easy, CURLOPT_URL, origin->url.c_str());
+  curl_easy_setopt(easy, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(easy, CURLOPT_TIMEOUT, WARM_TIMEOUT_SECS);
+  curl_easy_setopt(easy, CURLOPT_FRESH_CONNECT, fresh ? 1L : 0L);
+  curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, disable_http_2 ? CURL_HTTP_VERSION_1_1 : CURL_HTTP_VERSION_2_0);
+
+  Transfer_t *transfer = new Transfer_t();
+  transfer->url = origin->url;
+  transfer->easy = easy;
+  transfer->done = [easy](const TtsHttp::Result& result) {
+    if (result.code != CURLE_OK) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "tts_http: keepalive failed: %s\n", curl_easy_strerror(result.code));
+    }
+    curl_easy_cleanup(easy);
+  };
+  origin->pings++;
+  active++;
+  startTransfer(loop, transfer);
+}
+
+/**
+ * keeps warmConnections connections open to every origin used within the last warmIdleSecs, and to
+ * those pinned, pinging them every keepaliveSecs.  Runs on the loop's thread.
+ */
+static void warm_cb(const boost::system::error_code & error, Loop_t *loop) {
+  if (error) return;
+
+  auto now = std::chrono::steady_clock::now();
+  for (auto& it : loop->origins) {
+    Origin_t *origin = &it.second;
+    if (!origin->pinned && now - origin->lastUsed > std::chrono::seconds(warmIdleSecs)) continue;
+
+    /* pings to the connections we have share them, the rest each open a new one */
+    for (int i = 0; i < warmConnections; i++) ping(loop, origin, i >= origin->connections);
+  }
+
+  loop->warmTimer.expires_from_now(boost::posix_time::seconds(keepaliveSecs));
+  loop->warmTimer.async_wait(boost::bind(&warm_cb, boost::placeholders::_1, loop));
+}
+
+static void stop() {
+  for (auto& loop : loops) loop->io_service.stop();
+  for (auto& loop : loops) {
+    if (loop->thread.joinable()) loop->thread.join();
+
+    /* only keepalive requests can be left by now, once every module has abandoned its own */
+    for (Transfer_t *transfer : loop->transfers) {
+      curl_multi_remove_handle(loop->multi, transfer->easy);
+      curl_easy_cleanup(transfer->easy);
+      delete transfer;
+    }
+    active -= loop->transfers.size();
+    loop->transfers.clear();
+    curl_multi_cleanup(loop->multi);
+  }
+  loops.clear();
+
+  if (share && CURLSHE_OK != curl_share_cleanup(share)) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "tts_http: share handle still in use\n");
+  }
+  share = nullptr;
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "tts_http: stopped\n");
+}
+
+static bool start() {
+  int count = std::min(envInt("TTS_HTTP_THREADS", DEFAULT_THREADS, 1), MAX_THREADS);
+  int maxStreams = envInt("TTS_HTTP_MAX_STREAMS", DEFAULT_MAX_STREAMS, 1);
+  warmConnections = envInt("TTS_HTTP_WARM_CONNECTIONS", DEFAULT_WARM_CONNECTIONS, 0);
+  keepaliveSecs = envInt("TTS_HTTP_KEEPALIVE_SECS", DEFAULT_KEEPALIVE_SECS, 1);
+  warmIdleSecs = envInt("TTS_HTTP_WARM_IDLE_SECS", DEFAULT_WARM_IDLE_SECS, 0);
+
+  share = curl_share_init();
+  if (!share) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "curl_share_init() failed!\n");
+    return false;
+  }
+  curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+  for (int i = 0; i < count; i++) {
+    std::unique_ptr<Loop_t> loop(new Loop_t());
+    loop->multi = curl_multi_init();
+    if (!loop->multi) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "curl_multi_init() failed!\n");
+      stop();
+      return false;
+    }
+    curl_multi_setopt(loop->multi, CURLMOPT_SOCKETFUNCTION, sock_cb);
+    curl_multi_setopt(loop->multi, CURLMOPT_SOCKETDATA, loop.get());
+    curl_multi_setopt(loop->multi, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
+    curl_multi_setopt(loop->multi, CURLMOPT_TIMERDATA, loop.get());
+    curl_multi_setopt(loop->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(loop->multi, CURLMOPT_MAXCONNECTS, (long) std::max(MAX_CACHED_CONNECTIONS, warmConnections * 4));
+#if LIBCURL_VERSION_NUM >= 0x074300
+    curl_multi_setopt(loop->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, (long) maxStreams);
+#endif
+    loops.push_back(std::move(loop));
+  }
+
+  /* origins to keep warm from the start, before any request has been made to them */
+  const char* warmUrls = std::getenv("TTS_HTTP_WARM_URLS");
+  if (warmUrls) {
+    std::string urls(warmUrls);
+    size_t pos = 0;
+    while (pos < urls.size()) {
+      size_t end = std::min(urls.find(',', pos), urls.size());
+      std::string url = urls.substr(pos, end - pos);
+      if (!url.empty()) originFor(loopFor(url), url)->pinned = true;
+      pos = end + 1;
+    }
+  }
+
+  for (auto& loop : loops) {
+    if (warmConnections > 0) {
+      loop->warmTimer.expires_from_now(boost::posix_time::seconds(0));
+      loop->warmTimer.async_wait(boost::bind(&warm_cb, boost::placeholders::_1, loop.get()));
+    }
+    loop->thread = std::thread(threadFunc, loop.get());
+  }
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "tts_http: started %d threads, %d warm connections per origin, up to %d streams each\n",
+    count, warmConnections, maxStreams);
+  return true;
+}
+
+SWITCH_STANDARD_API(tts_http_function)
+{
+  TtsHttp::stats(stream);
+  return SWITCH_STATUS_SUCCESS;
+}
+
+switch_status_t TtsHttp::registerModule(const char* module, switch_loadable_module_interface_t **module_interface) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (loops.empty() && !start()) return SWITCH_STATUS_FALSE;
+  modules.insert(module);
+
+  /**
+   * freeswitch drops an api along with the module that added it, and won't take the same name
+   * twice, so each module adds its own, e.g. elevenlabs_tts_http for mod_elevenlabs_tts.  Every
+   * one of them reports on the whole engine, which so stays reachable while any module is loaded.
+   */
+  std::string name(module);
+  if (0 == name.compare(0, 4, "mod_")) name.erase(0, 4);
+  const char* apiName = apiNames.insert(name + "_http").first->c_str();
+  switch_api_interface_t *api_interface;
+  SWITCH_ADD_API(api_interface, apiName, "TTS streaming http engine metrics", tts_http_function, "");
+
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "tts_http: registered %s\n", module);
+  return SWITCH_STATUS_SUCCESS;
+}
+
+void TtsHttp::unregisterModule(const char* module) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (0 == modules.erase(module)) return;
+
+  /* the module's callbacks are about to be unloaded, so its transfers can't be left running */
+  std::string name(module);
+  for (auto& loop : loops) {
+    Loop_t *l = loop.get();
+    runOnLoop(l, [l, &name]() {
+      for (auto it = l->transfers.begin(); it != l->transfers.end();) {
+        Transfer_t *transfer = *it;
+        if (transfer->module != name) {
+          ++it;
+          continue;
+        }
+        curl_multi_remove_handle(l->multi, transfer->easy);
+        it = l->transfers.erase(it);
+        active--;
+        delete transfer;
+      }
+      for (auto it = l->flights.begin(); it != l->flights.end();) {
+        if (it->second->module == name) it = l->flights.erase(it);
+        else ++it;
+      }
+    });
+  }
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "tts_http: unregistered %s\n", module);
+
+  if (modules.empty()) stop();
+}
+
+static long transfer_timeout(const char* envVar) {
+  const char* val = envVar ? std::getenv(envVar) : nullptr;
+  if (!val || !*val) val = std::getenv("TTS_CURL_CONNECT_TIMEOUT");
+  return val && *val ? std::strtol(val, nullptr, 10) : DEFAULT_TIMEOUT_SECS;
+}
+
+CURL* TtsHttp::createEasyHandle(const char* timeoutEnvVar) {
+  CURL* easy = curl_easy_init();
+  if(!easy) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "curl_easy_init() failed!\n");
+    return nullptr ;
+  }
+
+  curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(easy, CURLOPT_USERAGENT, "jambonz/0.8.5");
+
+  // connect timeout of 3 seconds, and a total timeout configured per vendor
+  curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT_MS, 3000L);
+  curl_easy_setopt(easy, CURLOPT_TIMEOUT, transfer_timeout(timeoutEnvVar));
+
+  curl_easy_setopt(easy, CURLOPT_SHARE, share);
+  curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+
+  /* sockets are opened on, and watched by, the loop the transfer is added to */
+  curl_easy_setopt(easy, CURLOPT_OPENSOCKETFUNCTION, opensocket);
+  curl_easy_setopt(easy, CURLOPT_CLOSESOCKETFUNCTION, close_socket);
+
+  return easy ;
+}
+
+void TtsHttp::addTransfer(const char* module, const std::string& url, CURL* easy, Callback_t done) {
+  if (loops.empty()) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "tts_http: %s added a transfer but the engine is not running\n", module);
+    TtsHttp::Result result = {};
+    result.code = CURLE_FAILED_INIT;
+    done(result);
+    return;
+  }
+
+  Loop_t *loop = loopFor(url);
+  Transfer_t *transfer = new Transfer_t();
+  transfer->module = module;
+  transfer->url = url;
+  transfer->easy = easy;
+  transfer->done = done;
+
+  /* the multi handle, and the origins, are only ever touched from the loop's thread */
+  active++;
+  loop->io_service.post([loop, transfer]() { startTransfer(loop, transfer); });
+}
+
+void TtsHttp::addSharedTransfer(const char* module, const std::string& url, const std::string& body,
+  const struct curl_slist* headers, CURL* easy, const Sink& sink) {
+  /* the request headers carry the credentials, so requests made with different ones never share a response */
+  std::vector<std::string> headerLines;
+  for (const struct curl_slist *h = headers; h; h = h->next) headerLines.push_back(h->data);
+  std::string key = TtsCache::key(module, url, headerLines, body);
+
+  /* a cached response is replayed right here, without going near the network */
+  TtsCache::EntryPtr entry = TtsCache::lookup(key);
+  if (entry) {
+    TtsHttp::Result result = {};
+    result.code = replay(sink, entry->headers, entry->body) ? CURLE_OK : CURLE_WRITE_ERROR;
+    result.responseCode = entry->responseCode;
+    result.contentType = entry->contentType.empty() ? nullptr : entry->contentType.c_str();
+    result.reused = true;
+    count(module, &ModuleStats_t::hits);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "tts_http: %s cache hit %s\n", module, key.c_str());
+    sink.done(result);
+    return;
+  }
+
+  if (loops.empty()) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "tts_http: %s added a transfer but the engine is not running\n", module);
+    TtsHttp::Result result = {};
+    result.code = CURLE_FAILED_INIT;
+    sink.done(result);
+    return;
+  }
+
+  /* our own copy of the request, since the requester may be gone before the response is */
+  CURL *copy = curl_easy_duphandle(easy);
+  if (!copy) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "curl_easy_duphandle() failed!\n");
+    TtsHttp::Result result = {};
+    result.code = CURLE_OUT_OF_MEMORY;
+    sink.done(result);
+    return;
+  }
+  struct curl_slist *hdr_list = nullptr;
+  for (const auto& header : headerLines) hdr_list = curl_slist_append(hdr_list, header.c_str());
+
+  Loop_t *loop = loopFor(url);
+  std::string name(module);
+  active++;
+  loop->io_service.post([loop, name, url, key, body, copy, hdr_list, sink]() {
+    auto it = loop->flights.find(key);
+    if (it != loop->flights.end() && it->second->replayable) {
+      Flight_t *f = it->second.get();
+      curl_easy_cleanup(copy);
+      curl_slist_free_all(hdr_list);
+      active--;
+      count(name, &ModuleStats_t::shared);
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "tts_http: %s joined transfer %s\n", name.c_str(), key.c_str());
+
+      if (replay(sink, f->headers, f->body)) f->sinks.push_back(sink);
+      else sink.done(resultOf(f->easy, CURLE_WRITE_ERROR));
+      return;
+    }
+
+    std::shared_ptr<Flight_t> f = std::make_shared<Flight_t>();
+    f->loop = loop;
+    f->module = name;
+    f->key = key;
+    f->easy = copy;
+    f->hdr_list = hdr_list;
+    f->replayable = true;
+    f->sinks.push_back(sink);
+    loop->flights[key] = f;
+
+    curl_easy_setopt(copy, CURLOPT_POSTFIELDSIZE, (long) body.size());
+    curl_easy_setopt(copy, CURLOPT_COPYPOSTFIELDS, body.c_str());
+    curl_easy_setopt(copy, CURLOPT_HTTPHEADER, hdr_list);
+    curl_easy_setopt(copy, CURLOPT_ERRORBUFFER, NULL);
+    curl_easy_setopt(copy, CURLOPT_HEADERFUNCTION, flight_header);
+    curl_easy_setopt(copy, CURLOPT_HEADERDATA, f.get());
+    curl_easy_setopt(copy, CURLOPT_WRITEFUNCTION, flight_body);
+    curl_easy_setopt(copy, CURLOPT_WRITEDATA, f.get());
+
+    Transfer_t *transfer = new Transfer_t();
+    transfer->module = name;
+    transfer->url = url;
+    transfer->easy = copy;
+    transfer->done = [loop, f](const TtsHttp::Result& result) { complete(loop, f, result); };
+    startTransfer(loop, transfer);
+  });
+}
+
+void TtsHttp::stats(switch_stream_handle_t *stream) {
+  size_t threads;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    threads = loops.size();
+  }
+  stream->write_function(stream, "threads: %lu\nactive: %lu\n", threads, active.load());
+
+  TtsCache::Stats c = TtsCache::stats();
+  stream->write_function(stream,
+    "cache: entries %lu, bytes %lu of %lu, files %lu, disk_bytes %lu of %lu, hits %lu, disk_hits %lu, misses %lu, inserts %lu, evictions %lu\n",
+    c.entries, c.bytes, c.budget, c.files, c.diskBytes, c.diskBudget, c.hits, c.diskHits, c.misses, c.inserts, c.evictions);
+
+  /* the origins are read on their loops' threads */
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& loop : loops) {
+      Loop_t *l = loop.get();
+      runOnLoop(l, [l, stream]() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto& it : l->origins) {
+          const Origin_t& o = it.second;
+          bool warm = warmConnections > 0 && (o.pinned || now - o.lastUsed <= std::chrono::seconds(warmIdleSecs));
+          stream->write_function(stream, "origin %s: connections %d, %s, keepalive pings %lu\n",
+            it.first.c_str(), o.connections, warm ? "warm" : "cold", o.pings);
+        }
+      });
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(statsMutex);
+  for (auto& it : moduleStats) {
+    const ModuleStats_t& s = it.second;
+    double n = std::max<double>(s.transfers, 1);
+    stream->write_function(stream,
+      "%s: transfers %lu, failures %lu, reused %lu, cache_hits %lu, shared %lu, avg_dns_ms %.1f, avg_connect_ms %.1f, avg_tls_ms %.1f, "
+      "avg_first_byte_ms %.1f, max_first_byte_ms %.1f, avg_total_ms %.1f\n",
+      it.first.c_str(), s.transfers, s.failures, s.reused, s.hits, s.shared, s.nameLookup / n, s.connect / n, s.appConnect / n,
+      s.firstByte / n, s.maxFirstByte, s.total / n);
+  }
+}
@@ -0,0 +1,82 @@
+#ifndef __TTS_HTTP_H__
+#define __TTS_HTTP_H__
+
+#include <switch.h>
+#include <curl/curl.h>
+#include <functional>
+#include <string>
+
+/**
+ * streaming HTTP engine shared by the curl-based TTS modules.
+ *
+ * Transfers run on TTS_HTTP_THREADS event loops (default 1), each driving a curl multi handle
+ * of its own.  Requests to the same host always go to the same loop, so they reuse its
+ * connections, multiplexed over HTTP/2 where the server allows, whichever module makes them.
+ * DNS lookups and TLS sessions are shared by all the loops.  Every transfer is timed the same
+ * way, and the totals for each module are reported by each module's <vendor>_tts_http api.
+ *
+ * Connections to the hosts in use are kept warm between requests, topped up to
+ * TTS_HTTP_WARM_CONNECTIONS and pinged every TTS_HTTP_KEEPALIVE_SECS, so that the first request
+ * after a quiet spell does not pay for DNS, TCP and TLS before its first byte.
+ *
+ * Shared transfers go through the TtsCache: a request whose response is cached is answered at
+ * once, without touching the network, and identical requests made while one is in flight are
+ * answered by that one transfer rather than each making their own.
+ *
+ * The engine starts when the first module registers and stops when the last one unregisters.
+ */
+class TtsHttp {
+public:
+  /* how a transfer went; times are in seconds from the start of the transfer, as curl reports them */
+  struct Result {
+    CURLcode code;
+    long responseCode;
+    const char* contentType;  // valid during the callback only
+    double nameLookup;
+    double connect;
+    double appConnect;        // TLS handshake complete
+    double startTransfer;     // first byte of the response
+    double total;
+    bool reused;              // sent over a connection that was already open
+  };
+  typedef std::function<void(const Result&)> Callback_t;
+
+  /**
+   * where a shared transfer delivers its response, in the shape of curl's header and write
+   * callbacks.  Returning less than it was given from body stops delivery to this sink, which is
+   * then done with CURLE_WRITE_ERROR, as a curl transfer would be.
+   */
+  struct Sink {
+    std::function<size_t(char*, size_t)> header;
+    std::function<size_t(char*, size_t)> body;
+    Callback_t done;
+  };
+
+  // starts the engine if this is the first module to register, and adds the module's <vendor>_tts_http api
+  static switch_status_t registerModule(const char* module, switch_loadable_module_interface_t **module_interface);
+
+  // abandons the module's transfers still in progress, and stops the engine once no module is left
+  static void unregisterModule(const char* module);
+
+  // an easy handle with the options common to all TTS requests; timeoutEnvVar overrides TTS_CURL_CONNECT_TIMEOUT
+  static CURL* createEasyHandle(const char* timeoutEnvVar);
+
+  /**
+   * starts a transfer on the loop serving the url's host.  done is called on that loop once the
+   * transfer is complete and the handle has been removed, so the caller may clean it up there.
+   */
+  static void addTransfer(const char* module, const std::string& url, CURL* easy, Callback_t done);
+
+  /**
+   * like addTransfer, but the response is shared with identical requests and cached.  A cached
+   * response is delivered to the sink before this returns; otherwise delivery is on the loop
+   * serving the url's host.  The engine makes the request with copies of easy, its headers and
+   * body, so the caller may clean them up as soon as the sink is done.
+   */
+  static void addSharedTransfer(const char* module, const std::string& url, const std::string& body,
+    const struct curl_slist* headers, CURL* easy, const Sink& sink);
+
+  static void stats(switch_stream_handle_t *stream);
+};
+
+#endif
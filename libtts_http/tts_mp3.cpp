@@ -0,0 +1,81 @@
+#include "tts_mp3.h"
+#include <switch.h>
+
+#include <chrono>
+#include <algorithm>
+
+/* the least a buffer grows by when a frame doesn't fit */
+#define BUFFER_GROW_SIZE (8192)
+
+TtsMp3Decoder* TtsMp3Decoder::create(int sampleRate) {
+  int mhError = 0;
+  mpg123_handle *mh = mpg123_new("auto", &mhError);
+  if (!mh) {
+    const char *mhErr = mpg123_plain_strerror(mhError);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Error allocating mpg123 handle! %s\n", switch_str_nil(mhErr));
+    return nullptr;
+  }
+
+  const char* failed = nullptr;
+  if (mpg123_open_feed(mh) != MPG123_OK) failed = "Error mpg123_open_feed!\n";
+  else if (mpg123_format_all(mh) != MPG123_OK) failed = "Error mpg123_format_all!\n";
+  else if (mpg123_param(mh, MPG123_FLAGS, MPG123_MONO_MIX, 0) != MPG123_OK) failed = "Error forcing single channel!\n";
+  else if (mpg123_param(mh, MPG123_FORCE_RATE, sampleRate, 0) != MPG123_OK) failed = "Error mpg123_param!\n";
+  if (failed) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "%s", failed);
+    mpg123_delete(mh);
+    return nullptr;
+  }
+  return new TtsMp3Decoder(mh);
+}
+
+TtsMp3Decoder::~TtsMp3Decoder() {
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "TtsMp3Decoder: decoded %lu samples in %lu us\n", _decodedSamples, _decodeUs);
+  mpg123_close(_mh);
+  mpg123_delete(_mh);
+}
+
+void TtsMp3Decoder::decode(const uint8_t* data, size_t len, boost::circular_buffer<uint16_t>& buffer, FILE* pcmFile) {
+  int mp3err = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  if (mpg123_feed(_mh, data, len) != MPG123_OK) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Error feeding data to mpg123\n");
+    return;
+  }
+
+  for (;;) {
+    size_t usedlen = 0;
+    off_t frame_offset;
+    unsigned char* audio;
+
+    int decode_status = mpg123_decode_frame(_mh, &frame_offset, &audio, &usedlen);
+    if (decode_status == MPG123_NEW_FORMAT) continue;
+    if (decode_status == MPG123_DONE || decode_status == MPG123_NEED_MORE) break;
+    if (decode_status != MPG123_OK) {
+      if (++mp3err >= 5) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Decoder Error!\n");
+        break;
+      }
+      continue;
+    }
+    mp3err = 0;
+
+    uint16_t *frame = reinterpret_cast<uint16_t*>(audio);
+    size_t samples = usedlen / sizeof(uint16_t);
+
+    /* cache same data to avoid streaming and cached audio quality is different*/
+    if (pcmFile) fwrite(frame, sizeof(uint16_t), samples, pcmFile);
+
+    // Resize the buffer if necessary
+    if (buffer.capacity() - buffer.size() < samples) {
+      //TODO: if buffer exceeds some max size, return CURL_WRITEFUNC_ERROR to abort the transfer
+      buffer.set_capacity(buffer.size() + std::max(samples, (size_t)BUFFER_GROW_SIZE));
+    }
+
+    /* Push the data into the buffer */
+    buffer.insert(buffer.end(), frame, frame + samples);
+    _decodedSamples += samples;
+  }
+  _decodeUs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,40 @@
+#ifndef __TTS_MP3_H__
+#define __TTS_MP3_H__
+
+#include <cstdio>
+#include <cstdint>
+#include <mpg123.h>
+#include <boost/circular_buffer.hpp>
+
+/**
+ * streaming mp3 decoder shared by the modules whose vendors answer in mp3.
+ *
+ * Audio is fed in as it arrives and decoded a frame at a time, mixed down to mono at the rate
+ * asked for, each frame copied straight from mpg123's output into the caller's buffer.  Callers
+ * call mpg123_init when they load, and serialize calls to decode with the lock guarding the buffer.
+ */
+class TtsMp3Decoder {
+public:
+  // returns nullptr, having logged why, if mpg123 can't be set up
+  static TtsMp3Decoder* create(int sampleRate);
+  ~TtsMp3Decoder();
+
+  // decodes what it can of a chunk, appending it to buffer, growing that as needed, and to pcmFile if there is one
+  void decode(const uint8_t* data, size_t len, boost::circular_buffer<uint16_t>& buffer, FILE* pcmFile);
+
+  uint64_t decodedSamples() const { return _decodedSamples; }
+  uint64_t decodeUs() const { return _decodeUs; }
+
+  // no copying
+  TtsMp3Decoder(const TtsMp3Decoder&) = delete;
+  void operator=(const TtsMp3Decoder&) = delete;
+
+private:
+  explicit TtsMp3Decoder(mpg123_handle* mh) : _mh(mh), _decodedSamples(0), _decodeUs(0) {}
+
+  mpg123_handle* _mh;
+  uint64_t _decodedSamples;
+  uint64_t _decodeUs;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include "tts_prebuffer.h"
+#include <switch.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+#define DEFAULT_PREBUFFER_MS (40)
+#define DEFAULT_PREBUFFER_MAX_MS (400)
+
+typedef struct
+{
+  int minMs;
+  int maxMs;
+  bool adaptive;
+} PrebufferConfig_t;
+
+static const PrebufferConfig_t& config() {
+  static const PrebufferConfig_t c = []() {
+    const char* min = std::getenv("TTS_PREBUFFER_MS");
+    const char* max = std::getenv("TTS_PREBUFFER_MAX_MS");
+    const char* adaptive = std::getenv("TTS_PREBUFFER_ADAPTIVE");
+    PrebufferConfig_t c;
+    c.minMs = min ? std::max(atoi(min), 0) : DEFAULT_PREBUFFER_MS;
+    c.maxMs = std::max(max ? atoi(max) : DEFAULT_PREBUFFER_MAX_MS, c.minMs);
+    c.adaptive = !adaptive || switch_true(adaptive);
+    return c;
+  }();
+  return c;
+}
+
+TtsPrebuffer::TtsPrebuffer(int sampleRate) : _sampleRate(sampleRate), _playing(false), _gaps(0), _gapMs(0), _gapDevMs(0) {}
+
+void TtsPrebuffer::arrived() {
+  auto now = std::chrono::steady_clock::now();
+  if (_lastArrival != std::chrono::steady_clock::time_point()) {
+    double gap = std::chrono::duration<double, std::milli>(now - _lastArrival).count();
+
+    /* smoothed as in RFC 6298 */
+    if (0 == _gaps++) {
+      _gapMs = gap;
+      _gapDevMs = gap / 2;
+    }
+    else {
+      _gapDevMs = 0.75 * _gapDevMs + 0.25 * std::fabs(_gapMs - gap);
+      _gapMs = 0.875 * _gapMs + 0.125 * gap;
+    }
+  }
+  _lastArrival = now;
+}
+
+int TtsPrebuffer::thresholdMs() const {
+  const PrebufferConfig_t& c = config();
+  if (!c.adaptive || 0 == _gaps) return c.minMs;
+  return std::min(std::max(static_cast<int>(_gapMs + 4 * _gapDevMs), c.minMs), c.maxMs);
+}
+
+bool TtsPrebuffer::ready(size_t buffered, bool complete) {
+  if (complete) return true;
+  if (0 == buffered) {
+    if (_playing) switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "TtsPrebuffer: underrun, rebuffering to %d ms\n", thresholdMs());
+    _playing = false;
+    return false;
+  }
+  if (!_playing && buffered * 1000 < static_cast<size_t>(thresholdMs()) * _sampleRate) return false;
+
+  if (!_playing) switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "TtsPrebuffer: starting with %lu ms buffered, threshold %d ms\n",
+    buffered * 1000 / _sampleRate, thresholdMs());
+  _playing = true;
+  return true;
+}
@@ -0,0 +1,39 @@
+#ifndef __TTS_PREBUFFER_H__
+#define __TTS_PREBUFFER_H__
+
+#include <chrono>
+#include <cstddef>
+
+/**
+ * decides when a TTS stream has buffered enough audio to start playing without running dry.
+ *
+ * Playback waits for TTS_PREBUFFER_MS of audio (default 40), or for the whole response if it is
+ * shorter.  Unless TTS_PREBUFFER_ADAPTIVE is false, the threshold then follows the gaps between
+ * the vendor's chunks: their smoothed mean plus four times their smoothed deviation, as TCP
+ * estimates a retransmission timeout, capped at TTS_PREBUFFER_MAX_MS (default 400).  Should the
+ * buffer run dry anyway, playback waits for the threshold again before carrying on.
+ *
+ * Not thread safe: callers hold the lock that guards the buffer itself.
+ */
+class TtsPrebuffer {
+public:
+  explicit TtsPrebuffer(int sampleRate);
+
+  // records a chunk of audio arriving from the vendor
+  void arrived();
+
+  // whether to play from a buffer holding this many samples, complete once the response has all arrived
+  bool ready(size_t buffered, bool complete);
+
+  int thresholdMs() const;
+
+private:
+  int _sampleRate;
+  bool _playing;
+  int _gaps;
+  double _gapMs;
+  double _gapDevMs;
+  std::chrono::steady_clock::time_point _lastArrival;
+};
+
+#endif
@@ -1,4 +1,6 @@
 #include <cassert>
+#include <vector>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 
@@ -7,11 +9,76 @@
 
 /* discard incoming text messages over the socket that are longer than this */
 #define MAX_RECV_BUF_SIZE (65 * 1024 * 10)
-#define RECV_BUF_REALLOC_SIZE (8 * 1024)
+#define RECV_BUF_INITIAL_SIZE (8 * 1024)
+/* idle receive buffers kept by each service thread, and the largest one worth keeping */
+#define MAX_POOLED_RECV_BUFS (4)
+#define MAX_POOLED_RECV_BUF_SIZE (64 * 1024)
+
+/* audio is sent as text frames of the form {"audio_data":"<base64>"} */
+#define AUDIO_JSON_PREFIX "{\"audio_data\":\""
+#define AUDIO_JSON_SUFFIX "\"}"
 
 using namespace assemblyai;
 
 namespace {
+  /**
+   * fragmented text messages are reassembled into buffers borrowed from a small per-thread pool,
+   * so that once the pool is warm receiving a message costs no allocations
+   */
+  class RecvBufferPool {
+  public:
+    ~RecvBufferPool() {
+      for (auto& b : m_free) free(b.first);
+    }
+
+    // hands out a buffer with room for minLen bytes plus a terminating NUL; returns its capacity, or 0 if none
+    size_t acquire(uint8_t** pbuf, size_t minLen) {
+      size_t capacity = 0;
+      *pbuf = nullptr;
+      if (!m_free.empty()) {
+        *pbuf = m_free.back().first;
+        capacity = m_free.back().second;
+        m_free.pop_back();
+      }
+      if (capacity > minLen) return capacity;
+      return grow(pbuf, capacity, minLen);
+    }
+
+    // grows a buffer to hold minLen bytes plus a terminating NUL, or frees it if that would exceed MAX_RECV_BUF_SIZE
+    size_t grow(uint8_t** pbuf, size_t capacity, size_t minLen) {
+      if (minLen >= MAX_RECV_BUF_SIZE) {
+        free(*pbuf);
+        *pbuf = nullptr;
+        return 0;
+      }
+      size_t newCapacity = std::max(capacity, (size_t) RECV_BUF_INITIAL_SIZE);
+      while (newCapacity <= minLen) newCapacity <<= 1;
+      newCapacity = std::min(newCapacity, (size_t) MAX_RECV_BUF_SIZE);
+
+      uint8_t* buf = (uint8_t*) realloc(*pbuf, newCapacity);
+      if (nullptr == buf) {
+        free(*pbuf);
+        *pbuf = nullptr;
+        return 0;
+      }
+      *pbuf = buf;
+      return newCapacity;
+    }
+
+    void release(uint8_t* buf, size_t capacity) {
+      if (m_free.size() < MAX_POOLED_RECV_BUFS && capacity <= MAX_POOLED_RECV_BUF_SIZE) {
+        m_free.push_back(std::make_pair(buf, capacity));
+      }
+      else free(buf);
+    }
+
+  private:
+    std::vector<std::pair<uint8_t*, size_t> > m_free;
+  };
+
+  // a connection is only ever serviced by one thread, so its messages are always assembled from that thread's pool
+  thread_local RecvBufferPool recvBufferPool;
+
   static const char *requestedTcpKeepaliveSecs = std::getenv("MOD_AUDIO_FORK_TCP_KEEPALIVE_SECS");
   static int nTcpKeepaliveSecs = requestedTcpKeepaliveSecs ? ::atoi(requestedTcpKeepaliveSecs) : 55;
 }
@@ -72,7 +139,7 @@ int AudioPipe::lws_callback(struct lws *wsi,
         lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_CONNECTION_ERROR: %s, response status %d\n", in ? (char *)in : "(null)", rc); 
         if (ap) {
           ap->m_state = LWS_CLIENT_FAILED;
-          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECT_FAIL, (char *) in, ap->isFinished());
+          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECT_FAIL, (char *) in, in ? strlen((char *) in) : 0, ap->isFinished());
         }
         else {
           lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_CONNECTION_ERROR unable to find wsi %p..\n", wsi); 
@@ -87,7 +154,7 @@ int AudioPipe::lws_callback(struct lws *wsi,
           *ppAp = ap;
           ap->m_vhd = vhd;
           ap->m_state = LWS_CLIENT_CONNECTED;
-          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECT_SUCCESS, NULL,  ap->isFinished());
+          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECT_SUCCESS, NULL, 0, ap->isFinished());
         }
         else {
           lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_ESTABLISHED %s unable to find wsi %p..\n", ap->m_uuid.c_str(), wsi); 
@@ -105,12 +172,12 @@ int AudioPipe::lws_callback(struct lws *wsi,
           // closed by us
 
           lwsl_debug("%s socket closed by us\n", ap->m_uuid.c_str());
-          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL,  ap->isFinished());
+          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL, 0, ap->isFinished());
         }
         else if (ap->m_state == LWS_CLIENT_CONNECTED) {
           // closed by far end
           lwsl_info("%s socket closed by far end\n", ap->m_uuid.c_str());
-          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECTION_DROPPED, NULL,  ap->isFinished());
+          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECTION_DROPPED, NULL, 0, ap->isFinished());
         }
         ap->m_state = LWS_CLIENT_DISCONNECTED;
         ap->setClosed();
@@ -137,29 +204,21 @@ int AudioPipe::lws_callback(struct lws *wsi,
         }
 
         if (lws_is_first_fragment(wsi)) {
-          // allocate a buffer for the entire chunk of memory needed
+          // borrow a buffer big enough for the entire message, if lws knows how big it is
           assert(nullptr == ap->m_recv_buf);
-          ap->m_recv_buf_len = len + lws_remaining_packet_payload(wsi);
-          ap->m_recv_buf = (uint8_t*) malloc(ap->m_recv_buf_len);
+          ap->m_recv_buf_len = recvBufferPool.acquire(&ap->m_recv_buf, len + lws_remaining_packet_payload(wsi));
           ap->m_recv_buf_ptr = ap->m_recv_buf;
-        }
-
-        size_t write_offset = ap->m_recv_buf_ptr - ap->m_recv_buf;
-        size_t remaining_space = ap->m_recv_buf_len - write_offset;
-        if (remaining_space < len) {
-          lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE buffer realloc needed.\n");
-          size_t newlen = ap->m_recv_buf_len + RECV_BUF_REALLOC_SIZE;
-          if (newlen > MAX_RECV_BUF_SIZE) {
-            free(ap->m_recv_buf);
-            ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
-            ap->m_recv_buf_len = 0;
-            lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, truncating message.\n");
+          if (nullptr == ap->m_recv_buf) {
+            lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, discarding message.\n");
           }
-          else {
-            ap->m_recv_buf = (uint8_t*) realloc(ap->m_recv_buf, newlen);
-            if (nullptr != ap->m_recv_buf) {
-              ap->m_recv_buf_len = newlen;
-              ap->m_recv_buf_ptr = ap->m_recv_buf + write_offset;
+        }
+        else if (nullptr != ap->m_recv_buf) {
+          size_t write_offset = ap->m_recv_buf_ptr - ap->m_recv_buf;
+          if (ap->m_recv_buf_len - write_offset <= len) {
+            ap->m_recv_buf_len = recvBufferPool.grow(&ap->m_recv_buf, ap->m_recv_buf_len, write_offset + len);
+            ap->m_recv_buf_ptr = ap->m_recv_buf ? ap->m_recv_buf + write_offset : nullptr;
+            if (nullptr == ap->m_recv_buf) {
+              lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, truncating message.\n");
             }
           }
         }
@@ -170,11 +229,11 @@ int AudioPipe::lws_callback(struct lws *wsi,
             ap->m_recv_buf_ptr += len;
           }
           if (lws_is_final_fragment(wsi)) {
-            if (nullptr != ap->m_recv_buf) {
-              std::string msg((char *)ap->m_recv_buf, ap->m_recv_buf_ptr - ap->m_recv_buf);
-              ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::MESSAGE, msg.c_str(),  ap->isFinished());
-              if (nullptr != ap->m_recv_buf) free(ap->m_recv_buf);
-            }
+            // hand the message to the callback in place, NUL-terminated for consumers that treat it as a string
+            size_t msg_len = ap->m_recv_buf_ptr - ap->m_recv_buf;
+            ap->m_recv_buf[msg_len] = '\0';
+            ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::MESSAGE, (const char *) ap->m_recv_buf, msg_len, ap->isFinished());
+            recvBufferPool.release(ap->m_recv_buf, ap->m_recv_buf_len);
             ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
             ap->m_recv_buf_len = 0;
           }
@@ -223,13 +282,15 @@ int AudioPipe::lws_callback(struct lws *wsi,
           if (ap->m_audio_buffer_write_offset > LWS_PRE) {
             size_t datalen = ap->m_audio_buffer_write_offset - LWS_PRE;
             if (datalen >= 1600) {
-              std::ostringstream oss;
-              oss << "{\"audio_data\":\"" << drachtio::base64_encode((unsigned char const *) ap->m_audio_buffer + LWS_PRE, datalen) << "\"}";
-              std::string result = oss.str();
-              uint8_t buf[result.length() + LWS_PRE];
-              memcpy(buf + LWS_PRE,result.c_str(), result.length());
-              int n = result.length();
-              int m = lws_write(wsi, buf + LWS_PRE, n, LWS_WRITE_TEXT);
+              // base64 encode straight into the frame, behind the headroom lws_write needs
+              uint8_t* p = ap->m_audio_json.data() + LWS_PRE;
+              memcpy(p, AUDIO_JSON_PREFIX, sizeof(AUDIO_JSON_PREFIX) - 1);
+              p += sizeof(AUDIO_JSON_PREFIX) - 1;
+              p += drachtio::base64_encode((unsigned char const *) ap->m_audio_buffer + LWS_PRE, datalen, (char *) p);
+              memcpy(p, AUDIO_JSON_SUFFIX, sizeof(AUDIO_JSON_SUFFIX) - 1);
+              p += sizeof(AUDIO_JSON_SUFFIX) - 1;
+              int n = p - (ap->m_audio_json.data() + LWS_PRE);
+              int m = lws_write(wsi, ap->m_audio_json.data() + LWS_PRE, n, LWS_WRITE_TEXT);
               if (m < n) {
                 lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_WRITEABLE attemped to send %lu bytes only sent %d wsi %p..\n", 
                   n, m, wsi); 
@@ -457,10 +518,12 @@ AudioPipe::AudioPipe(const char* uuid, const char* bugname, const char* host, un
   m_state(LWS_CLIENT_IDLE), m_wsi(nullptr), m_vhd(nullptr), m_apiKey(apiKey), m_callback(callback) {
 
   m_audio_buffer = new uint8_t[m_audio_buffer_max_len];
+  m_audio_json.resize(LWS_PRE + sizeof(AUDIO_JSON_PREFIX) - 1 +
+    drachtio::base64_encoded_size(m_audio_buffer_max_len - LWS_PRE) + sizeof(AUDIO_JSON_SUFFIX) - 1);
 }
 AudioPipe::~AudioPipe() {
   if (m_audio_buffer) delete [] m_audio_buffer;
-  if (m_recv_buf) delete [] m_recv_buf;
+  if (m_recv_buf) free(m_recv_buf);
 }
 
 void AudioPipe::connect(void) {
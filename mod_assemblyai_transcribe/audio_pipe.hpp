@@ -8,6 +8,7 @@
 #include <queue>
 #include <unordered_map>
 #include <thread>
+#include <vector>
 
 #include <libwebsockets.h>
 
@@ -31,7 +32,7 @@ public:
     MESSAGE
   };
   typedef void (*log_emit_function)(int level, const char *line);
-  typedef void (*notifyHandler_t)(const char *sessionId,const char* bugname, NotifyEvent_t event, const char* message, bool finished);
+  typedef void (*notifyHandler_t)(const char *sessionId,const char* bugname, NotifyEvent_t event, const char* message, size_t message_len, bool finished);
 
   struct lws_per_vhost_data {
     struct lws_context *context;
@@ -127,6 +128,7 @@ private:
   size_t m_audio_buffer_max_len;
   size_t m_audio_buffer_write_offset;
   size_t m_audio_buffer_min_freespace;
+  std::vector<uint8_t> m_audio_json;
   uint8_t* m_recv_buf;
   uint8_t* m_recv_buf_ptr;
   size_t m_recv_buf_len;
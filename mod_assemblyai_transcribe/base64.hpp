@@ -5,6 +5,10 @@
     done by Peter Thorson (webmaster@zaphoyd.com) in 2012. All modifications to
     the code are redistributed under the same license as the original, which is
     listed below.
+
+    The decoder and encoder have since been rewritten for drachtio to work on
+    caller-provided buffers, using lookup tables and, where the build enables
+    it, AVX2 kernels.
     ******
 
    base64.cpp and base64.h
@@ -37,6 +41,12 @@
 #define _BASE64_HPP_
 
 #include <string>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(USE_AVX2)
+#include <immintrin.h>
+#endif
 
 namespace drachtio {
 
@@ -45,69 +55,187 @@ static std::string const base64_chars =
              "abcdefghijklmnopqrstuvwxyz"
              "0123456789+/";
 
+// maps a character to its 6-bit value, or 0xff if it is not in the base64 alphabet
+static const unsigned char base64_values[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
 /// Test whether a character is a valid base64 character
 /**
  * @param c The character to test
  * @return true if c is a valid base64 character
  */
 static inline bool is_base64(unsigned char c) {
-    return (c == 43 || // +
-           (c >= 47 && c <= 57) || // /-9
-           (c >= 65 && c <= 90) || // A-Z
-           (c >= 97 && c <= 122)); // a-z
+    return 0xff != base64_values[c];
 }
 
-/// Encode a char buffer into a base64 string
+/// Number of characters base64_encode writes for len bytes of input
+inline size_t base64_encoded_size(size_t len) {
+    return (len + 2) / 3 * 4;
+}
+
+/// Size of buffer base64_decode needs for len characters of input
+/**
+ * This is an upper bound; the vectorized decoder may scribble on the bytes
+ * past the decoded data, up to this size.
+ */
+inline size_t base64_decoded_size(size_t len) {
+    return (len + 3) / 4 * 3;
+}
+
+namespace detail {
+
+#if defined(USE_AVX2)
+
+// turns 32 base64 characters into their 6-bit values; returns false if any are outside the alphabet
+static inline bool base64_translate_avx2(__m256i& str) {
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+    __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    if (!_mm256_testz_si256(lo, hi)) return false;
+
+    __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+    __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+    str = _mm256_add_epi8(str, roll);
+    return true;
+}
+
+// decodes 32 characters at a time into 24 bytes, stopping at the first block holding padding or junk
+static inline size_t base64_decode_simd(const unsigned char* in, size_t len, unsigned char*& out) {
+    size_t i = 0;
+
+    // each store writes 32 bytes, so keep well clear of the end of a base64_decoded_size buffer
+    for (; i + 48 <= len; i += 32) {
+        __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        if (!base64_translate_avx2(str)) break;
+
+        __m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+        __m256i packed = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        packed = _mm256_shuffle_epi8(packed, _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), packed);
+        out += 24;
+    }
+    return i;
+}
+
+// encodes 24 bytes at a time into 32 characters
+static inline size_t base64_encode_simd(const unsigned char* in, size_t len, char*& out) {
+    size_t i = 0;
+
+    // the upper half is loaded from 12 bytes in, and reads 16
+    for (; i + 28 <= len; i += 24) {
+        __m256i str = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12)), 1);
+
+        // spread each 3 bytes over 4, then pull out the 6-bit fields
+        str = _mm256_shuffle_epi8(str, _mm256_setr_epi8(
+            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+        __m256i t0 = _mm256_and_si256(str, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(str, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i values = _mm256_or_si256(t1, t3);
+
+        // and map them onto the alphabet
+        const __m256i lut = _mm256_setr_epi8(
+            65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+            65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+        __m256i indices = _mm256_subs_epu8(values, _mm256_set1_epi8(51));
+        indices = _mm256_sub_epi8(indices, _mm256_cmpgt_epi8(values, _mm256_set1_epi8(25)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_add_epi8(values, _mm256_shuffle_epi8(lut, indices)));
+        out += 32;
+    }
+    return i;
+}
+
+#else
+
+static inline size_t base64_decode_simd(const unsigned char*, size_t, unsigned char*&) {
+    return 0;
+}
+
+static inline size_t base64_encode_simd(const unsigned char*, size_t, char*&) {
+    return 0;
+}
+
+#endif
+
+} // namespace detail
+
+/// Encode a char buffer into a caller-provided buffer
 /**
  * @param input The input data
  * @param len The length of input in bytes
- * @return A base64 encoded string representing input
+ * @param out Receives the base64 characters; must hold base64_encoded_size(len) bytes
+ * @return The number of characters written (no terminating NUL is added)
  */
-inline std::string base64_encode(unsigned char const * input, size_t len) {
-    std::string ret;
-    int i = 0;
-    int j = 0;
-    unsigned char char_array_3[3];
-    unsigned char char_array_4[4];
-
-    while (len--) {
-        char_array_3[i++] = *(input++);
-        if (i == 3) {
-            char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-            char_array_4[1] = ((char_array_3[0] & 0x03) << 4) +
-                              ((char_array_3[1] & 0xf0) >> 4);
-            char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) +
-                              ((char_array_3[2] & 0xc0) >> 6);
-            char_array_4[3] = char_array_3[2] & 0x3f;
-
-            for(i = 0; (i <4) ; i++) {
-                ret += base64_chars[char_array_4[i]];
-            }
-            i = 0;
-        }
+inline size_t base64_encode(unsigned char const * input, size_t len, char * out) {
+    char * o = out;
+    size_t i = detail::base64_encode_simd(input, len, o);
+
+    for (; i + 3 <= len; i += 3) {
+        uint32_t v = (input[i] << 16) | (input[i + 1] << 8) | input[i + 2];
+        o[0] = base64_chars[v >> 18];
+        o[1] = base64_chars[(v >> 12) & 0x3f];
+        o[2] = base64_chars[(v >> 6) & 0x3f];
+        o[3] = base64_chars[v & 0x3f];
+        o += 4;
     }
 
-    if (i) {
-        for(j = i; j < 3; j++) {
-            char_array_3[j] = '\0';
-        }
-
-        char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-        char_array_4[1] = ((char_array_3[0] & 0x03) << 4) +
-                          ((char_array_3[1] & 0xf0) >> 4);
-        char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) +
-                          ((char_array_3[2] & 0xc0) >> 6);
-        char_array_4[3] = char_array_3[2] & 0x3f;
-
-        for (j = 0; (j < i + 1); j++) {
-            ret += base64_chars[char_array_4[j]];
-        }
-
-        while((i++ < 3)) {
-            ret += '=';
-        }
+    if (i < len) {
+        uint32_t v = input[i] << 16;
+        if (i + 1 < len) v |= input[i + 1] << 8;
+        o[0] = base64_chars[v >> 18];
+        o[1] = base64_chars[(v >> 12) & 0x3f];
+        o[2] = i + 1 < len ? base64_chars[(v >> 6) & 0x3f] : '=';
+        o[3] = '=';
+        o += 4;
     }
 
+    return o - out;
+}
+
+/// Encode a char buffer into a base64 string
+/**
+ * @param input The input data
+ * @param len The length of input in bytes
+ * @return A base64 encoded string representing input
+ */
+inline std::string base64_encode(unsigned char const * input, size_t len) {
+    std::string ret(base64_encoded_size(len), '\0');
+    ret.resize(base64_encode(input, len, &ret[0]));
     return ret;
 }
 
@@ -123,53 +251,61 @@ inline std::string base64_encode(std::string const & input) {
     );
 }
 
-/// Decode a base64 encoded string into a string of raw bytes
+/// Decode base64 characters into a caller-provided buffer
 /**
+ * Decoding stops at the first '=' or character outside the base64 alphabet.
+ * The output never runs ahead of the input, so out may be the input buffer
+ * itself to decode in place.
+ *
  * @param input The base64 encoded input data
- * @return A string representing the decoded raw bytes
+ * @param len The number of characters of input
+ * @param out Receives the raw bytes; must hold base64_decoded_size(len) bytes
+ * @return The number of bytes decoded
  */
-inline std::string base64_decode(std::string const & input) {
-    size_t in_len = input.size();
-    int i = 0;
-    int j = 0;
-    int in_ = 0;
-    unsigned char char_array_4[4], char_array_3[3];
-    std::string ret;
-
-    while (in_len-- && ( input[in_] != '=') && is_base64(input[in_])) {
-        char_array_4[i++] = input[in_]; in_++;
-        if (i ==4) {
-            for (i = 0; i <4; i++) {
-                char_array_4[i] = static_cast<unsigned char>(base64_chars.find(char_array_4[i]));
-            }
-
-            char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-            for (i = 0; (i < 3); i++) {
-                ret += char_array_3[i];
-            }
-            i = 0;
-        }
+inline size_t base64_decode(char const * input, size_t len, unsigned char * out) {
+    const unsigned char * in = reinterpret_cast<const unsigned char *>(input);
+    unsigned char * o = out;
+    size_t i = detail::base64_decode_simd(in, len, o);
+
+    for (; i + 4 <= len; i += 4) {
+        uint32_t a = base64_values[in[i]];
+        uint32_t b = base64_values[in[i + 1]];
+        uint32_t c = base64_values[in[i + 2]];
+        uint32_t d = base64_values[in[i + 3]];
+        if ((a | b | c | d) & 0x80) break;
+
+        uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+        o[0] = static_cast<unsigned char>(v >> 16);
+        o[1] = static_cast<unsigned char>(v >> 8);
+        o[2] = static_cast<unsigned char>(v);
+        o += 3;
     }
 
-    if (i) {
-        for (j = i; j <4; j++)
-            char_array_4[j] = 0;
-
-        for (j = 0; j <4; j++)
-            char_array_4[j] = static_cast<unsigned char>(base64_chars.find(char_array_4[j]));
-
-        char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-        for (j = 0; (j < i - 1); j++) {
-            ret += static_cast<std::string::value_type>(char_array_3[j]);
-        }
+    // a final group of two or three characters, cut short by padding, junk or the end of input
+    uint32_t v = 0;
+    int n = 0;
+    for (; i < len && n < 4; i++, n++) {
+        uint32_t c = base64_values[in[i]];
+        if (c & 0x80) break;
+        v = (v << 6) | c;
     }
+    if (n > 1) {
+        v <<= 6 * (4 - n);
+        *o++ = static_cast<unsigned char>(v >> 16);
+        if (n > 2) *o++ = static_cast<unsigned char>(v >> 8);
+    }
+
+    return o - out;
+}
 
+/// Decode a base64 encoded string into a string of raw bytes
+/**
+ * @param input The base64 encoded input data
+ * @return A string representing the decoded raw bytes
+ */
+inline std::string base64_decode(std::string const & input) {
+    std::string ret(base64_decoded_size(input.size()), '\0');
+    ret.resize(base64_decode(input.data(), input.size(), reinterpret_cast<unsigned char *>(&ret[0])));
     return ret;
 }
 
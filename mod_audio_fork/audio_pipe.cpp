@@ -2,20 +2,93 @@
 #include <switch.h>
 
 #include <cassert>
+#include <vector>
 #include <iostream>
+#include <algorithm>
 
 /* discard incoming text messages over the socket that are longer than this */
 #define MAX_RECV_BUF_SIZE (65 * 1024 * 10)
-#define RECV_BUF_REALLOC_SIZE (8 * 1024)
+#define RECV_BUF_INITIAL_SIZE (8 * 1024)
+/* idle receive buffers kept by each service thread, and the largest one worth keeping */
+#define MAX_POOLED_RECV_BUFS (4)
+#define MAX_POOLED_RECV_BUF_SIZE (64 * 1024)
+
+/* text frames are allocated in multiples of this, and a few are kept per pipe for reuse */
+#define TEXT_FRAME_ALLOC_SIZE (1024)
+#define MAX_TEXT_FRAMES_RECYCLED (8)
+#define MAX_TEXT_FRAME_RECYCLE_SIZE (64 * 1024)
+#define MAX_TEXT_FRAMES_PER_WRITEABLE (16)
 
 using namespace drachtio;
 
 namespace {
+  /**
+   * fragmented text messages are reassembled into buffers borrowed from a small per-thread pool,
+   * so that once the pool is warm receiving a message costs no allocations
+   */
+  class RecvBufferPool {
+  public:
+    ~RecvBufferPool() {
+      for (auto& b : m_free) free(b.first);
+    }
+
+    // hands out a buffer with room for minLen bytes plus a terminating NUL; returns its capacity, or 0 if none
+    size_t acquire(uint8_t** pbuf, size_t minLen) {
+      size_t capacity = 0;
+      *pbuf = nullptr;
+      if (!m_free.empty()) {
+        *pbuf = m_free.back().first;
+        capacity = m_free.back().second;
+        m_free.pop_back();
+      }
+      if (capacity > minLen) return capacity;
+      return grow(pbuf, capacity, minLen);
+    }
+
+    // grows a buffer to hold minLen bytes plus a terminating NUL, or frees it if that would exceed MAX_RECV_BUF_SIZE
+    size_t grow(uint8_t** pbuf, size_t capacity, size_t minLen) {
+      if (minLen >= MAX_RECV_BUF_SIZE) {
+        free(*pbuf);
+        *pbuf = nullptr;
+        return 0;
+      }
+      size_t newCapacity = std::max(capacity, (size_t) RECV_BUF_INITIAL_SIZE);
+      while (newCapacity <= minLen) newCapacity <<= 1;
+      newCapacity = std::min(newCapacity, (size_t) MAX_RECV_BUF_SIZE);
+
+      uint8_t* buf = (uint8_t*) realloc(*pbuf, newCapacity);
+      if (nullptr == buf) {
+        free(*pbuf);
+        *pbuf = nullptr;
+        return 0;
+      }
+      *pbuf = buf;
+      return newCapacity;
+    }
+
+    void release(uint8_t* buf, size_t capacity) {
+      if (m_free.size() < MAX_POOLED_RECV_BUFS && capacity <= MAX_POOLED_RECV_BUF_SIZE) {
+        m_free.push_back(std::make_pair(buf, capacity));
+      }
+      else free(buf);
+    }
+
+  private:
+    std::vector<std::pair<uint8_t*, size_t> > m_free;
+  };
+
+  // a connection is only ever serviced by one thread, so its messages are always assembled from that thread's pool
+  thread_local RecvBufferPool recvBufferPool;
+
   static const char* basicAuthUser = std::getenv("MOD_AUDIO_FORK_HTTP_AUTH_USER");
   static const char* basicAuthPassword = std::getenv("MOD_AUDIO_FORK_HTTP_AUTH_PASSWORD");
 
   static const char *requestedTcpKeepaliveSecs = std::getenv("MOD_AUDIO_FORK_TCP_KEEPALIVE_SECS");
   static int nTcpKeepaliveSecs = requestedTcpKeepaliveSecs ? ::atoi(requestedTcpKeepaliveSecs) : 55;
+
+  // when set, queued writes are picked up by a timer on the service thread instead of waking it for each frame
+  static const char *requestedWriteFlushMs = std::getenv("MOD_AUDIO_FORK_WRITE_FLUSH_MS");
+  static int nWriteFlushMs = std::max(0, std::min(requestedWriteFlushMs ? ::atoi(requestedWriteFlushMs) : 0, 20));
 }
 
 // remove once we update to lws with this helper
@@ -47,6 +120,7 @@ int AudioPipe::lws_callback(struct lws *wsi,
 
   struct lws_vhost* vhost = lws_get_vhost(wsi);
   AudioPipe ** ppAp = (AudioPipe **) user;
+  lws_service_context* sc = static_cast<lws_service_context*>(lws_context_user(lws_get_context(wsi)));
 
   switch (reason) {
     case LWS_CALLBACK_PROTOCOL_INIT:
@@ -77,9 +151,11 @@ int AudioPipe::lws_callback(struct lws *wsi,
       break;
 
     case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
-      processPendingConnects(vhd);
-      processPendingDisconnects(vhd);
-      processPendingWrites();
+      // clear first, so anything queued from here on triggers a fresh wakeup
+      sc->wakeupPending = false;
+      processPendingConnects(sc, vhd);
+      processPendingDisconnects(sc, vhd);
+      processPendingWrites(sc);
       break;
     case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
       {
@@ -88,7 +164,8 @@ int AudioPipe::lws_callback(struct lws *wsi,
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR,"AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_CONNECTION_ERROR: %s, response status %d\n", in ? (char *)in : "(null)", rc); 
         if (ap) {
           ap->m_state = LWS_CLIENT_FAILED;
-          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECT_FAIL, (char *) in, NULL, len);
+          ap->m_ctx->numPipes--;
+          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::CONNECT_FAIL, (char *) in, NULL, in ? strlen((char *) in) : 0);
         }
         else {
           switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR,"AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_CONNECTION_ERROR unable to find wsi %p..\n", wsi); 
@@ -132,6 +209,7 @@ int AudioPipe::lws_callback(struct lws *wsi,
         //pointer or reference to this object must treat is as no longer valid
 
         *ppAp = NULL;
+        ap->m_ctx->numPipes--;
         delete ap;
       }
       break;
@@ -162,29 +240,21 @@ int AudioPipe::lws_callback(struct lws *wsi,
         }
         else {
           if (lws_is_first_fragment(wsi)) {
-            // allocate a buffer for the entire chunk of memory needed
+            // borrow a buffer big enough for the entire message, if lws knows how big it is
             assert(nullptr == ap->m_recv_buf);
-            ap->m_recv_buf_len = len + lws_remaining_packet_payload(wsi);
-            ap->m_recv_buf = (uint8_t*) malloc(ap->m_recv_buf_len);
+            ap->m_recv_buf_len = recvBufferPool.acquire(&ap->m_recv_buf, len + lws_remaining_packet_payload(wsi));
             ap->m_recv_buf_ptr = ap->m_recv_buf;
-          }
-
-          size_t write_offset = ap->m_recv_buf_ptr - ap->m_recv_buf;
-          size_t remaining_space = ap->m_recv_buf_len - write_offset;
-          if (remaining_space < len) {
-            //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO,"AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE buffer realloc needed.\n");
-            size_t newlen = ap->m_recv_buf_len + RECV_BUF_REALLOC_SIZE;
-            if (newlen > MAX_RECV_BUF_SIZE) {
-              free(ap->m_recv_buf);
-              ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
-              ap->m_recv_buf_len = 0;
-              switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR,"AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, truncating message.\n");
+            if (nullptr == ap->m_recv_buf) {
+              switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, discarding message.\n");
             }
-            else {
-              ap->m_recv_buf = (uint8_t*) realloc(ap->m_recv_buf, newlen);
-              if (nullptr != ap->m_recv_buf) {
-                ap->m_recv_buf_len = newlen;
-                ap->m_recv_buf_ptr = ap->m_recv_buf + write_offset;
+          }
+          else if (nullptr != ap->m_recv_buf) {
+            size_t write_offset = ap->m_recv_buf_ptr - ap->m_recv_buf;
+            if (ap->m_recv_buf_len - write_offset <= len) {
+              ap->m_recv_buf_len = recvBufferPool.grow(&ap->m_recv_buf, ap->m_recv_buf_len, write_offset + len);
+              ap->m_recv_buf_ptr = ap->m_recv_buf ? ap->m_recv_buf + write_offset : nullptr;
+              if (nullptr == ap->m_recv_buf) {
+                switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, truncating message.\n");
               }
             }
           }
@@ -195,11 +265,11 @@ int AudioPipe::lws_callback(struct lws *wsi,
               ap->m_recv_buf_ptr += len;
             }
             if (lws_is_final_fragment(wsi)) {
-              if (nullptr != ap->m_recv_buf) {
-                std::string msg((char *)ap->m_recv_buf, ap->m_recv_buf_ptr - ap->m_recv_buf);
-                ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::MESSAGE, msg.c_str(), NULL, len);
-                if (nullptr != ap->m_recv_buf) free(ap->m_recv_buf);
-              }
+              // hand the message to the callback in place, NUL-terminated for consumers that treat it as a string
+              size_t msg_len = ap->m_recv_buf_ptr - ap->m_recv_buf;
+              ap->m_recv_buf[msg_len] = '\0';
+              ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), AudioPipe::MESSAGE, (const char *) ap->m_recv_buf, NULL, msg_len);
+              recvBufferPool.release(ap->m_recv_buf, ap->m_recv_buf_len);
               ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
               ap->m_recv_buf_len = 0;
             }
@@ -219,28 +289,38 @@ int AudioPipe::lws_callback(struct lws *wsi,
         // check for graceful close - send a zero length binary frame
         if (ap->isGracefulShutdown()) {
           switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR,"%s graceful shutdown - sending zero length binary frame to flush any final responses\n", ap->m_uuid.c_str());
-          std::lock_guard<std::mutex> lk(ap->m_audio_mutex);
-          int sent = lws_write(wsi, (unsigned char *) ap->m_audio_buffer + LWS_PRE, 0, LWS_WRITE_BINARY);
+          uint8_t buf[LWS_PRE];
+          int sent = lws_write(wsi, buf + LWS_PRE, 0, LWS_WRITE_BINARY);
           return 0;
         }
 
-        // check for text frames to send
+        // check for text frames to send; drain several per callback while the socket will take them
         {
-          std::lock_guard<std::mutex> lk(ap->m_text_mutex);
-          if (!ap->m_metadata_list.empty()) {
-            const std::string& message = ap->m_metadata_list.front();
-            uint8_t buf[message.length() + LWS_PRE];
-            memcpy(buf + LWS_PRE, message.c_str(), message.length());
-            int n = message.length();
-            int m = lws_write(wsi, buf + LWS_PRE, n, LWS_WRITE_TEXT);
+          int nFrames = 0;
+          while (nFrames < MAX_TEXT_FRAMES_PER_WRITEABLE) {
+            text_frame_t frame;
+            {
+              std::lock_guard<std::mutex> lk(ap->m_text_mutex);
+              if (ap->m_metadata_list.empty()) break;
+              frame = ap->m_metadata_list.front();
+              ap->m_metadata_list.pop_front();
+            }
 
+            // frames are allocated with LWS_PRE headroom, so they are sent in place
+            int n = frame.len;
+            int m = lws_write(wsi, frame.buf + LWS_PRE, n, LWS_WRITE_TEXT);
+            {
+              std::lock_guard<std::mutex> lk(ap->m_text_mutex);
+              ap->recycleTextFrame(frame);
+            }
             if (m < n) {
               return -1; // Failed to send the full message
             }
-
-            // Remove the message that was successfully sent
-            ap->m_metadata_list.pop_front();
-            // Request another writable event if there are more messages
+            nFrames++;
+            if (lws_send_pipe_choked(wsi)) break;
+          }
+          if (nFrames > 0) {
+            // Request another writable event for any remaining messages and audio
             lws_callback_on_writable(wsi);
             return 0;
           }
@@ -251,18 +331,21 @@ int AudioPipe::lws_callback(struct lws *wsi,
           return -1;
         }
 
-        // check for audio packets
+        // check for audio packets; the ring hands us data with LWS_PRE headroom so it is sent in place
         {
-          std::lock_guard<std::mutex> lk(ap->m_audio_mutex);
-          if (ap->m_audio_buffer_write_offset > LWS_PRE) {
-            size_t datalen = ap->m_audio_buffer_write_offset - LWS_PRE;
-            int sent = lws_write(wsi, (unsigned char *) ap->m_audio_buffer + LWS_PRE, datalen, LWS_WRITE_BINARY);
+          size_t datalen;
+          uint8_t* data = ap->m_audio_ring.peek(datalen);
+          if (datalen > 0) {
+            int sent = lws_write(wsi, data, datalen, LWS_WRITE_BINARY);
             if (sent < datalen) {
               switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO,"AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_WRITEABLE %s attemped to send %lu only sent %d wsi %p..\n", 
                 ap->m_uuid.c_str(), datalen, sent, wsi); 
             }
-            ap->m_audio_buffer_write_offset = LWS_PRE;
           }
+          ap->m_audio_ring.consume(datalen);
+
+          // if the producer wrapped there is a second span waiting
+          if (!ap->m_audio_ring.empty()) lws_callback_on_writable(wsi);
         }
 
         return 0;
@@ -286,44 +369,46 @@ static const lws_retry_bo_t retry = {
     0          // jitter_percent
 };
 
-struct lws_context *AudioPipe::context = nullptr;
-std::thread AudioPipe::serviceThread;
+AudioPipe::lws_service_context AudioPipe::serviceContexts[MAX_SERVICE_THREADS];
+unsigned int AudioPipe::numContexts = 0;
+unsigned int AudioPipe::nchild = 0;
 std::string AudioPipe::protocolName;
-std::mutex AudioPipe::mutex_connects;
-std::mutex AudioPipe::mutex_disconnects;
-std::mutex AudioPipe::mutex_writes;
-std::list<AudioPipe*> AudioPipe::pendingConnects;
-std::list<AudioPipe*> AudioPipe::pendingDisconnects;
-std::list<AudioPipe*> AudioPipe::pendingWrites;
 AudioPipe::log_emit_function AudioPipe::logger;
 std::mutex AudioPipe::mapMutex;
-bool AudioPipe::stopFlag;
 
-void AudioPipe::processPendingConnects(lws_per_vhost_data *vhd) {
+AudioPipe::lws_service_context* AudioPipe::selectServiceContext(void) {
+  // pick the least loaded service thread, starting the search round-robin so ties are spread evenly
+  std::lock_guard<std::mutex> lock(mapMutex);
+  unsigned int start = nchild++ % numContexts;
+  lws_service_context* best = &serviceContexts[start];
+  for (unsigned int i = 1; i < numContexts; i++) {
+    lws_service_context* sc = &serviceContexts[(start + i) % numContexts];
+    if (sc->numPipes < best->numPipes) best = sc;
+  }
+  best->numPipes++;
+  return best;
+}
+
+void AudioPipe::processPendingConnects(lws_service_context* sc, lws_per_vhost_data *vhd) {
   std::list<AudioPipe*> connects;
   {
-    std::lock_guard<std::mutex> guard(mutex_connects);
-    for (auto it = pendingConnects.begin(); it != pendingConnects.end(); ++it) {
-      if ((*it)->m_state == LWS_CLIENT_IDLE) {
-        connects.push_back(*it);
-        (*it)->m_state = LWS_CLIENT_CONNECTING;
-      }
-    }
+    std::lock_guard<std::mutex> guard(sc->mutex_connects);
+    connects.swap(sc->pendingConnects);
   }
   for (auto it = connects.begin(); it != connects.end(); ++it) {
     AudioPipe* ap = *it;
-    ap->connect_client(vhd);   
+    if (ap->m_state == LWS_CLIENT_IDLE) ap->connect_client(vhd);
   }
 }
 
-void AudioPipe::processPendingDisconnects(lws_per_vhost_data *vhd) {
+void AudioPipe::processPendingDisconnects(lws_service_context* sc, lws_per_vhost_data *vhd) {
   std::list<AudioPipe*> disconnects;
   {
-    std::lock_guard<std::mutex> guard(mutex_disconnects);
-    for (auto it = pendingDisconnects.begin(); it != pendingDisconnects.end(); ++it) {
+    std::lock_guard<std::mutex> guard(sc->mutex_disconnects);
+    for (auto it = sc->pendingDisconnects.begin(); it != sc->pendingDisconnects.end(); ++it) {
       if ((*it)->m_state == LWS_CLIENT_DISCONNECTING) disconnects.push_back(*it);
     }
-    pendingDisconnects.clear();
+    sc->pendingDisconnects.clear();
   }
   for (auto it = disconnects.begin(); it != disconnects.end(); ++it) {
     AudioPipe* ap = *it;
@@ -331,14 +416,15 @@ void AudioPipe::processPendingDisconnects(lws_per_vhost_data *vhd) {
   }
 }
 
-void AudioPipe::processPendingWrites() {
+void AudioPipe::processPendingWrites(lws_service_context* sc) {
   std::list<AudioPipe*> writes;
   {
-    std::lock_guard<std::mutex> guard(mutex_writes);
-    for (auto it = pendingWrites.begin(); it != pendingWrites.end(); ++it) {
+    std::lock_guard<std::mutex> guard(sc->mutex_writes);
+    for (auto it = sc->pendingWrites.begin(); it != sc->pendingWrites.end(); ++it) {
+       (*it)->m_write_pending = false;
        if ((*it)->m_state == LWS_CLIENT_CONNECTED) writes.push_back(*it);
     }  
-    pendingWrites.clear();
+    sc->pendingWrites.clear();
   }
   for (auto it = writes.begin(); it != writes.end(); ++it) {
     AudioPipe* ap = *it;
@@ -346,71 +432,78 @@ void AudioPipe::processPendingWrites() {
   }
 }
 
+// the AudioPipe is attached to its wsi as opaque user data at connect time, so no list needs to be searched
 AudioPipe* AudioPipe::findAndRemovePendingConnect(struct lws *wsi) {
-  AudioPipe* ap = NULL;
-  std::lock_guard<std::mutex> guard(mutex_connects);
-  std::list<AudioPipe* > toRemove;
-
-  for (auto it = pendingConnects.begin(); it != pendingConnects.end() && !ap; ++it) {
-    int state = (*it)->m_state;
-
-    if ((*it)->m_wsi == nullptr)
-      toRemove.push_back(*it);
-
-    if ((state == LWS_CLIENT_CONNECTING) &&
-      (*it)->m_wsi == wsi) ap = *it;
-  }
-
-  for (auto it = toRemove.begin(); it != toRemove.end(); ++it)
-    pendingConnects.remove(*it);
-
-  if (ap) {
-    pendingConnects.remove(ap);
-  }
-
+  AudioPipe* ap = findPendingConnect(wsi);
+  if (ap) lws_set_opaque_user_data(wsi, nullptr);
   return ap;
 }
 
 AudioPipe* AudioPipe::findPendingConnect(struct lws *wsi) {
-  AudioPipe* ap = NULL;
-  std::lock_guard<std::mutex> guard(mutex_connects);
-
-  for (auto it = pendingConnects.begin(); it != pendingConnects.end() && !ap; ++it) {
-    int state = (*it)->m_state;
-    if ((state == LWS_CLIENT_CONNECTING) &&
-      (*it)->m_wsi == wsi) ap = *it;
-  }
-  return ap;
+  AudioPipe* ap = static_cast<AudioPipe*>(lws_get_opaque_user_data(wsi));
+  if (ap && ap->m_state == LWS_CLIENT_CONNECTING) return ap;
+  return nullptr;
 }
 
 void AudioPipe::addPendingConnect(AudioPipe* ap) {
+  lws_service_context* sc = ap->m_ctx;
   {
-    std::lock_guard<std::mutex> guard(mutex_connects);
-    pendingConnects.push_back(ap);
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG,"%s after adding connect there are %lu pending connects\n", 
-      ap->m_uuid.c_str(), pendingConnects.size());
+    std::lock_guard<std::mutex> guard(sc->mutex_connects);
+    sc->pendingConnects.push_back(ap);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG,"%s after adding connect there are %lu pending connects on service thread %ld\n", 
+      ap->m_uuid.c_str(), sc->pendingConnects.size(), (long) (sc - serviceContexts));
   }
-  lws_cancel_service(context);
+  wakeServiceThread(sc);
 }
 void AudioPipe::addPendingDisconnect(AudioPipe* ap) {
+  lws_service_context* sc = ap->m_ctx;
   ap->m_state = LWS_CLIENT_DISCONNECTING;
   {
-    std::lock_guard<std::mutex> guard(mutex_disconnects);
-    pendingDisconnects.push_back(ap);
+    std::lock_guard<std::mutex> guard(sc->mutex_disconnects);
+    sc->pendingDisconnects.push_back(ap);
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG,"%s after adding disconnect there are %lu pending disconnects\n", 
-      ap->m_uuid.c_str(), pendingDisconnects.size());
+      ap->m_uuid.c_str(), sc->pendingDisconnects.size());
   }
-  lws_cancel_service(ap->m_vhd->context);
+  wakeServiceThread(sc);
 }
 void AudioPipe::addPendingWrite(AudioPipe* ap) {
+  lws_service_context* sc = ap->m_ctx;
+  sc->writesRequested++;
+
+  // already queued and not yet picked up by the service thread
+  if (ap->m_write_pending.exchange(true)) {
+    sc->writesCoalesced++;
+    return;
+  }
   {
-    std::lock_guard<std::mutex> guard(mutex_writes);
-    pendingWrites.push_back(ap);
+    std::lock_guard<std::mutex> guard(sc->mutex_writes);
+    sc->pendingWrites.push_back(ap);
   }
-  lws_cancel_service(ap->m_vhd->context);
+  if (nWriteFlushMs > 0) {
+    // the flush timer will pick it up
+    sc->wakeupsAvoided++;
+    return;
+  }
+  wakeServiceThread(sc);
 }
 
-bool AudioPipe::lws_service_thread() {
+void AudioPipe::wakeServiceThread(lws_service_context* sc) {
+  // one lws_cancel_service per service loop iteration is enough
+  if (sc->wakeupPending.exchange(true)) {
+    sc->wakeupsAvoided++;
+    return;
+  }
+  sc->wakeups++;
+  lws_cancel_service(sc->context);
+}
+
+void AudioPipe::flushTimerCallback(lws_sorted_usec_list_t *sul) {
+  lws_service_context* sc = reinterpret_cast<lws_flush_timer*>(sul)->sc;
+  processPendingWrites(sc);
+  lws_sul_schedule(sc->context, 0, &sc->flushTimer.sul, flushTimerCallback, nWriteFlushMs * LWS_US_PER_MS);
+}
+
+bool AudioPipe::lws_service_thread(lws_service_context* sc) {
   struct lws_context_creation_info info;
 
   const struct lws_protocols protocols[] = {
@@ -435,64 +528,100 @@ bool AudioPipe::lws_service_thread() {
   info.keepalive_timeout = 5;           // seconds to allow remote client to hold on to an idle HTTP/1.1 connection 
   info.timeout_secs_ah_idle = 10;       // secs to allow a client to hold an ah without using it
   info.retry_and_idle_policy = &retry;
+  info.user = sc;
 
-  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO,"AudioPipe::lws_service_thread creating context\n");
+  long nServiceThread = sc - serviceContexts;
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO,"AudioPipe::lws_service_thread creating context in service thread %ld\n", nServiceThread);
 
-  context = lws_create_context(&info);
-  if (!context) {
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR,"AudioPipe::lws_service_thread failed creating context\n"); 
+  sc->context = lws_create_context(&info);
+  if (!sc->context) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR,"AudioPipe::lws_service_thread failed creating context in service thread %ld\n", nServiceThread); 
     return false;
   }
 
+  if (nWriteFlushMs > 0) {
+    sc->flushTimer.sc = sc;
+    lws_sul_schedule(sc->context, 0, &sc->flushTimer.sul, flushTimerCallback, nWriteFlushMs * LWS_US_PER_MS);
+  }
+
   int n;
   do {
-    n = lws_service(context, 0);
-  } while (n >= 0 && !stopFlag);
+    n = lws_service(sc->context, 0);
+  } while (n >= 0 && !sc->stopFlag);
 
-  lwsl_notice("AudioPipe::lws_service_thread ending\n"); 
-  lws_context_destroy(context);
+  lwsl_notice("AudioPipe::lws_service_thread ending in service thread %ld\n", nServiceThread); 
+  lws_context_destroy(sc->context);
+  sc->context = nullptr;
 
   return true;
 }
 
-void AudioPipe::initialize(const char* protocol, int loglevel, log_emit_function logger) {
+void AudioPipe::initialize(const char* protocol, unsigned int nThreads, int loglevel, log_emit_function logger) {
+  assert(nThreads > 0 && nThreads <= MAX_SERVICE_THREADS);
+
   protocolName = protocol;
   lws_set_log_level(loglevel, logger);
 
-  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE,"AudioPipe::initialize starting\n"); 
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE,"AudioPipe::initialize starting %u service threads, write flush interval %d ms\n", nThreads, nWriteFlushMs); 
   std::lock_guard<std::mutex> lock(mapMutex);
-  stopFlag = false;
-  serviceThread = std::thread(&AudioPipe::lws_service_thread);
+  numContexts = nThreads;
+  for (unsigned int i = 0; i < numContexts; i++) {
+    lws_service_context* sc = &serviceContexts[i];
+    sc->stopFlag = false;
+    sc->numPipes = 0;
+    sc->wakeupPending = false;
+    sc->writesRequested = sc->writesCoalesced = sc->wakeups = sc->wakeupsAvoided = 0;
+    sc->serviceThread = std::thread(&AudioPipe::lws_service_thread, sc);
+  }
 }
 
 bool AudioPipe::deinitialize() {
   switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE,"AudioPipe::deinitialize\n"); 
   std::lock_guard<std::mutex> lock(mapMutex);
-  stopFlag = true;
-  if (serviceThread.joinable()) {
-    serviceThread.join();
+  for (unsigned int i = 0; i < numContexts; i++) {
+    lws_service_context* sc = &serviceContexts[i];
+    sc->stopFlag = true;
+    if (sc->context) lws_cancel_service(sc->context);
+    if (sc->serviceThread.joinable()) {
+      sc->serviceThread.join();
+    }
   }
+  numContexts = 0;
   return true;
 }
 
+unsigned int AudioPipe::getServiceStats(service_stats_t* stats, unsigned int maxStats) {
+  std::lock_guard<std::mutex> lock(mapMutex);
+  unsigned int i;
+  for (i = 0; i < numContexts && i < maxStats; i++) {
+    lws_service_context* sc = &serviceContexts[i];
+    stats[i].pipes = sc->numPipes;
+    stats[i].writesRequested = sc->writesRequested;
+    stats[i].writesCoalesced = sc->writesCoalesced;
+    stats[i].wakeups = sc->wakeups;
+    stats[i].wakeupsAvoided = sc->wakeupsAvoided;
+  }
+  return i;
+}
+
 // instance members
 AudioPipe::AudioPipe(const char* uuid, const char* host, unsigned int port, const char* path,
   int sslFlags, size_t bufLen, size_t minFreespace, const char* username, const char* password, char* bugname,
   int bidirectional_audio_stream, notifyHandler_t callback) :
   m_uuid(uuid), m_host(host), m_port(port), m_path(path), m_sslFlags(sslFlags),
-  m_audio_buffer_min_freespace(minFreespace), m_audio_buffer_max_len(bufLen), m_gracefulShutdown(false),
-  m_audio_buffer_write_offset(LWS_PRE), m_recv_buf(nullptr), m_recv_buf_ptr(nullptr), m_bugname(bugname),
-  m_state(LWS_CLIENT_IDLE), m_wsi(nullptr), m_vhd(nullptr), m_callback(callback) {
+  m_audio_buffer_min_freespace(minFreespace), m_audio_ring(bufLen - LWS_PRE, LWS_PRE), m_gracefulShutdown(false),
+  m_audio_bytes_dropped(0), m_recv_buf(nullptr), m_recv_buf_ptr(nullptr), m_bugname(bugname),
+  m_state(LWS_CLIENT_IDLE), m_wsi(nullptr), m_vhd(nullptr), m_callback(callback), m_ctx(selectServiceContext()), m_write_pending(false) {
 
   if (username && password) {
     m_username.assign(username);
     m_password.assign(password);
   }
   m_bidirectional_audio_stream = bidirectional_audio_stream;
-  m_audio_buffer = new uint8_t[m_audio_buffer_max_len];
 }
 AudioPipe::~AudioPipe() {
-  if (m_audio_buffer) delete [] m_audio_buffer;
+  for (auto& frame : m_metadata_list) delete [] frame.buf;
+  for (auto& frame : m_text_slab) delete [] frame.buf;
   if (m_recv_buf) free(m_recv_buf);
 }
 
@@ -501,7 +630,6 @@ void AudioPipe::connect(void) {
 }
 
 bool AudioPipe::connect_client(struct lws_per_vhost_data *vhd) {
-  assert(m_audio_buffer != nullptr);
   assert(m_vhd == nullptr);
 
   struct lws_client_connect_info i;
@@ -516,6 +644,7 @@ bool AudioPipe::connect_client(struct lws_per_vhost_data *vhd) {
   i.ssl_connection = m_sslFlags;
   i.protocol = protocolName.c_str();
   i.pwsi = &(m_wsi);
+  i.opaque_user_data = this;
 
   m_state = LWS_CLIENT_CONNECTING;
   m_vhd = vhd;
@@ -523,6 +652,13 @@ bool AudioPipe::connect_client(struct lws_per_vhost_data *vhd) {
   m_wsi = lws_client_connect_via_info(&i);
   switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG,"%s attempting connection, wsi is %p\n", m_uuid.c_str(), m_wsi);
 
+  // failed before a wsi was created, so no LWS_CALLBACK_CLIENT_CONNECTION_ERROR is coming
+  if (nullptr == m_wsi && m_state == LWS_CLIENT_CONNECTING) {
+    m_state = LWS_CLIENT_FAILED;
+    m_ctx->numPipes--;
+    m_callback(m_uuid.c_str(), m_bugname.c_str(), AudioPipe::CONNECT_FAIL, "failed to create connection", NULL, 0);
+  }
+
   return nullptr != m_wsi;
 }
 
@@ -530,14 +666,58 @@ void AudioPipe::bufferForSending(const char* text) {
   if (m_state != LWS_CLIENT_CONNECTED) return;
   {
     std::lock_guard<std::mutex> lk(m_text_mutex);
-    m_metadata_list.emplace_back(text);
+    size_t len = strlen(text);
+    text_frame_t frame = allocTextFrame(len);
+    memcpy(frame.buf + LWS_PRE, text, len);
+    frame.len = len;
+    m_metadata_list.push_back(frame);
   }
   addPendingWrite(this);
 }
 
-void AudioPipe::unlockAudioBuffer() {
-  if (m_audio_buffer_write_offset > LWS_PRE) addPendingWrite(this);
-  m_audio_mutex.unlock();
+// callers hold m_text_mutex
+AudioPipe::text_frame_t AudioPipe::allocTextFrame(size_t len) {
+  size_t needed = LWS_PRE + len;
+  for (auto it = m_text_slab.begin(); it != m_text_slab.end(); ++it) {
+    if (it->capacity >= needed) {
+      text_frame_t frame = *it;
+      m_text_slab.erase(it);
+      return frame;
+    }
+  }
+  text_frame_t frame;
+  frame.capacity = (needed + TEXT_FRAME_ALLOC_SIZE - 1) / TEXT_FRAME_ALLOC_SIZE * TEXT_FRAME_ALLOC_SIZE;
+  frame.buf = new uint8_t[frame.capacity];
+  frame.len = 0;
+  return frame;
+}
+
+void AudioPipe::recycleTextFrame(text_frame_t& frame) {
+  if (m_text_slab.size() < MAX_TEXT_FRAMES_RECYCLED && frame.capacity <= MAX_TEXT_FRAME_RECYCLE_SIZE) {
+    frame.len = 0;
+    m_text_slab.push_back(frame);
+  }
+  else {
+    delete [] frame.buf;
+  }
+  frame.buf = nullptr;
+}
+
+char * AudioPipe::binaryWriteReserve(size_t& available, bool& dropped) {
+  uint8_t* p;
+  dropped = false;
+  while (nullptr == (p = m_audio_ring.reserve(m_audio_buffer_min_freespace, available))) {
+    // far end is not keeping up: discard the oldest frame and try again
+    size_t n = m_audio_ring.dropOldest(m_audio_buffer_min_freespace);
+    if (0 == n) break;
+    m_audio_bytes_dropped += n;
+    dropped = true;
+  }
+  return (char *) p;
+}
+
+void AudioPipe::binaryWriteFlush() {
+  if (!m_audio_ring.empty()) addPendingWrite(this);
 }
 
 void AudioPipe::close() {
@@ -5,11 +5,18 @@
 #include <list>
 #include <mutex>
 #include <queue>
+#include <deque>
+#include <vector>
 #include <unordered_map>
 #include <thread>
+#include <atomic>
 
 #include <libwebsockets.h>
 
+#include "bip_buffer.hpp"
+
+#define MAX_SERVICE_THREADS (5)
+
 namespace drachtio {
 
   class AudioPipe {
@@ -31,7 +38,7 @@ namespace drachtio {
       BINARY
     };
     typedef void (*log_emit_function)(int level, const char *line);
-    typedef void (*notifyHandler_t)(const char *sessionId, const char* bugname, NotifyEvent_t event, const char* message, const char* binary, size_t binary_len );
+    typedef void (*notifyHandler_t)(const char *sessionId, const char* bugname, NotifyEvent_t event, const char* message, const char* binary, size_t len);
 
     struct lws_per_vhost_data {
       struct lws_context *context;
@@ -39,9 +46,49 @@ namespace drachtio {
       const struct lws_protocols *protocol;
     };
 
-    static void initialize(const char* protocolName, int loglevel, log_emit_function logger);
+    struct lws_service_context;
+
+    // periodic flush of pending writes when MOD_AUDIO_FORK_WRITE_FLUSH_MS is set
+    struct lws_flush_timer {
+      lws_sorted_usec_list_t sul;
+      lws_service_context* sc;
+    };
+
+    // each service thread runs its own lws_context and owns the pending work for the pipes assigned to it
+    struct lws_service_context {
+      struct lws_context *context;
+      std::thread serviceThread;
+      bool stopFlag;
+      std::atomic<unsigned int> numPipes;
+      std::atomic<bool> wakeupPending;
+      lws_flush_timer flushTimer;
+
+      // write request counters
+      std::atomic<uint64_t> writesRequested;
+      std::atomic<uint64_t> writesCoalesced;
+      std::atomic<uint64_t> wakeups;
+      std::atomic<uint64_t> wakeupsAvoided;
+
+      std::mutex mutex_connects;
+      std::mutex mutex_disconnects;
+      std::mutex mutex_writes;
+      std::list<AudioPipe*> pendingConnects;
+      std::list<AudioPipe*> pendingDisconnects;
+      std::list<AudioPipe*> pendingWrites;
+    };
+
+    static void initialize(const char* protocolName, unsigned int nThreads, int loglevel, log_emit_function logger);
     static bool deinitialize();
-    static bool lws_service_thread();
+    static bool lws_service_thread(lws_service_context* sc);
+
+    struct service_stats_t {
+      unsigned int pipes;
+      uint64_t writesRequested;
+      uint64_t writesCoalesced;
+      uint64_t wakeups;
+      uint64_t wakeupsAvoided;
+    };
+    static unsigned int getServiceStats(service_stats_t* stats, unsigned int maxStats);
 
     // constructor
     AudioPipe(const char* uuid, const char* host, unsigned int port, const char* path, int sslFlags, 
@@ -52,25 +99,19 @@ namespace drachtio {
     LwsState_t getLwsState(void) { return m_state; }
     void connect(void);
     void bufferForSending(const char* text);
-    size_t binarySpaceAvailable(void) {
-      return m_audio_buffer_max_len - m_audio_buffer_write_offset;
-    }
     size_t binaryMinSpace(void) {
       return m_audio_buffer_min_freespace;
     }
-    char * binaryWritePtr(void) { 
-      return (char *) m_audio_buffer + m_audio_buffer_write_offset;
-    }
-    void binaryWritePtrAdd(size_t len) {
-      m_audio_buffer_write_offset += len;
-    }
-    void binaryWritePtrResetToZero(void) {
-      m_audio_buffer_write_offset = 0;
+    // media thread only: contiguous space for at least binaryMinSpace() bytes; if the socket has
+    // stalled the oldest queued audio is dropped to make room, and dropped is set
+    char * binaryWriteReserve(size_t& available, bool& dropped);
+    void binaryWriteCommit(size_t len) {
+      m_audio_ring.commit(len);
     }
-    void lockAudioBuffer(void) {
-      m_audio_mutex.lock();
+    void binaryWriteFlush(void);
+    uint64_t binaryBytesDropped(void) {
+      return m_audio_bytes_dropped;
     }
-    void unlockAudioBuffer(void) ;
     bool hasBasicAuth(void) {
       return !m_username.empty() && !m_password.empty();
     }
@@ -97,48 +138,54 @@ namespace drachtio {
     void operator=(const AudioPipe&) = delete;
 
   private:
-    static std::thread serviceThread;
-
     static int lws_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len); 
-    static struct lws_context *context;
+    static lws_service_context serviceContexts[MAX_SERVICE_THREADS];
+    static unsigned int numContexts;
+    static unsigned int nchild;
     static std::string protocolName;
-    static std::mutex mutex_connects;
-    static std::mutex mutex_disconnects;
-    static std::mutex mutex_writes;
-    static std::list<AudioPipe*> pendingConnects;
-    static std::list<AudioPipe*> pendingDisconnects;
-    static std::list<AudioPipe*> pendingWrites;
     static log_emit_function logger;
 
     static std::mutex mapMutex;
-    static bool stopFlag;
 
+    static lws_service_context* selectServiceContext(void);
     static AudioPipe* findAndRemovePendingConnect(struct lws *wsi);
     static AudioPipe* findPendingConnect(struct lws *wsi);
     static void addPendingConnect(AudioPipe* ap);
     static void addPendingDisconnect(AudioPipe* ap);
     static void addPendingWrite(AudioPipe* ap);
-    static void processPendingConnects(lws_per_vhost_data *vhd);
-    static void processPendingDisconnects(lws_per_vhost_data *vhd);
-    static void processPendingWrites(void);
+    static void processPendingConnects(lws_service_context* sc, lws_per_vhost_data *vhd);
+    static void processPendingDisconnects(lws_service_context* sc, lws_per_vhost_data *vhd);
+    static void processPendingWrites(lws_service_context* sc);
+    static void wakeServiceThread(lws_service_context* sc);
+    static void flushTimerCallback(lws_sorted_usec_list_t *sul);
     
     bool connect_client(struct lws_per_vhost_data *vhd);
 
+    // a queued text frame, allocated with LWS_PRE bytes of headroom so it can be sent in place
+    struct text_frame_t {
+      uint8_t* buf;
+      size_t len;
+      size_t capacity;
+    };
+    text_frame_t allocTextFrame(size_t len);
+    void recycleTextFrame(text_frame_t& frame);
+
+    lws_service_context* m_ctx;
+    std::atomic<bool> m_write_pending;
     LwsState_t m_state;
     std::string m_uuid;
     std::string m_host;
     std::string m_bugname;
     unsigned int m_port;
     std::string m_path;
-    std::list<std::string> m_metadata_list;
+    std::deque<text_frame_t> m_metadata_list;
+    std::vector<text_frame_t> m_text_slab;
     std::mutex m_text_mutex;
-    std::mutex m_audio_mutex;
     int m_sslFlags;
     struct lws *m_wsi;
-    uint8_t *m_audio_buffer;
-    size_t m_audio_buffer_max_len;
-    size_t m_audio_buffer_write_offset;
+    BipBuffer m_audio_ring;
     size_t m_audio_buffer_min_freespace;
+    uint64_t m_audio_bytes_dropped;
     uint8_t* m_recv_buf;
     uint8_t* m_recv_buf_ptr;
     size_t m_recv_buf_len;
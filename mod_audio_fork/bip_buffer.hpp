@@ -0,0 +1,151 @@
+#ifndef __BIP_BUFFER_HPP__
+#define __BIP_BUFFER_HPP__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+namespace drachtio {
+
+/**
+ * single-producer / single-consumer lock-free bip buffer.
+ *
+ * Both sides always work on contiguous spans: the producer reserves space and writes
+ * into it in place, and the consumer peeks at the oldest contiguous run of data and
+ * hands it straight to the socket.  A fixed amount of headroom is kept in front of
+ * every span handed to the consumer, so that lws_write can prepend its framing
+ * (LWS_PRE) without a copy.
+ *
+ * The producer may also discard the oldest data when the consumer has stalled, as long
+ * as the consumer is not in the middle of reading it; the low bit of the read index is
+ * used as a "consumer busy" flag to make that safe.
+ */
+class BipBuffer {
+public:
+  BipBuffer(size_t capacity, size_t headroom) : m_capacity(capacity), m_headroom(headroom),
+    m_write(0), m_read(0), m_watermark(capacity), m_reserve_wrapped(false) {
+    m_storage = new uint8_t[headroom + capacity];
+    m_data = m_storage + headroom;
+  }
+  ~BipBuffer() {
+    delete [] m_storage;
+  }
+
+  size_t capacity(void) const { return m_capacity; }
+
+  /* producer side */
+
+  // returns the largest contiguous free span, provided it is at least minLen bytes long
+  uint8_t* reserve(size_t minLen, size_t& len) {
+    size_t w = m_write.load(std::memory_order_relaxed);
+    size_t r = m_read.load(std::memory_order_acquire) >> 1;
+
+    m_reserve_wrapped = false;
+    if (w >= r) {
+      if (m_capacity - w >= minLen) {
+        len = m_capacity - w;
+        return m_data + w;
+      }
+      // wrap to the start, staying clear of the consumer's headroom
+      if (r > minLen + m_headroom) {
+        m_reserve_wrapped = true;
+        len = r - m_headroom - 1;
+        return m_data;
+      }
+    }
+    else if (r - w > minLen + m_headroom) {
+      len = r - w - m_headroom - 1;
+      return m_data + w;
+    }
+    len = 0;
+    return nullptr;
+  }
+
+  // publishes len bytes written into the span returned by the last call to reserve
+  void commit(size_t len) {
+    if (0 == len) return;
+    if (m_reserve_wrapped) {
+      m_watermark.store(m_write.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      m_write.store(len, std::memory_order_release);
+    }
+    else {
+      m_write.store(m_write.load(std::memory_order_relaxed) + len, std::memory_order_release);
+    }
+    m_reserve_wrapped = false;
+  }
+
+  // discards up to len bytes of the oldest data; returns 0 if the consumer is busy or there is nothing to drop
+  size_t dropOldest(size_t len) {
+    size_t rs = m_read.load(std::memory_order_acquire);
+    if (rs & 1) return 0;
+
+    size_t start, avail;
+    readableSpan(rs >> 1, m_write.load(std::memory_order_relaxed), start, avail);
+    size_t n = std::min(len, avail);
+    if (0 == n) return 0;
+    if (!m_read.compare_exchange_strong(rs, (start + n) << 1, std::memory_order_acq_rel)) return 0;
+    return n;
+  }
+
+  /* consumer side */
+
+  // claims the oldest contiguous run of data; the m_headroom bytes in front of it may be scribbled on
+  uint8_t* peek(size_t& len) {
+    size_t r = m_read.fetch_or(1, std::memory_order_acq_rel) >> 1;
+    readableSpan(r, m_write.load(std::memory_order_acquire), m_peek_start, len);
+    return m_data + m_peek_start;
+  }
+
+  // releases the claim taken by peek, discarding len bytes
+  void consume(size_t len) {
+    m_read.store((m_peek_start + len) << 1, std::memory_order_release);
+  }
+
+  bool empty(void) const {
+    return (m_read.load(std::memory_order_acquire) >> 1) == m_write.load(std::memory_order_acquire);
+  }
+
+  // no copying
+  BipBuffer(const BipBuffer&) = delete;
+  void operator=(const BipBuffer&) = delete;
+
+private:
+  void readableSpan(size_t r, size_t w, size_t& start, size_t& len) const {
+    if (w >= r) {
+      start = r;
+      len = w - r;
+    }
+    else {
+      // the producer has wrapped; finish off the tail up to the watermark, then continue from the start
+      size_t wm = m_watermark.load(std::memory_order_relaxed);
+      if (r >= wm) {
+        start = 0;
+        len = w;
+      }
+      else {
+        start = r;
+        len = wm - r;
+      }
+    }
+  }
+
+  uint8_t* m_storage;
+  uint8_t* m_data;
+  size_t m_capacity;
+  size_t m_headroom;
+
+  std::atomic<size_t> m_write;
+  std::atomic<size_t> m_read;
+  std::atomic<size_t> m_watermark;
+
+  // producer-only state
+  bool m_reserve_wrapped;
+
+  // consumer-only state
+  size_t m_peek_start;
+};
+
+} // namespace drachtio
+
+#endif
@@ -19,16 +19,15 @@
 #include "audio_pipe.hpp"
 #include "vector_math.h"
 
-#include <boost/circular_buffer.hpp>
+#include "sample_ring.hpp"
 
-
-typedef boost::circular_buffer<uint16_t> CircularBuffer_t;
+typedef drachtio::SampleRing CircularBuffer_t;
 
 #define RTP_PACKETIZATION_PERIOD 20
 #define FRAME_SIZE_8000  320 /*which means each 20ms frame as 320 bytes at 8 khz (1 channel only)*/
 #define BUFFER_GROW_SIZE (16384)
-#define AUDIO_MARKER 0xFFFF
-#define MAX_MARKS (30)
+#define RESAMPLER_SLACK (64)
+#define MAX_MARKS (4096)
 
 namespace {
   static const char *requestedBufferSecs = std::getenv("MOD_AUDIO_FORK_BUFFER_SECS");
@@ -36,146 +35,176 @@ namespace {
   static const char *requestedNumServiceThreads = std::getenv("MOD_AUDIO_FORK_SERVICE_THREADS");
   static const char* mySubProtocolName = std::getenv("MOD_AUDIO_FORK_SUBPROTOCOL_NAME") ?
     std::getenv("MOD_AUDIO_FORK_SUBPROTOCOL_NAME") : "audio.drachtio.org";
-  static unsigned int nServiceThreads = std::max(1, std::min(requestedNumServiceThreads ? ::atoi(requestedNumServiceThreads) : 1, 5));
+  static unsigned int nServiceThreads = std::max(1, std::min(requestedNumServiceThreads ? ::atoi(requestedNumServiceThreads) : 1, MAX_SERVICE_THREADS));
+  static const char *requestedPlayAudioInMemory = std::getenv("MOD_AUDIO_FORK_PLAY_AUDIO_IN_MEMORY");
+  static bool playAudioInMemory = requestedPlayAudioInMemory && switch_true(requestedPlayAudioInMemory);
   static unsigned int idxCallCount = 0;
   static uint32_t playCount = 0;
 
+  /**
+   * "mark" bookkeeping for bidirectional audio.  A mark waits in inventory until the next audio arrives, and is then
+   * tagged with the stream position of the first sample that follows it: first in the prebuffer, and then in the
+   * playout buffer once that sample has been moved there.  Playout only has to compare its read position against
+   * the oldest mark, rather than scan the audio for in-band sentinels.  Guarded by tech_pvt->mutex.
+   */
+  struct audio_mark_t {
+    uint64_t position;
+    std::string name;
+  };
+  struct marks_t {
+    std::deque<std::string> inventory;
+    std::deque<audio_mark_t> prebuffered;
+    std::deque<audio_mark_t> queued;
+
+    size_t size(void) const { return inventory.size() + prebuffered.size() + queued.size(); }
+    void clear(void) {
+      inventory.clear();
+      prebuffered.clear();
+      queued.clear();
+    }
+  };
+
   static bool markCountExceeded(private_t* tech_pvt) {
-    if (nullptr != tech_pvt->pVecMarksInUse) {
-      std::deque<std::string>* pVecMarksInUse = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksInUse);
-      std::deque<std::string>* pVecMarksInInventory = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksInInventory);
-      return pVecMarksInUse->size()+ pVecMarksInInventory->size() >= MAX_MARKS;
+    if (nullptr != tech_pvt->pMarks) {
+      return static_cast<marks_t*>(tech_pvt->pMarks)->size() >= MAX_MARKS;
     }
     return false;
   }
 
-  switch_status_t processIncomingBinary(private_t* tech_pvt, switch_core_session_t* session, const char* message, size_t dataLength) {
-    std::vector<uint8_t> data;
-
-    // Prepend the set-aside byte if there is one
-    if (tech_pvt->has_set_aside_byte) {
-        data.push_back(tech_pvt->set_aside_byte);
-        tech_pvt->has_set_aside_byte = false;
+  // moves marks that precede the next prebuffered sample over to the playout buffer
+  static void promoteMarks(marks_t* marks, CircularBuffer_t* cBuffer, CircularBuffer_t* playoutBuffer) {
+    while (!marks->prebuffered.empty() && marks->prebuffered.front().position <= cBuffer->readPosition()) {
+      audio_mark_t mark = { playoutBuffer->writePosition(), std::move(marks->prebuffered.front().name) };
+      marks->queued.push_back(std::move(mark));
+      marks->prebuffered.pop_front();
     }
+  }
 
-    // Append the new incoming message
-    data.insert(data.end(), message, message + dataLength);
-
-    // Check if the total data length is now odd
-    if (data.size() % 2 != 0) {
-        // Set aside the last byte
-        tech_pvt->set_aside_byte = data.back();
-        tech_pvt->has_set_aside_byte = true;
-        data.pop_back(); // Remove the last byte from the data vector
+  // appends audio to the playout buffer, resampling from inRate to outRate straight into its free space if needed
+  void appendToPlayout(CircularBuffer_t* playoutBuffer, SpeexResamplerState* resampler, int inRate, int outRate,
+    const int16_t* in, size_t numSamples) {
+    if (!resampler) {
+      playoutBuffer->reserve(numSamples, BUFFER_GROW_SIZE);
+      playoutBuffer->write(in, numSamples);
+      return;
     }
 
-    // Convert the data to 16-bit elements
-    const uint16_t* data_uint16 = reinterpret_cast<const uint16_t*>(data.data());
-    size_t numSamples = data.size() / sizeof(uint16_t);
+    while (numSamples > 0) {
+      // room for the converted samples, plus whatever the resampler may be holding back
+      playoutBuffer->reserve(numSamples * outRate / inRate + RESAMPLER_SLACK, BUFFER_GROW_SIZE);
 
-    // Access the prebuffer
-    CircularBuffer_t* cBuffer = static_cast<CircularBuffer_t*>(tech_pvt->streamingPreBuffer);
+      size_t space;
+      int16_t* out = playoutBuffer->writeSpan(space);
+      spx_uint32_t in_len = numSamples;
+      spx_uint32_t out_len = space;
+      speex_resampler_process_interleaved_int(resampler, in, &in_len, out, &out_len);
+      playoutBuffer->commit(out_len);
 
-    int numMarkers = 0;
-    std::deque<std::string>* pVecMarksInInventory = nullptr;
-    std::deque<std::string>* pVecMarksInUse = nullptr;
-    if (nullptr != tech_pvt->pVecMarksInInventory) {
-      pVecMarksInInventory = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksInInventory);
-      pVecMarksInUse = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksInUse);
-      numMarkers = pVecMarksInInventory->size();
-
-      // move inventory to in-use
-      pVecMarksInUse->insert(pVecMarksInUse->end(), pVecMarksInInventory->begin(), pVecMarksInInventory->end());
-      pVecMarksInInventory->clear();
-    }
-  
-    // Ensure the prebuffer has enough capacity
-    if (cBuffer->capacity() - cBuffer->size() < numSamples + numMarkers) {
-        size_t newCapacity = cBuffer->size() + std::max(numSamples + numMarkers, (size_t)BUFFER_GROW_SIZE);
-        cBuffer->set_capacity(newCapacity);
+      if (0 == in_len && 0 == out_len) break;
+      in += in_len;
+      numSamples -= in_len;
     }
+  }
 
-    // prepend any markers
-    while (numMarkers-- > 0) {
-      cBuffer->push_back(AUDIO_MARKER);
-    }
-
-    // Append the data to the prebuffer
-    cBuffer->insert(cBuffer->end(), data_uint16, data_uint16 + numSamples);
-    //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Appended %zu 16-bit samples to the prebuffer.\n", numSamples);
-
-    // if we haven't reached threshold amount of prebuffered data, return
-    if (cBuffer->size() < tech_pvt->streamingPreBufSize) {
-        //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Prebuffered data is below threshold %u, returning.\n", tech_pvt->streamingPreBufSize);
-        return SWITCH_STATUS_SUCCESS;
-    }
-
-    //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Prebuffered data samples %u is above threshold %u, prepare to playout.\n", cBuffer->size(), tech_pvt->streamingPreBufSize);
-
-    // after initial pre-buffering, rachet down the threshold to 40ms
-    tech_pvt->streamingPreBufSize = 320 * tech_pvt->downscale_factor * 2;
-
-    // Check for downsampling factor
-    size_t downsample_factor = tech_pvt->downscale_factor;
-
-    // Calculate the number of samples that can be evenly divided by the downsample factor
-    size_t numCompleteSamples = (cBuffer->size() / downsample_factor) * downsample_factor;
-
-    // Handle leftover samples
-    std::vector<uint16_t> leftoverSamples;
-    size_t numLeftoverSamples = cBuffer->size() - numCompleteSamples;
-    if (numLeftoverSamples > 0) {
-        leftoverSamples.assign(cBuffer->end() - numLeftoverSamples, cBuffer->end());
-        cBuffer->resize(numCompleteSamples);
-        //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Temporarily removing %u leftover samples due to downsampling.\n", numLeftoverSamples);
+  switch_status_t processIncomingBinary(private_t* tech_pvt, switch_core_session_t* session, const char* message, size_t dataLength) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(message);
+    CircularBuffer_t* cBuffer = static_cast<CircularBuffer_t*>(tech_pvt->streamingPreBuffer);
+    CircularBuffer_t* playoutBuffer = static_cast<CircularBuffer_t*>(tech_pvt->streamingPlayoutBuffer);
+
+    // any marks in inventory go in front of this audio
+    marks_t* marks = static_cast<marks_t*>(tech_pvt->pMarks);
+    if (nullptr != marks && nullptr != tech_pvt->mutex) {
+      switch_mutex_lock(tech_pvt->mutex);
+      while (!marks->inventory.empty()) {
+        audio_mark_t mark = { cBuffer->writePosition(), std::move(marks->inventory.front()) };
+        marks->prebuffered.push_back(std::move(mark));
+        marks->inventory.pop_front();
+      }
+      switch_mutex_unlock(tech_pvt->mutex);
     }
 
-    // resample if necessary
-    std::vector<int16_t> out;
     try {
-      if (tech_pvt->bidirectional_audio_resampler) {
-        // Improvement: Use assign to convert circular buffer to vector for resampling
-        std::vector<int16_t> in;
-        in.assign(cBuffer->begin(), cBuffer->end()); 
-        out.resize(in.size() * 6); // max upsampling would be from 8k -> 48k
-
-        spx_uint32_t in_len = in.size();
-        spx_uint32_t out_len = out.size();
-
-        //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Resampling %u samples into a buffer that can hold %u samples\n", in.size(), out_len);
+      cBuffer->reserve(1 + dataLength / sizeof(int16_t), BUFFER_GROW_SIZE);
 
-        speex_resampler_process_interleaved_int(tech_pvt->bidirectional_audio_resampler, in.data(), &in_len, out.data(), &out_len);
-
-        // Resize the output buffer to match the output length from resampler
-        //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Resizing output buffer from %u to %u samples\n", in.size(), out_len);
+      // complete the sample that was split across messages with the byte set aside last time
+      if (tech_pvt->has_set_aside_byte && dataLength > 0) {
+        uint8_t sample[sizeof(int16_t)] = { tech_pvt->set_aside_byte, data[0] };
+        cBuffer->write(sample, 1);
+        tech_pvt->has_set_aside_byte = false;
+        data++;
+        dataLength--;
+      }
 
-        out.resize(out_len);
+      // and set aside a trailing odd byte for the next one
+      if (dataLength % 2 != 0) {
+        tech_pvt->set_aside_byte = data[--dataLength];
+        tech_pvt->has_set_aside_byte = true;
       }
-      else {
-        // If no resampling is needed, copy the data from the prebuffer to the output buffer
-        out.assign(cBuffer->begin(), cBuffer->end());
+      size_t numSamples = dataLength / sizeof(int16_t);
+
+      /**
+       * a message that meets the prebuffer threshold on its own, with nothing already staged ahead of it,
+       * goes straight from the websocket buffer into the playout buffer, as long as it is suitably aligned
+       */
+      if (cBuffer->empty() && numSamples >= (size_t) tech_pvt->streamingPreBufSize &&
+        0 == (reinterpret_cast<uintptr_t>(data) & (alignof(int16_t) - 1)) &&
+        nullptr != tech_pvt->mutex && switch_mutex_trylock(tech_pvt->mutex) == SWITCH_STATUS_SUCCESS) {
+        try {
+          if (nullptr != marks) promoteMarks(marks, cBuffer, playoutBuffer);
+          appendToPlayout(playoutBuffer, tech_pvt->bidirectional_audio_resampler, tech_pvt->bidirectional_audio_sample_rate,
+            tech_pvt->channel_sampling, reinterpret_cast<const int16_t*>(data), numSamples);
+        } catch (...) {
+          switch_mutex_unlock(tech_pvt->mutex);
+          throw;
+        }
+        switch_mutex_unlock(tech_pvt->mutex);
+
+        // after initial pre-buffering, rachet down the threshold to 40ms
+        tech_pvt->streamingPreBufSize = 320 * tech_pvt->downscale_factor * 2;
+        return SWITCH_STATUS_SUCCESS;
       }
+
+      // otherwise stage it in the prebuffer
+      cBuffer->write(data, numSamples);
     } catch (const std::exception& e) {
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Error resampling incoming binary message: %s\n", e.what());
+      cBuffer->clear();
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Error processing incoming binary message: %s\n", e.what());
       return SWITCH_STATUS_FALSE;
     } catch (...) {
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Error resampling incoming binary message\n");
+      cBuffer->clear();
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Error processing incoming binary message\n");
       return SWITCH_STATUS_FALSE;
     }
+    //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Appended %zu 16-bit samples to the prebuffer.\n", numSamples);
+
+    // if we haven't reached threshold amount of prebuffered data, return
+    if (cBuffer->size() < (size_t) tech_pvt->streamingPreBufSize) {
+        //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Prebuffered data is below threshold %u, returning.\n", tech_pvt->streamingPreBufSize);
+        return SWITCH_STATUS_SUCCESS;
+    }
+
+    //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Prebuffered data samples %u is above threshold %u, prepare to playout.\n", cBuffer->size(), tech_pvt->streamingPreBufSize);
 
     if (nullptr != tech_pvt->mutex && switch_mutex_trylock(tech_pvt->mutex) == SWITCH_STATUS_SUCCESS) {
-      CircularBuffer_t *playoutBuffer = (CircularBuffer_t *) tech_pvt->streamingPlayoutBuffer;
+      // after initial pre-buffering, rachet down the threshold to 40ms
+      tech_pvt->streamingPreBufSize = 320 * tech_pvt->downscale_factor * 2;
 
       try {
-        // Resize the buffer if necessary
-        if (playoutBuffer->capacity() - playoutBuffer->size() < out.size()) {
-          size_t newCapacity = playoutBuffer->size() + std::max(out.size(), (size_t)BUFFER_GROW_SIZE);
-          playoutBuffer->set_capacity(newCapacity);
-          //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Resized playout buffer to new capacity: %zu\n", newCapacity);
+        // drain the prebuffer a contiguous segment at a time, stopping at each mark to carry it across
+        while (true) {
+          if (nullptr != marks) promoteMarks(marks, cBuffer, playoutBuffer);
+          if (cBuffer->empty()) break;
+
+          size_t len;
+          const int16_t* samples = cBuffer->readSpan(len);
+          if (nullptr != marks && !marks->prebuffered.empty()) {
+            len = std::min(len, static_cast<size_t>(marks->prebuffered.front().position - cBuffer->readPosition()));
+          }
+          appendToPlayout(playoutBuffer, tech_pvt->bidirectional_audio_resampler, tech_pvt->bidirectional_audio_sample_rate,
+            tech_pvt->channel_sampling, samples, len);
+          cBuffer->consume(len);
         }
-        // Push the data into the buffer.
-        playoutBuffer->insert(playoutBuffer->end(), out.begin(), out.end());
-        //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Appended %zu 16-bit samples to the playout buffer.\n", out.size());
+        //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Appended %zu 16-bit samples to the playout buffer.\n", playoutBuffer->size());
       } catch (const std::exception& e) {
         switch_mutex_unlock(tech_pvt->mutex);
         cBuffer->clear();
@@ -188,13 +217,6 @@ namespace {
         return SWITCH_STATUS_FALSE;
       }
       switch_mutex_unlock(tech_pvt->mutex);
-      cBuffer->clear();
-
-      // Put the leftover samples back in the prebuffer for the next time
-      if (!leftoverSamples.empty()) {
-          cBuffer->insert(cBuffer->end(), leftoverSamples.begin(), leftoverSamples.end());
-          //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Put back %u leftover samples into the prebuffer.\n", leftoverSamples.size());
-      }
       return SWITCH_STATUS_SUCCESS;
     }
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Failed to get mutext (temp)\n");
@@ -202,6 +224,92 @@ namespace {
     return SWITCH_STATUS_SUCCESS;
   }
 
+  static uint32_t readLE32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+  }
+
+  // narrows a WAVE file down to its samples, provided they are 16-bit mono PCM
+  static bool findWavePcm(const uint8_t*& data, size_t& len, int& sampleRate) {
+    if (len < 12 || 0 != memcmp(data, "RIFF", 4) || 0 != memcmp(data + 8, "WAVE", 4)) return false;
+
+    bool haveFormat = false;
+    size_t offset = 12;
+    while (offset + 8 <= len) {
+      const uint8_t* chunk = data + offset;
+      const uint8_t* body = chunk + 8;
+      size_t chunkLen = readLE32(chunk + 4);
+      size_t available = len - offset - 8;
+
+      if (0 == memcmp(chunk, "fmt ", 4)) {
+        if (chunkLen < 16 || available < 16) return false;
+        int format = body[0] | (body[1] << 8);
+        int channels = body[2] | (body[3] << 8);
+        int bitsPerSample = body[14] | (body[15] << 8);
+        sampleRate = readLE32(body + 4);
+        if (1 != format || 1 != channels || 16 != bitsPerSample || sampleRate <= 0) return false;
+        haveFormat = true;
+      }
+      else if (0 == memcmp(chunk, "data", 4)) {
+        if (!haveFormat) return false;
+
+        // streamed WAVE files often carry a placeholder length for the data chunk
+        data = body;
+        len = std::min(chunkLen, available);
+        return true;
+      }
+      offset += 8 + chunkLen + (chunkLen & 1);
+    }
+    return false;
+  }
+
+  // queues playAudio content straight onto the channel; returns false if it has to be played from a file instead
+  static bool queuePlayAudio(private_t* tech_pvt, const uint8_t* audio, size_t len, bool isWave, int sampleRate) {
+    const uint8_t* pcm = audio;
+    size_t pcmLen = len;
+    CircularBuffer_t* playoutBuffer = static_cast<CircularBuffer_t*>(tech_pvt->streamingPlayoutBuffer);
+
+    if (nullptr == tech_pvt->mutex || nullptr == playoutBuffer) return false;
+    if (isWave && !findWavePcm(pcm, pcmLen, sampleRate)) return false;
+    if (0 != (reinterpret_cast<uintptr_t>(pcm) & (alignof(int16_t) - 1))) return false;
+
+    switch_mutex_lock(tech_pvt->mutex);
+
+    SpeexResamplerState* resampler = nullptr;
+    if (sampleRate != tech_pvt->channel_sampling) {
+      if (tech_pvt->play_audio_resampler && tech_pvt->play_audio_sample_rate != sampleRate) {
+        speex_resampler_destroy(tech_pvt->play_audio_resampler);
+        tech_pvt->play_audio_resampler = nullptr;
+      }
+      if (!tech_pvt->play_audio_resampler) {
+        int err;
+        tech_pvt->play_audio_resampler = speex_resampler_init(1, sampleRate, tech_pvt->channel_sampling, SWITCH_RESAMPLE_QUALITY, &err);
+        if (0 != err) {
+          tech_pvt->play_audio_resampler = nullptr;
+          switch_mutex_unlock(tech_pvt->mutex);
+          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) queuePlayAudio - error initializing resampler: %s.\n",
+            tech_pvt->id, speex_resampler_strerror(err));
+          return false;
+        }
+        tech_pvt->play_audio_sample_rate = sampleRate;
+      }
+      resampler = tech_pvt->play_audio_resampler;
+    }
+
+    try {
+      appendToPlayout(playoutBuffer, resampler, sampleRate, tech_pvt->channel_sampling,
+        reinterpret_cast<const int16_t*>(pcm), pcmLen / sizeof(int16_t));
+    } catch (const std::exception& e) {
+      switch_mutex_unlock(tech_pvt->mutex);
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) queuePlayAudio - error queueing audio: %s\n", tech_pvt->id, e.what());
+      return false;
+    }
+    switch_mutex_unlock(tech_pvt->mutex);
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) queuePlayAudio - queued %u samples at %d Hz for playout\n",
+      tech_pvt->id, (unsigned int) (pcmLen / sizeof(int16_t)), sampleRate);
+    return true;
+  }
+
   void processIncomingMessage(private_t* tech_pvt, switch_core_session_t* session, const char* message) {
     std::string msg = message;
     std::string type;
@@ -247,6 +355,7 @@ namespace {
                 break;
               default:
                 strcpy(fileType, ".r16");
+                sampleRate = 16000;
                 break;
             }
           }
@@ -259,24 +368,30 @@ namespace {
           }
 
           if (validAudio) {
-            char szFilePath[256];
-
-            std::string rawAudio = drachtio::base64_decode(jsonAudio->valuestring);
-            switch_snprintf(szFilePath, 256, "%s%s%s_%d.tmp%s", SWITCH_GLOBAL_dirs.temp_dir, 
-              SWITCH_PATH_SEPARATOR, tech_pvt->sessionId, playCount++, fileType);
-            std::ofstream f(szFilePath, std::ofstream::binary);
-            f << rawAudio;
-            f.close();
-
-            // add the file to the list of files played for this session, we'll delete when session closes
-            struct playout* playout = (struct playout *) malloc(sizeof(struct playout));
-            playout->file = (char *) malloc(strlen(szFilePath) + 1);
-            strcpy(playout->file, szFilePath);
-            playout->next = tech_pvt->playout;
-            tech_pvt->playout = playout;
-
-            jsonFile = cJSON_CreateString(szFilePath);
-            cJSON_AddItemToObject(jsonData, "file", jsonFile);
+            // we own the detached audioContent string, so decode it in place rather than into a copy
+            uint8_t* rawAudio = reinterpret_cast<uint8_t*>(jsonAudio->valuestring);
+            size_t rawAudioLen = drachtio::base64_decode(jsonAudio->valuestring, strlen(jsonAudio->valuestring), rawAudio);
+
+            // play it straight out of memory if we can, otherwise leave it in a file for the application to play
+            if (!playAudioInMemory || !queuePlayAudio(tech_pvt, rawAudio, rawAudioLen, 0 == strcmp(fileType, ".wav"), sampleRate)) {
+              char szFilePath[256];
+
+              switch_snprintf(szFilePath, 256, "%s%s%s_%d.tmp%s", SWITCH_GLOBAL_dirs.temp_dir, 
+                SWITCH_PATH_SEPARATOR, tech_pvt->sessionId, playCount++, fileType);
+              std::ofstream f(szFilePath, std::ofstream::binary);
+              f.write(reinterpret_cast<const char*>(rawAudio), rawAudioLen);
+              f.close();
+
+              // add the file to the list of files played for this session, we'll delete when session closes
+              struct playout* playout = (struct playout *) malloc(sizeof(struct playout));
+              playout->file = (char *) malloc(strlen(szFilePath) + 1);
+              strcpy(playout->file, szFilePath);
+              playout->next = tech_pvt->playout;
+              tech_pvt->playout = playout;
+
+              jsonFile = cJSON_CreateString(szFilePath);
+              cJSON_AddItemToObject(jsonData, "file", jsonFile);
+            }
           }
 
           char* jsonString = cJSON_PrintUnformatted(jsonData);
@@ -307,27 +422,22 @@ namespace {
               switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "(%u) processIncomingMessage - mark count exceeded, discarding mark %s\n", tech_pvt->id, cJSON_GetStringValue(name));
             }
             else {
-              if (nullptr == tech_pvt->pVecMarksInInventory) {
-                tech_pvt->pVecMarksInInventory = static_cast<void *>(new std::deque<std::string>());
-                tech_pvt->pVecMarksInUse = static_cast<void *>(new std::deque<std::string>());
-                tech_pvt->pVecMarksCleared = static_cast<void *>(new std::deque<std::string>());
+              switch_mutex_lock(tech_pvt->mutex);
+              if (nullptr == tech_pvt->pMarks) {
+                tech_pvt->pMarks = static_cast<void *>(new marks_t());
               }
-              std::deque<std::string>* pVec = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksInInventory);
-              pVec->push_back(name->valuestring);
+              static_cast<marks_t*>(tech_pvt->pMarks)->inventory.push_back(name->valuestring);
+              switch_mutex_unlock(tech_pvt->mutex);
             }
           }
         }
       }
       else if (0 == type.compare("clearMarks")) {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) processIncomingMessage - received clearMarks\n", tech_pvt->id);
-        if (nullptr != tech_pvt->pVecMarksInInventory) {
-          std::deque<std::string>* pVecMarksInInventory = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksInInventory);
-          std::deque<std::string>* pVecMarksInUse = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksInUse);
-          std::deque<std::string>* pVecMarksCleared = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksCleared);
-          pVecMarksCleared->insert(pVecMarksCleared->end(), pVecMarksInUse->begin(), pVecMarksInUse->end());
-          pVecMarksCleared->insert(pVecMarksCleared->end(), pVecMarksInInventory->begin(), pVecMarksInInventory->end());
-          pVecMarksInInventory->clear();
-          pVecMarksInUse->clear();
+        if (nullptr != tech_pvt->pMarks) {
+          switch_mutex_lock(tech_pvt->mutex);
+          static_cast<marks_t*>(tech_pvt->pMarks)->clear();
+          switch_mutex_unlock(tech_pvt->mutex);
         }
       }
       else if (0 == type.compare("transcription")) {
@@ -466,6 +576,7 @@ namespace {
     tech_pvt->port = port;
     strncpy(tech_pvt->path, path, MAX_PATH_LEN);    
     tech_pvt->sampling = desiredSampling;
+    tech_pvt->channel_sampling = sampling;
     tech_pvt->responseHandler = responseHandler;
     tech_pvt->playout = NULL;
     tech_pvt->channels = channels;
@@ -486,9 +597,7 @@ namespace {
     }
     tech_pvt->streamingPreBufSize = 320 * tech_pvt->downscale_factor * 4; // min 80ms prebuffer
     tech_pvt->streamingPreBuffer = (void *) new CircularBuffer_t(8192);
-    tech_pvt->pVecMarksInInventory = nullptr;
-    tech_pvt->pVecMarksInUse = nullptr;
-    tech_pvt->pVecMarksCleared = nullptr;
+    tech_pvt->pMarks = nullptr;
 
     strncpy(tech_pvt->bugname, bugname, MAX_BUG_LEN);
     if (metadata) strncpy(tech_pvt->initialMetadata, metadata, MAX_METADATA_LEN);
@@ -542,6 +651,10 @@ namespace {
       speex_resampler_destroy(tech_pvt->bidirectional_audio_resampler);
       tech_pvt->bidirectional_audio_resampler = nullptr;
     }
+    if (tech_pvt->play_audio_resampler) {
+      speex_resampler_destroy(tech_pvt->play_audio_resampler);
+      tech_pvt->play_audio_resampler = nullptr;
+    }
     if (tech_pvt->mutex) {
       switch_mutex_destroy(tech_pvt->mutex);
       tech_pvt->mutex = nullptr;
@@ -557,13 +670,9 @@ namespace {
       tech_pvt->streamingPreBuffer = nullptr;
     }
 
-    if (tech_pvt->pVecMarksInInventory) {
-      delete static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksInInventory);
-      tech_pvt->pVecMarksInInventory = nullptr;
-      delete static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksInUse);
-      tech_pvt->pVecMarksInUse = nullptr;
-      delete static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksCleared);
-      tech_pvt->pVecMarksCleared = nullptr;
+    if (tech_pvt->pMarks) {
+      delete static_cast<marks_t*>(tech_pvt->pMarks);
+      tech_pvt->pMarks = nullptr;
     }
   }
 
@@ -676,14 +785,20 @@ extern "C" {
   switch_status_t fork_init() {
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: audio buffer (in secs):    %d secs\n", nAudioBufferSecs);
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: sub-protocol:              %s\n", mySubProtocolName);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: lws service threads:       %d\n", nServiceThreads);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: playAudio from memory:     %s\n", playAudioInMemory ? "yes" : "no");
  
     //int logs = LLL_ERR | LLL_WARN | LLL_NOTICE | LLL_INFO | LLL_PARSER | LLL_HEADER | LLL_EXT | LLL_CLIENT  | LLL_LATENCY | LLL_DEBUG ;
     int logs = LLL_ERR | LLL_WARN | LLL_NOTICE;
-    drachtio::AudioPipe::initialize(mySubProtocolName, logs, lws_logger);
+    drachtio::AudioPipe::initialize(mySubProtocolName, nServiceThreads, logs, lws_logger);
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork successfully initialized\n");
     return SWITCH_STATUS_SUCCESS;
   }
 
+  switch_bool_t fork_play_audio_in_memory() {
+    return playAudioInMemory ? SWITCH_TRUE : SWITCH_FALSE;
+  }
+
   switch_status_t fork_cleanup() {
     bool cleanup = false;
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork unloading..\n");
@@ -696,6 +811,16 @@ extern "C" {
     return SWITCH_STATUS_FALSE;
   }
 
+  switch_status_t fork_stats(switch_stream_handle_t *stream) {
+    drachtio::AudioPipe::service_stats_t stats[MAX_SERVICE_THREADS];
+    unsigned int n = drachtio::AudioPipe::getServiceStats(stats, MAX_SERVICE_THREADS);
+    for (unsigned int i = 0; i < n; i++) {
+      stream->write_function(stream, "service thread %u: pipes %u, write requests %lu, coalesced %lu, wakeups %lu, wakeups avoided %lu\n",
+        i, stats[i].pipes, stats[i].writesRequested, stats[i].writesCoalesced, stats[i].wakeups, stats[i].wakeupsAvoided);
+    }
+    return SWITCH_STATUS_SUCCESS;
+  }
+
   switch_status_t fork_session_init(switch_core_session_t *session, 
     responseHandler_t responseHandler,
     uint32_t samples_per_second, 
@@ -855,34 +980,35 @@ extern "C" {
         return SWITCH_TRUE;
       }
 
-      pAudioPipe->lockAudioBuffer();
-      size_t available = pAudioPipe->binarySpaceAvailable();
+      bool dropped = false;
+      size_t available = 0;
       if (NULL == tech_pvt->resampler) {
+        uint8_t discard[SWITCH_RECOMMENDED_BUFFER_SIZE];
         switch_frame_t frame = { 0 };
-        frame.data = pAudioPipe->binaryWritePtr();
-        frame.buflen = available;
         while (true) {
+          frame.data = pAudioPipe->binaryWriteReserve(available, dropped);
+          frame.buflen = available;
 
-          // check if buffer would be overwritten; dump packets if so
-          if (available < pAudioPipe->binaryMinSpace()) {
+          // if buffer would be overwritten the oldest packets are dumped to make room
+          if (dropped) {
             if (!tech_pvt->buffer_overrun_notified) {
               tech_pvt->buffer_overrun_notified = 1;
               tech_pvt->responseHandler(session, EVENT_BUFFER_OVERRUN, NULL);
             }
             switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) dropping packets!\n", 
               tech_pvt->id);
-            pAudioPipe->binaryWritePtrResetToZero();
+          }
 
-            frame.data = pAudioPipe->binaryWritePtr();
-            frame.buflen = available = pAudioPipe->binarySpaceAvailable();
+          // no room at all (the lws thread is mid-send of the oldest data): read the frame and discard it
+          if (nullptr == frame.data) {
+            frame.data = discard;
+            frame.buflen = sizeof(discard);
           }
 
           switch_status_t rv = switch_core_media_bug_read(bug, &frame, SWITCH_TRUE);
           if (rv != SWITCH_STATUS_SUCCESS) break;
-          if (frame.datalen) {
-            pAudioPipe->binaryWritePtrAdd(frame.datalen);
-            frame.buflen = available = pAudioPipe->binarySpaceAvailable();
-            frame.data = pAudioPipe->binaryWritePtr();
+          if (frame.datalen && frame.data != discard) {
+            pAudioPipe->binaryWriteCommit(frame.datalen);
             dirty = true;
           }
         }
@@ -894,36 +1020,35 @@ extern "C" {
         frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
         while (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS) {
           if (frame.datalen) {
-            spx_uint32_t out_len = available >> 1;  // space for samples which are 2 bytes
+            char* out = pAudioPipe->binaryWriteReserve(available, dropped);
+            if (dropped && !tech_pvt->buffer_overrun_notified) {
+              tech_pvt->buffer_overrun_notified = 1;
+              switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) dropping packets!\n", 
+                tech_pvt->id);
+              tech_pvt->responseHandler(session, EVENT_BUFFER_OVERRUN, NULL);
+            }
+            if (nullptr == out) continue;
+
+            spx_uint32_t out_len = available >> tech_pvt->channels;  // space for samples which are 2 bytes per channel
             spx_uint32_t in_len = frame.samples;
 
             speex_resampler_process_interleaved_int(tech_pvt->resampler, 
               (const spx_int16_t *) frame.data, 
               (spx_uint32_t *) &in_len, 
-              (spx_int16_t *) ((char *) pAudioPipe->binaryWritePtr()),
+              (spx_int16_t *) out,
               &out_len);
 
             if (out_len > 0) {
               // bytes written = num samples * 2 * num channels
               size_t bytes_written = out_len << tech_pvt->channels;
-              pAudioPipe->binaryWritePtrAdd(bytes_written);
-              available = pAudioPipe->binarySpaceAvailable();
+              pAudioPipe->binaryWriteCommit(bytes_written);
               dirty = true;
             }
-            if (available < pAudioPipe->binaryMinSpace()) {
-              if (!tech_pvt->buffer_overrun_notified) {
-                tech_pvt->buffer_overrun_notified = 1;
-                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) dropping packets!\n", 
-                  tech_pvt->id);
-                tech_pvt->responseHandler(session, EVENT_BUFFER_OVERRUN, NULL);
-              }
-              break;
-            }
           }
         }
       }
 
-      pAudioPipe->unlockAudioBuffer();
+      if (dirty) pAudioPipe->binaryWriteFlush();
       switch_mutex_unlock(tech_pvt->mutex);
     }
     return SWITCH_TRUE;
@@ -940,25 +1065,24 @@ extern "C" {
         tech_pvt->clear_bidirectional_audio_buffer = false;
 
         // send "mark" event for any queued markers
-        if (nullptr != tech_pvt->pVecMarksInInventory) {
-          std::deque<std::string>* pVecMarksInInventory = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksInInventory);
-          std::deque<std::string>* pVecMarksInUse = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksInUse);
-          if (pVecMarksInInventory->size() + pVecMarksInUse->size() > 0) {
-            std::deque<std::string> vec = *pVecMarksInUse;
-            vec.insert(vec.end(), pVecMarksInInventory->begin(), pVecMarksInInventory->end());
-            for (auto it = vec.begin(); it != vec.end(); ++it) {
-              switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "(%u) dub_speech_frame - Marker %s cleared\n",
-                  tech_pvt->id, it->c_str());
-              send_mark_event(tech_pvt, it->c_str(), true);
-            }
-
-            // put the "in-use" ones into the "cleared" queue so we dont notify again when they eventually come through
-            std::deque<std::string>* pVecMarksCleared = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksCleared);
-            pVecMarksCleared->insert(pVecMarksCleared->end(), pVecMarksInUse->begin(), pVecMarksInUse->end());
-
-            pVecMarksInUse->clear();
-            pVecMarksInInventory->clear();
+        marks_t* marks = static_cast<marks_t*>(tech_pvt->pMarks);
+        if (nullptr != marks && marks->size() > 0) {
+          for (const auto& mark : marks->queued) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "(%u) dub_speech_frame - Marker %s cleared\n",
+                tech_pvt->id, mark.name.c_str());
+            send_mark_event(tech_pvt, mark.name.c_str(), true);
+          }
+          for (const auto& mark : marks->prebuffered) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "(%u) dub_speech_frame - Marker %s cleared\n",
+                tech_pvt->id, mark.name.c_str());
+            send_mark_event(tech_pvt, mark.name.c_str(), true);
           }
+          for (const auto& name : marks->inventory) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "(%u) dub_speech_frame - Marker %s cleared\n",
+                tech_pvt->id, name.c_str());
+            send_mark_event(tech_pvt, name.c_str(), true);
+          }
+          marks->clear();
         }
       }
       else {
@@ -969,73 +1093,31 @@ extern "C" {
         rframe->datalen = rframe->samples * sizeof(int16_t);
 
         int16_t data[SWITCH_RECOMMENDED_BUFFER_SIZE];
-        memset(data, 0, sizeof(data));
-
         int samplesToCopy = std::min(static_cast<int>(cBuffer->size()), static_cast<int>(rframe->samples));
 
         //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) dub_speech_frame - samples to copy %u\n", tech_pvt->id, samplesToCopy); 
 
-        bool hasMarkers = false;
-        std::deque<std::string>* pVecInventory = nullptr;
-        std::deque<std::string>* pVecInUse = nullptr;
-        std::deque<std::string>* pVecCleared = nullptr;
-        if (tech_pvt->pVecMarksInInventory && tech_pvt->pVecMarksInUse && tech_pvt->pVecMarksCleared) {
-          pVecInventory = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksInInventory);
-          pVecInUse = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksInUse);
-          pVecCleared = static_cast<std::deque<std::string>*>(tech_pvt->pVecMarksCleared);
-          hasMarkers = pVecInUse->size() + pVecCleared->size() >  0;
+        cBuffer->read(data, samplesToCopy);
+        if (samplesToCopy > 0) {
+          vector_add(fp, data, samplesToCopy);
         }
 
-        if (hasMarkers) {
-          /* discard markers and send notifications */
-          auto bufferIter = cBuffer->begin();
-          auto dataIter = data;
-          for (int i = 0; i < samplesToCopy; ++i) {
-            if (*bufferIter == AUDIO_MARKER) {
-              // Marker detected, discard it and send a notice unless it was previously cleared
-              auto * pVec = pVecCleared->size() > 0 ? pVecCleared : pVecInUse;
-              if (!pVec->empty()) {
-                auto name = pVec->front();
-                pVec->pop_front();
-
-                if (pVec == pVecInUse) {
-                  send_mark_event(tech_pvt, name.c_str());
-                  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) dub_speech_frame - Marker %s detected in playout\n",
-                    tech_pvt->id, name.c_str());
-                }
-                else {
-                  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) dub_speech_frame - Marker %s detected in playout but previously cleared\n",
-                    tech_pvt->id, name.c_str());
-                }
-              }
-            } else {
-              // Copy valid audio samplewhat 
-              *dataIter = *bufferIter;
-              ++dataIter;
-            }
-            ++bufferIter;
-          }
-
-          // Remove the processed samples (including discarded markers) from the buffer
-          cBuffer->erase(cBuffer->begin(), cBuffer->begin() + samplesToCopy);
-
-          // Adjust the number of samples copied to the output frame
-          int validSamplesCopied = std::distance(data, dataIter);
-
-          if (validSamplesCopied > 0) {
-            vector_add(fp, data, validSamplesCopied);
+        marks_t* marks = static_cast<marks_t*>(tech_pvt->pMarks);
+        if (nullptr != marks) {
+          // a mark has played out once the sample that follows it has, or once all the audio in front of it has
+          while (!marks->queued.empty() && (marks->queued.front().position < cBuffer->readPosition() ||
+            (cBuffer->empty() && marks->queued.front().position == cBuffer->readPosition()))) {
+            const std::string& name = marks->queued.front().name;
+            send_mark_event(tech_pvt, name.c_str());
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) dub_speech_frame - Marker %s detected in playout\n",
+              tech_pvt->id, name.c_str());
+            marks->queued.pop_front();
           }
-        }
-        else {
-          std::copy_n(cBuffer->begin(), samplesToCopy, data);
-          cBuffer->erase(cBuffer->begin(), cBuffer->begin() + samplesToCopy);
 
-          if (samplesToCopy > 0) {
-            vector_add(fp, data, rframe->samples);
-          } else if (pVecInventory && pVecInventory->size()) {
+          if (0 == samplesToCopy && marks->prebuffered.empty() && !marks->inventory.empty()) {
             // no bidirectional audio to dub but still have some mark in inventory, send them now
-            auto name = pVecInventory->front();
-            pVecInventory->pop_front();
+            auto name = marks->inventory.front();
+            marks->inventory.pop_front();
 
             send_mark_event(tech_pvt, name.c_str());
             switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) dub_speech_frame - Marker %s detected in inventory\n",
@@ -7,6 +7,8 @@ int parse_ws_uri(switch_channel_t *channel, const char* szServerUri, char* host,
 
 switch_status_t fork_init();
 switch_status_t fork_cleanup();
+switch_status_t fork_stats(switch_stream_handle_t *stream);
+switch_bool_t fork_play_audio_in_memory();
 switch_status_t fork_session_init(switch_core_session_t *session, responseHandler_t responseHandler,
   uint32_t samples_per_second, char *host, unsigned int port, char* path, int sampling, int sslFlags, int channels, 
   char *bugname, char* metadata, int bidirectional_audio_enable,
@@ -286,6 +286,11 @@ SWITCH_STANDARD_API(fork_function)
           else bugname = argv[5];
         }
 
+				if (bidirectional_audio_enable && !bidirectional_audio_stream && fork_play_audio_in_memory()) {
+					/* playAudio content is played out through the bug rather than from a file */
+					flags |= SMBF_WRITE_REPLACE ;
+				}
+
         if (0 == strcmp(argv[3], "mixed")) {
           flags |= SMBF_WRITE_STREAM ;
         }
@@ -338,6 +343,12 @@ SWITCH_STANDARD_API(fork_function)
 	return SWITCH_STATUS_SUCCESS;
 }
 
+#define FORK_STATS_API_SYNTAX ""
+SWITCH_STANDARD_API(fork_stats_function)
+{
+	fork_stats(stream);
+	return SWITCH_STATUS_SUCCESS;
+}
 
 SWITCH_MODULE_LOAD_FUNCTION(mod_audio_fork_load)
 {
@@ -361,6 +372,7 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_audio_fork_load)
 	}
 
 	SWITCH_ADD_API(api_interface, "uuid_audio_fork", "audio_fork API", fork_function, FORK_API_SYNTAX);
+	SWITCH_ADD_API(api_interface, "audio_fork_stats", "audio_fork service thread statistics", fork_stats_function, FORK_STATS_API_SYNTAX);
 	switch_console_set_complete("add uuid_audio_fork start wss-url metadata");
 	switch_console_set_complete("add uuid_audio_fork start wss-url");
 	switch_console_set_complete("add uuid_audio_fork stop");
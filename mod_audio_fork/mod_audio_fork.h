@@ -54,9 +54,7 @@ struct private_data {
   char initialMetadata[8192];
 
   // for "mark" feature of bidirectional audio
-  void *pVecMarksInInventory;
-  void *pVecMarksInUse;
-  void *pVecMarksCleared;
+  void *pMarks;
 
   // bidirectional audio
   void *streamingPlayoutBuffer;
@@ -66,6 +64,9 @@ struct private_data {
   int has_set_aside_byte;
   int downscale_factor;
   SpeexResamplerState *bidirectional_audio_resampler;
+  int channel_sampling;
+  SpeexResamplerState *play_audio_resampler;
+  int play_audio_sample_rate;
   int bidirectional_audio_enable;
 	int bidirectional_audio_stream;
   int bidirectional_audio_sample_rate;
@@ -0,0 +1,132 @@
+#ifndef __SAMPLE_RING_HPP__
+#define __SAMPLE_RING_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+namespace drachtio {
+
+/**
+ * growable ring of 16-bit samples, used to stage and play out bidirectional audio.
+ *
+ * Unlike boost::circular_buffer it exposes its storage as contiguous spans, so callers can
+ * memcpy or resample straight into (and out of) the ring rather than going through a
+ * temporary vector.  It also counts the samples that have passed through either end, so that
+ * a position in the stream can be tracked alongside the audio.  It is not thread-safe; callers
+ * serialize access themselves.
+ */
+class SampleRing {
+public:
+  explicit SampleRing(size_t capacity) : m_buf(std::max(capacity, (size_t) 1)), m_head(0), m_size(0), m_read(0), m_written(0) {}
+
+  size_t size(void) const { return m_size; }
+  size_t capacity(void) const { return m_buf.size(); }
+  bool empty(void) const { return 0 == m_size; }
+  void clear(void) {
+    m_head = m_size = 0;
+    m_read = m_written;
+  }
+
+  // stream positions of the oldest sample in the ring, and of the next sample to be appended
+  uint64_t readPosition(void) const { return m_read; }
+  uint64_t writePosition(void) const { return m_written; }
+
+  // makes room for at least len more samples, growing by no less than growBy when it has to grow
+  void reserve(size_t len, size_t growBy) {
+    if (capacity() - m_size >= len) return;
+    std::vector<int16_t> buf(m_size + std::max(len, growBy));
+    peek(buf.data(), m_size);
+    m_buf.swap(buf);
+    m_head = 0;
+  }
+
+  /* producer side */
+
+  // the contiguous free space at the tail of the ring
+  int16_t* writeSpan(size_t& len) {
+    size_t tail = m_head + m_size;
+    if (tail >= capacity()) {
+      tail -= capacity();
+      len = m_head - tail;
+    }
+    else {
+      len = capacity() - tail;
+    }
+    return m_buf.data() + tail;
+  }
+
+  void commit(size_t len) {
+    m_size += len;
+    m_written += len;
+  }
+
+  // appends len samples from a possibly unaligned source; the caller must have reserved the space
+  void write(const void* src, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(src);
+    while (len > 0) {
+      size_t avail;
+      int16_t* dst = writeSpan(avail);
+      size_t n = std::min(len, avail);
+      memcpy(dst, p, n * sizeof(int16_t));
+      commit(n);
+      p += n * sizeof(int16_t);
+      len -= n;
+    }
+  }
+
+  void push_back(int16_t sample) {
+    size_t avail;
+    *writeSpan(avail) = sample;
+    commit(1);
+  }
+
+  /* consumer side */
+
+  // the oldest contiguous run of samples
+  const int16_t* readSpan(size_t& len) const {
+    len = std::min(m_size, capacity() - m_head);
+    return m_buf.data() + m_head;
+  }
+
+  void consume(size_t len) {
+    m_head += len;
+    if (m_head >= capacity()) m_head -= capacity();
+    m_size -= len;
+    m_read += len;
+    if (0 == m_size) m_head = 0;
+  }
+
+  // copies out and discards up to len of the oldest samples, returning how many were read
+  size_t read(int16_t* dst, size_t len) {
+    len = peek(dst, len);
+    consume(len);
+    return len;
+  }
+
+  // no copying
+  SampleRing(const SampleRing&) = delete;
+  void operator=(const SampleRing&) = delete;
+
+private:
+  size_t peek(int16_t* dst, size_t len) const {
+    len = std::min(len, m_size);
+    if (0 == len) return 0;
+    size_t first = std::min(len, capacity() - m_head);
+    memcpy(dst, m_buf.data() + m_head, first * sizeof(int16_t));
+    memcpy(dst + first, m_buf.data(), (len - first) * sizeof(int16_t));
+    return len;
+  }
+
+  std::vector<int16_t> m_buf;
+  size_t m_head;
+  size_t m_size;
+  uint64_t m_read;
+  uint64_t m_written;
+};
+
+} // namespace drachtio
+
+#endif
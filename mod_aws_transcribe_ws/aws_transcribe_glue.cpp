@@ -71,7 +71,7 @@ namespace {
   }
 
   static void eventCallback(const char* sessionId, const char* bugname, 
-    aws::AudioPipe::NotifyEvent_t event, const char* message, bool finished) {
+    aws::AudioPipe::NotifyEvent_t event, const char* message, size_t message_len, bool finished) {
     switch_core_session_t* session = switch_core_session_locate(sessionId);
     if (session) {
       switch_channel_t *channel = switch_core_session_get_channel(session);
@@ -206,6 +206,43 @@ bool TranscribeManager::parseResponse(const string& response, string& payload, b
     return true;
 }
 
+bool TranscribeManager::parseResponse(char* buffer, size_t len, char*& payload, size_t& payloadLen, bool& isError, bool verbose) {
+    if (len < 16) {
+        return false;
+    }
+
+    uint32_t totalLen;
+    memcpy(&totalLen, &buffer[0], sizeof(uint32_t));
+    totalLen = ntohl(totalLen);
+
+    uint32_t headerLen;
+    memcpy(&headerLen, &buffer[4], sizeof(uint32_t));
+    headerLen = ntohl(headerLen);
+
+    if (totalLen > len || totalLen < headerLen + 4*4) {
+        return false;
+    }
+
+    if (!verifyCRC(buffer, totalLen)) {
+        return false;
+    }
+
+    const char* p = buffer + 12; // bytes 0 - 11 are prelude
+
+    const int numberOfHeaders = 3;
+    for (int i = 0; i < numberOfHeaders; i++) {
+        parseHeader(&p, isError, verbose);
+    }
+
+    payload = buffer + (p - buffer);
+    payloadLen = totalLen - headerLen - 4*4;
+
+    // the message CRC that trails the payload has been verified, so it can be overwritten
+    payload[payloadLen] = '\0';
+
+    return true;
+}
+
 bool TranscribeManager::verifyCRC(const char* buffer, const uint32_t totalLength) {
     uint32_t preludeCRC;
     memcpy(&preludeCRC, &buffer[8], 4);
@@ -31,6 +31,8 @@ public:
             const char* piiEntities, int shouldIdentifyPiiEntities, const char* languageModelName);
 
     static bool parseResponse(const std::string& response, std::string& payload, bool& isError, bool verbose = false);
+    // decodes a message in place; on success payload points into buffer and is NUL-terminated
+    static bool parseResponse(char* buffer, size_t len, char*& payload, size_t& payloadLen, bool& isError, bool verbose = false);
 
     static bool makeRequest(std::string& request, const std::vector<uint8_t>& data);
     static void writeHeader(char** buffer, const char* key, const char* val);
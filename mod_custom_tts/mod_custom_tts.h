@@ -25,6 +25,7 @@ typedef struct custom_data {
 
 	void *conn;
   void *circularBuffer;
+  void *prebuffer;
   switch_mutex_t *mutex;
   FILE *file;
 } custom_t;
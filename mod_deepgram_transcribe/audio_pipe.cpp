@@ -1,15 +1,78 @@
 #include "audio_pipe.hpp"
 
 #include <cassert>
+#include <vector>
+#include <algorithm>
 #include <iostream>
 
 /* discard incoming text messages over the socket that are longer than this */
 #define MAX_RECV_BUF_SIZE (65 * 1024 * 10)
-#define RECV_BUF_REALLOC_SIZE (8 * 1024)
+#define RECV_BUF_INITIAL_SIZE (8 * 1024)
+/* idle receive buffers kept by each service thread, and the largest one worth keeping */
+#define MAX_POOLED_RECV_BUFS (4)
+#define MAX_POOLED_RECV_BUF_SIZE (64 * 1024)
 
 using namespace deepgram;
 
 namespace {
+  /**
+   * fragmented text messages are reassembled into buffers borrowed from a small per-thread pool,
+   * so that once the pool is warm receiving a message costs no allocations
+   */
+  class RecvBufferPool {
+  public:
+    ~RecvBufferPool() {
+      for (auto& b : m_free) free(b.first);
+    }
+
+    // hands out a buffer with room for minLen bytes plus a terminating NUL; returns its capacity, or 0 if none
+    size_t acquire(uint8_t** pbuf, size_t minLen) {
+      size_t capacity = 0;
+      *pbuf = nullptr;
+      if (!m_free.empty()) {
+        *pbuf = m_free.back().first;
+        capacity = m_free.back().second;
+        m_free.pop_back();
+      }
+      if (capacity > minLen) return capacity;
+      return grow(pbuf, capacity, minLen);
+    }
+
+    // grows a buffer to hold minLen bytes plus a terminating NUL, or frees it if that would exceed MAX_RECV_BUF_SIZE
+    size_t grow(uint8_t** pbuf, size_t capacity, size_t minLen) {
+      if (minLen >= MAX_RECV_BUF_SIZE) {
+        free(*pbuf);
+        *pbuf = nullptr;
+        return 0;
+      }
+      size_t newCapacity = std::max(capacity, (size_t) RECV_BUF_INITIAL_SIZE);
+      while (newCapacity <= minLen) newCapacity <<= 1;
+      newCapacity = std::min(newCapacity, (size_t) MAX_RECV_BUF_SIZE);
+
+      uint8_t* buf = (uint8_t*) realloc(*pbuf, newCapacity);
+      if (nullptr == buf) {
+        free(*pbuf);
+        *pbuf = nullptr;
+        return 0;
+      }
+      *pbuf = buf;
+      return newCapacity;
+    }
+
+    void release(uint8_t* buf, size_t capacity) {
+      if (m_free.size() < MAX_POOLED_RECV_BUFS && capacity <= MAX_POOLED_RECV_BUF_SIZE) {
+        m_free.push_back(std::make_pair(buf, capacity));
+      }
+      else free(buf);
+    }
+
+  private:
+    std::vector<std::pair<uint8_t*, size_t> > m_free;
+  };
+
+  // a connection is only ever serviced by one thread, so its messages are always assembled from that thread's pool
+  thread_local RecvBufferPool recvBufferPool;
+
   static const char *requestedTcpKeepaliveSecs = std::getenv("MOD_AUDIO_FORK_TCP_KEEPALIVE_SECS");
   static int nTcpKeepaliveSecs = requestedTcpKeepaliveSecs ? ::atoi(requestedTcpKeepaliveSecs) : 55;
 }
@@ -73,7 +136,7 @@ int AudioPipe::lws_callback(struct lws *wsi,
         lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_CONNECTION_ERROR: %s, response status %d\n", in ? (char *)in : "(null)", rc); 
         if (ap) {
           ap->m_state = LWS_CLIENT_FAILED;
-          ap->m_callback(ap->m_uuid.c_str(),  ap->m_bugname.c_str(), deepgram::AudioPipe::CONNECT_FAIL, (char *) in, ap->isFinished());
+          ap->m_callback(ap->m_uuid.c_str(),  ap->m_bugname.c_str(), deepgram::AudioPipe::CONNECT_FAIL, (char *) in, in ? strlen((char *) in) : 0, ap->isFinished());
         }
         else {
           lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_CONNECTION_ERROR unable to find wsi %p..\n", wsi); 
@@ -89,7 +152,7 @@ int AudioPipe::lws_callback(struct lws *wsi,
           *ppAp = ap;
           ap->m_vhd = vhd;
           ap->m_state = LWS_CLIENT_CONNECTED;
-          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), deepgram::AudioPipe::CONNECT_SUCCESS, NULL,  ap->isFinished());
+          ap->m_callback(ap->m_uuid.c_str(), ap->m_bugname.c_str(), deepgram::AudioPipe::CONNECT_SUCCESS, NULL, 0, ap->isFinished());
         }
         else {
           lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_ESTABLISHED %s unable to find wsi %p..\n", ap->m_uuid.c_str(), wsi); 
@@ -108,12 +171,12 @@ int AudioPipe::lws_callback(struct lws *wsi,
           // closed by us
 
           lwsl_debug("%s socket closed by us\n", ap->m_uuid.c_str());
-          ap->m_callback(ap->m_uuid.c_str(),  ap->m_bugname.c_str(), deepgram::AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL,  ap->isFinished());
+          ap->m_callback(ap->m_uuid.c_str(),  ap->m_bugname.c_str(), deepgram::AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL, 0, ap->isFinished());
         }
         else if (ap->m_state == LWS_CLIENT_CONNECTED) {
           // closed by far end
           lwsl_info("%s socket closed by far end\n", ap->m_uuid.c_str());
-          ap->m_callback(ap->m_uuid.c_str(),  ap->m_bugname.c_str(), deepgram::AudioPipe::CONNECTION_DROPPED, NULL,  ap->isFinished());
+          ap->m_callback(ap->m_uuid.c_str(),  ap->m_bugname.c_str(), deepgram::AudioPipe::CONNECTION_DROPPED, NULL, 0, ap->isFinished());
         }
         ap->m_state = LWS_CLIENT_DISCONNECTED;
         ap->setClosed();
@@ -141,29 +204,21 @@ int AudioPipe::lws_callback(struct lws *wsi,
         }
 
         if (lws_is_first_fragment(wsi)) {
-          // allocate a buffer for the entire chunk of memory needed
+          // borrow a buffer big enough for the entire message, if lws knows how big it is
           assert(nullptr == ap->m_recv_buf);
-          ap->m_recv_buf_len = len + lws_remaining_packet_payload(wsi);
-          ap->m_recv_buf = (uint8_t*) malloc(ap->m_recv_buf_len);
+          ap->m_recv_buf_len = recvBufferPool.acquire(&ap->m_recv_buf, len + lws_remaining_packet_payload(wsi));
           ap->m_recv_buf_ptr = ap->m_recv_buf;
-        }
-
-        size_t write_offset = ap->m_recv_buf_ptr - ap->m_recv_buf;
-        size_t remaining_space = ap->m_recv_buf_len - write_offset;
-        if (remaining_space < len) {
-          lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE buffer realloc needed.\n");
-          size_t newlen = ap->m_recv_buf_len + RECV_BUF_REALLOC_SIZE;
-          if (newlen > MAX_RECV_BUF_SIZE) {
-            free(ap->m_recv_buf);
-            ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
-            ap->m_recv_buf_len = 0;
-            lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, truncating message.\n");
+          if (nullptr == ap->m_recv_buf) {
+            lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, discarding message.\n");
           }
-          else {
-            ap->m_recv_buf = (uint8_t*) realloc(ap->m_recv_buf, newlen);
-            if (nullptr != ap->m_recv_buf) {
-              ap->m_recv_buf_len = newlen;
-              ap->m_recv_buf_ptr = ap->m_recv_buf + write_offset;
+        }
+        else if (nullptr != ap->m_recv_buf) {
+          size_t write_offset = ap->m_recv_buf_ptr - ap->m_recv_buf;
+          if (ap->m_recv_buf_len - write_offset <= len) {
+            ap->m_recv_buf_len = recvBufferPool.grow(&ap->m_recv_buf, ap->m_recv_buf_len, write_offset + len);
+            ap->m_recv_buf_ptr = ap->m_recv_buf ? ap->m_recv_buf + write_offset : nullptr;
+            if (nullptr == ap->m_recv_buf) {
+              lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, truncating message.\n");
             }
           }
         }
@@ -174,13 +229,13 @@ int AudioPipe::lws_callback(struct lws *wsi,
             ap->m_recv_buf_ptr += len;
           }
           if (lws_is_final_fragment(wsi)) {
-            if (nullptr != ap->m_recv_buf) {
-              std::string msg((char *)ap->m_recv_buf, ap->m_recv_buf_ptr - ap->m_recv_buf);
-              if (!ap->m_silence_disconnect) {
-                ap->m_callback(ap->m_uuid.c_str(),  ap->m_bugname.c_str(), deepgram::AudioPipe::MESSAGE, msg.c_str(),  ap->isFinished());
-              }
-              if (nullptr != ap->m_recv_buf) free(ap->m_recv_buf);
+            // hand the message to the callback in place, NUL-terminated for consumers that treat it as a string
+            size_t msg_len = ap->m_recv_buf_ptr - ap->m_recv_buf;
+            ap->m_recv_buf[msg_len] = '\0';
+            if (!ap->m_silence_disconnect) {
+              ap->m_callback(ap->m_uuid.c_str(),  ap->m_bugname.c_str(), deepgram::AudioPipe::MESSAGE, (const char *) ap->m_recv_buf, msg_len, ap->isFinished());
             }
+            recvBufferPool.release(ap->m_recv_buf, ap->m_recv_buf_len);
             ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
             ap->m_recv_buf_len = 0;
           }
@@ -462,7 +517,7 @@ AudioPipe::AudioPipe(const char* uuid, const char* bugname, const char* host, un
 }
 AudioPipe::~AudioPipe() {
   if (m_audio_buffer) delete [] m_audio_buffer;
-  if (m_recv_buf) delete [] m_recv_buf;
+  if (m_recv_buf) free(m_recv_buf);
 }
 
 void AudioPipe::connect(void) {
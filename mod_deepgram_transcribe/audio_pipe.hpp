@@ -31,7 +31,7 @@ namespace deepgram {
       MESSAGE
     };
     typedef void (*log_emit_function)(int level, const char *line);
-    typedef void (*notifyHandler_t)(const char *sessionId, const char* bugname, NotifyEvent_t event, const char* message, bool finished);
+    typedef void (*notifyHandler_t)(const char *sessionId, const char* bugname, NotifyEvent_t event, const char* message, size_t message_len, bool finished);
 
     struct lws_per_vhost_data {
       struct lws_context *context;
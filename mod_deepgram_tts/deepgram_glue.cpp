@@ -1,4 +1,6 @@
 #include "mod_deepgram_tts.h"
+#include "tts_http.h"
+#include "tts_prebuffer.h"
 #include <switch.h>
 #include <switch_json.h>
 #include <curl/curl.h>
@@ -21,14 +23,6 @@
 #define BUFFER_GROW_SIZE (80000)
 
 typedef boost::circular_buffer<uint16_t> CircularBuffer_t;
-/* Global information, common to all connections */
-typedef struct
-{
-  CURLM *multi;
-  int still_running;
-} GlobalInfo_t;
-static GlobalInfo_t global;
-
 /* Information associated with a specific easy handle */
 typedef struct
 {
@@ -36,7 +30,6 @@ typedef struct
   deepgram_t* deepgram;
   char* body;
   struct curl_slist *hdr_list;
-  GlobalInfo_t *global;
   char error[CURL_ERROR_SIZE];
   FILE* file;
   std::chrono::time_point<std::chrono::high_resolution_clock> startTime;
@@ -48,11 +41,7 @@ typedef struct
 
 
 static boost::object_pool<ConnInfo_t> pool ;
-static std::map<curl_socket_t, boost::asio::ip::tcp::socket *> socket_map;
-static boost::asio::io_service io_service;
-static boost::asio::deadline_timer timer(io_service);
 static std::string fullDirPath;
-static std::thread worker_thread;
 
 std::string secondsToMillisecondsString(double seconds) {
     // Convert to milliseconds
@@ -65,44 +54,6 @@ std::string secondsToMillisecondsString(double seconds) {
     return std::to_string(milliseconds_long);
 }
 
-static std::string getEnvVar(const std::string& varName) {
-    const char* val = std::getenv(varName.c_str());
-    return val ? std::string(val) : "";
-}
-
-static long getConnectionTimeout() {
-    std::string connectTimeoutStr = getEnvVar("DEEPGRAM_TTS_CURL_CONNECT_TIMEOUT");
-
-    if (connectTimeoutStr.empty()) {
-        connectTimeoutStr = getEnvVar("TTS_CURL_CONNECT_TIMEOUT");
-    }
-
-    long connectTimeout = 10L;
-
-    if (!connectTimeoutStr.empty()) {
-        connectTimeout = std::stol(connectTimeoutStr);
-    }
-
-    return connectTimeout;
-}
-
-static CURL* createEasyHandle(void) {
-  CURL* easy = curl_easy_init();
-  if(!easy) {
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "curl_easy_init() failed!\n");
-    return nullptr ;
-  }  
-
-  curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
-  curl_easy_setopt(easy, CURLOPT_USERAGENT, "jambonz/0.8.5");
-
-  // set connect timeout to 3 seconds and total timeout to 109 seconds
-  curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT_MS, 3000L);
-  curl_easy_setopt(easy, CURLOPT_TIMEOUT, getConnectionTimeout());
-
-  return easy ;    
-}
-
 static void cleanupConn(ConnInfo_t *conn) {
   auto d = conn->deepgram;
 
@@ -126,275 +77,17 @@ static void cleanupConn(ConnInfo_t *conn) {
   pool.destroy(conn) ;
 }
 
-/* Check for completed transfers, and remove their easy handles */
-void check_multi_info(GlobalInfo_t *g) {
-  CURLMsg *msg;
-  int msgs_left;
-  ConnInfo_t *conn;
-  CURL *easy;
-  CURLcode res;
-  
-  while((msg = curl_multi_info_read(g->multi, &msgs_left))) {
-    if(msg->msg == CURLMSG_DONE) {
-      long response_code;
-      double namelookup=0, connect=0, total=0 ;
-      char *ct = NULL ;
-
-      easy = msg->easy_handle;
-      res = msg->data.result;
-      curl_easy_getinfo(easy, CURLINFO_PRIVATE, &conn);
-      curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &response_code);
-      curl_easy_getinfo(easy, CURLINFO_CONTENT_TYPE, &ct);
-
-      curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME, &namelookup);
-      curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME, &connect);
-      curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME, &total);
-
-      auto d = conn->deepgram;
-      d->response_code = response_code;
-      if (ct) d->ct = strdup(ct);
-
-      std::string name_lookup_ms = secondsToMillisecondsString(namelookup);
-      std::string connect_ms = secondsToMillisecondsString(connect);
-      std::string final_response_time_ms = secondsToMillisecondsString(total);
-
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, 
-        "mod_deepgram_tts: response: %ld, content-type %s,"
-        "dns(ms): %"  CURL_FORMAT_CURL_OFF_T ".%06ld, "
-        "connect(ms): %"  CURL_FORMAT_CURL_OFF_T ".%06ld, "
-        "total(ms): %"  CURL_FORMAT_CURL_OFF_T ".%06ld\n",
-        response_code, ct,
-        (long)(namelookup), (long)(fmod(namelookup, 1.0) * 1000000),
-        (long)(connect), (long)(fmod(connect, 1.0) * 1000000),
-        (long)(total), (long)(fmod(total, 1.0) * 1000000));
-
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "name lookup time: %s\n", name_lookup_ms.c_str());
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "connect time: %s\n", connect_ms.c_str());
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "final response time: %s\n", final_response_time_ms.c_str());
-
-      d->name_lookup_time_ms = strdup(name_lookup_ms.c_str());
-      d->connect_time_ms = strdup(connect_ms.c_str());
-      d->final_response_time_ms = strdup(final_response_time_ms.c_str());
-
-      curl_multi_remove_handle(g->multi, easy);
-      cleanupConn(conn);
-    }
-  }
-}
-
-int mcode_test(const char *where, CURLMcode code) {
-  if(CURLM_OK != code) {
-    const char *s;
-    switch(code) {
-    case CURLM_CALL_MULTI_PERFORM:
-      s = "CURLM_CALL_MULTI_PERFORM";
-      break;
-    case CURLM_BAD_HANDLE:
-      s = "CURLM_BAD_HANDLE";
-      break;
-    case CURLM_BAD_EASY_HANDLE:
-      s = "CURLM_BAD_EASY_HANDLE";
-      break;
-    case CURLM_OUT_OF_MEMORY:
-      s = "CURLM_OUT_OF_MEMORY";
-      break;
-    case CURLM_INTERNAL_ERROR:
-      s = "CURLM_INTERNAL_ERROR";
-      break;
-    case CURLM_UNKNOWN_OPTION:
-      s = "CURLM_UNKNOWN_OPTION";
-      break;
-    case CURLM_LAST:
-      s = "CURLM_LAST";
-      break;
-    default:
-      s = "CURLM_unknown";
-      break;
-    case CURLM_BAD_SOCKET:
-      s = "CURLM_BAD_SOCKET";
-      break;
-    }
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mcode_test ERROR: %s returns %s:%d\n", where, s, code);
-
-    return -1;
-  }
-  return 0 ;
-}
-
-static void remsock(int *f, GlobalInfo_t *g) {
-  if(f) {
-    free(f);
-    f = NULL;
-  }
-}
-
-/* Called by asio when there is an action on a socket */
-static void event_cb(GlobalInfo_t *g, curl_socket_t s, int action, const boost::system::error_code & error, int *fdp) {
-  int f = *fdp;
-
-  //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "event_cb socket %#X has action %d\n", s, action) ; 
-
-  // Socket already POOL REMOVED.
-  if (f == CURL_POLL_REMOVE) {
-    //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "event_cb socket %#X removed\n", s); 
-    remsock(fdp, g);
-    return;
-  }
-
-  if(socket_map.find(s) == socket_map.end()) {
-    //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "event_cb: socket  %#X already closed\n, s");
-    return;
-  }
-
-  /* make sure the event matches what are wanted */
-  if(f == action || f == CURL_POLL_INOUT) {
-    if(error) {
-      action = CURL_CSELECT_ERR;
-    }
-    CURLMcode rc = curl_multi_socket_action(g->multi, s, action, &g->still_running);
-
-    mcode_test("event_cb: curl_multi_socket_action", rc);
-    check_multi_info(g);
-
-    if(g->still_running <= 0) {
-      timer.cancel();
-    }
-
-    /* keep on watching.
-      * the socket may have been closed and/or fdp may have been changed
-      * in curl_multi_socket_action(), so check them both */
-    if(!error && socket_map.find(s) != socket_map.end() &&
-        (f == action || f == CURL_POLL_INOUT)) {
-      boost::asio::ip::tcp::socket *tcp_socket = socket_map.find(s)->second;
-
-      if(action == CURL_POLL_IN) {
-        tcp_socket->async_read_some(boost::asio::null_buffers(),
-                                    boost::bind(&event_cb, g, s,
-                                                action, boost::placeholders::_1, fdp));
-      }
-      if(action == CURL_POLL_OUT) {
-        tcp_socket->async_write_some(boost::asio::null_buffers(),
-                                      boost::bind(&event_cb, g, s,
-                                                  action, boost::placeholders::_1, fdp));
-      } 
-    }
-  }
-}
-
-/* socket functions */
-static void setsock(int *fdp, curl_socket_t s, CURL *e, int act, int oldact, GlobalInfo_t *g) {
-  std::map<curl_socket_t, boost::asio::ip::tcp::socket *>::iterator it = socket_map.find(s);
-
-  if(it == socket_map.end()) {
-    //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "setsock: socket  %#X not found\n, s");
-    return;
-  }
-
-  boost::asio::ip::tcp::socket * tcp_socket = it->second;
-
-  *fdp = act;
-
-  if(act == CURL_POLL_IN) {
-    if(oldact != CURL_POLL_IN && oldact != CURL_POLL_INOUT) {
-      tcp_socket->async_read_some(boost::asio::null_buffers(),
-                                  boost::bind(&event_cb, g, s,
-                                  CURL_POLL_IN, boost::placeholders::_1, fdp));
-    }
-  }
-  else if(act == CURL_POLL_OUT) {
-    if(oldact != CURL_POLL_OUT && oldact != CURL_POLL_INOUT) {
-      tcp_socket->async_write_some(boost::asio::null_buffers(),
-                                    boost::bind(&event_cb, g, s,
-                                    CURL_POLL_OUT, boost::placeholders::_1, fdp));
-    }
-  }
-  else if(act == CURL_POLL_INOUT) {
-    if(oldact != CURL_POLL_IN && oldact != CURL_POLL_INOUT) {
-      tcp_socket->async_read_some(boost::asio::null_buffers(),
-                                  boost::bind(&event_cb, g, s,
-                                  CURL_POLL_IN, boost::placeholders::_1, fdp));
-    }
-    if(oldact != CURL_POLL_OUT && oldact != CURL_POLL_INOUT) {
-      tcp_socket->async_write_some(boost::asio::null_buffers(),
-                                    boost::bind(&event_cb, g, s,
-                                    CURL_POLL_OUT, boost::placeholders::_1, fdp));
-    }
-  }
-}
-
-static void addsock(curl_socket_t s, CURL *easy, int action, GlobalInfo_t *g) {
-  /* fdp is used to store current action */
-  int *fdp = (int *) calloc(sizeof(int), 1);
-
-  setsock(fdp, s, easy, action, 0, g);
-  curl_multi_assign(g->multi, s, fdp);
-}
-
-static int sock_cb(CURL *e, curl_socket_t s, int what, void *cbp, void *sockp) {
-  GlobalInfo_t *g = &global;
-
-  int *actionp = (int *) sockp;
-  static const char *whatstr[] = { "none", "IN", "OUT", "INOUT", "REMOVE"};
-
-  if(what == CURL_POLL_REMOVE) {
-    *actionp = what;
-  }
-  else {
-    if(!actionp) {
-      addsock(s, e, what, g);
-    }
-    else {
-      setsock(actionp, s, e, what, *actionp, g);
-    }
-  }
-  return 0;  
-}
-
-static void threadFunc() {      
-  /* to make sure the event loop doesn't terminate when there is no work to do */
-  io_service.reset() ;
-  boost::asio::io_service::work work(io_service);
-  
-  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_deepgram_tts threadFunc - starting\n");
-
-  for(;;) {
-      
-    try {
-      io_service.run() ;
-      break ;
-    }
-    catch( std::exception& e) {
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_deepgram_tts threadFunc - Error: %s\n", e.what());
-    }
-  }
-  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_deepgram_tts threadFunc - ending\n");
-}
-
-
-/* Called by asio when our timeout expires */
-static void timer_cb(const boost::system::error_code & error, GlobalInfo_t *g)
-{
-  //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "timer_cb\n");
-
-  if(!error) {
-    CURLMcode rc = curl_multi_socket_action(g->multi, CURL_SOCKET_TIMEOUT, 0, &g->still_running);
-    mcode_test("timer_cb: curl_multi_socket_action", rc);
-    check_multi_info(g);
-  }
-}
-
-int multi_timer_cb(CURLM *multi, long timeout_ms, GlobalInfo_t *g) {
-
-  /* cancel running timer */
-  timer.cancel();
+/* called on the http engine's thread once a transfer is complete */
+static void transfer_done(ConnInfo_t *conn, const TtsHttp::Result& result) {
+  auto d = conn->deepgram;
+  d->response_code = result.responseCode;
+  if (result.contentType) d->ct = strdup(result.contentType);
 
-  if(timeout_ms >= 0) {
-    // from libcurl 7.88.1-10+deb12u4 does not allow call curl_multi_socket_action or curl_multi_perform in curl_multi callback directly
-    timer.expires_from_now(boost::posix_time::millisec(timeout_ms ? timeout_ms : 1));
-    timer.async_wait(boost::bind(&timer_cb, boost::placeholders::_1, g));
-  }
+  d->name_lookup_time_ms = strdup(secondsToMillisecondsString(result.nameLookup).c_str());
+  d->connect_time_ms = strdup(secondsToMillisecondsString(result.connect).c_str());
+  d->final_response_time_ms = strdup(secondsToMillisecondsString(result.total).c_str());
 
-  return 0;
+  cleanupConn(conn);
 }
 
 /* CURLOPT_WRITEFUNCTION */
@@ -472,6 +165,7 @@ static size_t write_cb(void *ptr, size_t size, size_t nmemb, ConnInfo_t *conn) {
     
     /* Push the data into the buffer */
     cBuffer->insert(cBuffer->end(), inputData, inputData + numSamples);
+    ((TtsPrebuffer *) d->prebuffer)->arrived();
 
     switch_mutex_unlock(d->mutex);
   }
@@ -595,64 +289,14 @@ static size_t header_callback(char *buffer, size_t size, size_t nitems, ConnInfo
   return bytes_received;
 }
 
-/* CURLOPT_OPENSOCKETFUNCTION */
-static curl_socket_t opensocket(void *clientp, curlsocktype purpose, struct curl_sockaddr *address) {
-  curl_socket_t sockfd = CURL_SOCKET_BAD;
-
-  //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "opensocket: %d\n", purpose);
-  /* restrict to IPv4 */
-  if(purpose == CURLSOCKTYPE_IPCXN && address->family == AF_INET) {
-    /* create a tcp socket object */
-    boost::asio::ip::tcp::socket *tcp_socket = new boost::asio::ip::tcp::socket(io_service);
-
-    /* open it and get the native handle*/
-    boost::system::error_code ec;
-    tcp_socket->open(boost::asio::ip::tcp::v4(), ec);
-
-    if(ec) {
-      /* An error occurred */
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't open socket [%ld][%s]\n", ec, ec.message().c_str());
-    }
-    else {
-      sockfd = tcp_socket->native_handle();
-
-      /* save it for monitoring */
-      socket_map.insert(std::pair<curl_socket_t, boost::asio::ip::tcp::socket *>(sockfd, tcp_socket));
-    }
-  }
-  return sockfd;
-}
-
-/* CURLOPT_CLOSESOCKETFUNCTION */
-static int close_socket(void *clientp, curl_socket_t item) {
-  //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "close_socket : %#X\n", item);
-
-  std::map<curl_socket_t, boost::asio::ip::tcp::socket *>::iterator it = socket_map.find(item);
-  if(it != socket_map.end()) {
-    delete it->second;
-    socket_map.erase(it);
-  }
-  return 0;
-}
-
-
 extern "C" {
-  switch_status_t deepgram_speech_load() {
+  switch_status_t deepgram_speech_load(switch_loadable_module_interface_t **module_interface) {
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "deepgram_speech_loading..\n");
-    memset(&global, 0, sizeof(GlobalInfo_t));
-    global.multi = curl_multi_init();
-
-     if (!global.multi) {
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "deepgram_speech_load curl_multi_init() failed, exiting!\n");
+    if (TtsHttp::registerModule("mod_deepgram_tts", module_interface) != SWITCH_STATUS_SUCCESS) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "deepgram_speech_load: failed to start the http engine\n");
       return SWITCH_STATUS_FALSE;
     }
 
-    curl_multi_setopt(global.multi, CURLMOPT_SOCKETFUNCTION, sock_cb);
-    curl_multi_setopt(global.multi, CURLMOPT_SOCKETDATA, &global);
-    curl_multi_setopt(global.multi, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
-    curl_multi_setopt(global.multi, CURLMOPT_TIMERDATA, &global);
-    curl_multi_setopt(global.multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
-
     /* create temp folder for cache files */
     const char* baseDir = std::getenv("JAMBONZ_TMP_CACHE_FOLDER");
     if (!baseDir) {
@@ -680,10 +324,6 @@ extern "C" {
       switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "created folder %s\n", fullDirPath.c_str());
     }
 
-    /* start worker thread that handles transfers*/
-    std::thread t(threadFunc) ;
-    worker_thread.swap( t ) ;
-
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "deepgram_speech_loaded..\n");
 
 
@@ -691,19 +331,7 @@ extern "C" {
   }
 
   switch_status_t deepgram_speech_unload() {
-    /* stop the ASIO IO service */
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "deepgram_speech_unload: stopping io service\n");
-    io_service.stop();
-
-    /* Join the worker thread */
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "deepgram_speech_unload: wait for worker thread to complete\n");
-    if (worker_thread.joinable()) {
-        worker_thread.join();
-    }
-
-    /* cleanup curl multi handle*/
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "deepgram_speech_unload: release curl multi\n");
-    curl_multi_cleanup(global.multi);
+    TtsHttp::unregisterModule("mod_deepgram_tts");
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "deepgram_speech_unload: completed\n");
 
 		return SWITCH_STATUS_SUCCESS;
@@ -714,7 +342,6 @@ extern "C" {
   }
 
   switch_status_t deepgram_speech_feed_tts(deepgram_t* d, char* text, switch_speech_flag_t *flags) {
-    CURLMcode rc;
 
     const int MAX_CHARS = 20;
     char tempText[MAX_CHARS + 4]; // +4 for the ellipsis and null terminator
@@ -777,11 +404,10 @@ extern "C" {
 
     ConnInfo_t *conn = pool.malloc() ;
 
-    CURL* easy = createEasyHandle();
+    CURL* easy = TtsHttp::createEasyHandle("DEEPGRAM_TTS_CURL_CONNECT_TIMEOUT");
     d->conn = (void *) conn ;
     conn->deepgram = d;
     conn->easy = easy;
-    conn->global = &global;
     conn->hdr_list = NULL ;
     conn->file = d->file;
     conn->body = json;
@@ -791,6 +417,7 @@ extern "C" {
 
 
     d->circularBuffer = (void *) new CircularBuffer_t(BUFFER_GROW_SIZE);
+    d->prebuffer = (void *) new TtsPrebuffer(8000);
     // Always use deepgram at rate 8000 for helping cache audio from jambonz.
     if (d->rate != 8000) {
       int err;
@@ -808,17 +435,10 @@ extern "C" {
     curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, write_cb);
     curl_easy_setopt(easy, CURLOPT_WRITEDATA, conn);
     curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, conn->error);
-    curl_easy_setopt(easy, CURLOPT_PRIVATE, conn);
     curl_easy_setopt(easy, CURLOPT_VERBOSE, 0L);
     curl_easy_setopt(easy, CURLOPT_NOPROGRESS, 1L);
     curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, header_callback);
     curl_easy_setopt(easy, CURLOPT_HEADERDATA, conn);
-    
-    /* call this function to get a socket */
-    curl_easy_setopt(easy, CURLOPT_OPENSOCKETFUNCTION, opensocket);
-
-    /* call this function to close a socket */
-    curl_easy_setopt(easy, CURLOPT_CLOSESOCKETFUNCTION, close_socket);
 
     conn->hdr_list = curl_slist_append(conn->hdr_list, api_key_stream.str().c_str());
     conn->hdr_list = curl_slist_append(conn->hdr_list, "Content-Type: application/json");
@@ -832,13 +452,16 @@ extern "C" {
     const bool disable_http_2 = switch_true(std::getenv("DISABLE_HTTP2_FOR_TTS_STREAMING"));
     curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, disable_http_2 ? CURL_HTTP_VERSION_1_1 : CURL_HTTP_VERSION_2_0);
 
-    rc = curl_multi_add_handle(global.multi, conn->easy);
-    mcode_test("new_conn: curl_multi_add_handle", rc);
-
     /* start a timer to measure the duration until we receive first byte of audio */
     conn->startTime = std::chrono::high_resolution_clock::now();
+    /* answered from the cache, or by an identical request already in flight, where possible */
+    TtsHttp::Sink sink;
+    sink.header = [conn](char *buffer, size_t len) { return header_callback(buffer, 1, len, conn); };
+    sink.body = [conn](char *ptr, size_t len) { return write_cb(ptr, 1, len, conn); };
+    sink.done = [conn](const TtsHttp::Result& result) { transfer_done(conn, result); };
+    TtsHttp::addSharedTransfer("mod_deepgram_tts", url, conn->body, conn->hdr_list, easy, sink);
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "deepgram_speech_feed_tts: called curl_multi_add_handle\n");
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "deepgram_speech_feed_tts: added transfer\n");
 
 
     return SWITCH_STATUS_SUCCESS;
@@ -860,13 +483,13 @@ extern "C" {
         switch_mutex_unlock(d->mutex);
         return SWITCH_STATUS_BREAK;
       }
-      if (cBuffer->empty()) {
-        if (d->draining) {
-          switch_mutex_unlock(d->mutex);
-          return SWITCH_STATUS_BREAK;
-        }
-        /* no audio available yet so send silence */
-        memset(data, 255, *datalen);
+      if (cBuffer->empty() && d->draining) {
+        switch_mutex_unlock(d->mutex);
+        return SWITCH_STATUS_BREAK;
+      }
+      if (!((TtsPrebuffer *) d->prebuffer)->ready(cBuffer->size(), d->draining)) {
+        /* not enough audio buffered to play without running dry, so send linear silence */
+        memset(data, 0, *datalen);
         switch_mutex_unlock(d->mutex);
         return SWITCH_STATUS_SUCCESS;
       }
@@ -909,6 +532,8 @@ extern "C" {
     CircularBuffer_t *cBuffer = (CircularBuffer_t *) d->circularBuffer;
     delete cBuffer;
     d->circularBuffer = nullptr ;
+    delete (TtsPrebuffer *) d->prebuffer;
+    d->prebuffer = nullptr;
 
     // destroy resampler
     if (d->resampler) {
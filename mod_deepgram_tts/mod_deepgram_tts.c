@@ -159,7 +159,7 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_deepgram_tts_load)
 	speech_interface->speech_text_param_tts = d_text_param_tts;
 	speech_interface->speech_numeric_param_tts = d_numeric_param_tts;
 	speech_interface->speech_float_param_tts = d_float_param_tts;
-  return deepgram_speech_load();
+  return deepgram_speech_load(module_interface);
 }
 
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_deepgram_tts_shutdown)
@@ -36,6 +36,7 @@ typedef struct deepgram_data {
 
 	void *conn;
   void *circularBuffer;
+  void *prebuffer;
   switch_mutex_t *mutex;
   FILE *file;
   SpeexResamplerState *resampler;
@@ -2,37 +2,317 @@
 #define __AP_H__
 
 #include <mutex>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
 #include <functional>
+#include <boost/asio.hpp>
 #include "common.h"
+#include "io_pool.h"
+#include "audio_cache.h"
+#include "mpg_decode.h"
+#include "vector_math.h"
 
-class AudioProducer {
+/**
+ * base class of the audio producers, which fetch or decode audio into a track's ring.
+ *
+ * Producers run on the shared IoPool, each through its own strand.  Handlers bind a shared
+ * pointer to the producer, so that it stays alive until they have run.
+ */
+class AudioProducer : public std::enable_shared_from_this<AudioProducer> {
 public:
   AudioProducer(
     std::mutex& mutex,
     CircularBuffer_t& circularBuffer,
     int sampleRate
-  ) : _mutex(mutex), _buffer(circularBuffer), _sampleRate(sampleRate), _notified(false), _loop(false), _gain(0) {}
+  ) : _mutex(mutex), _trackBuffer(circularBuffer), _sampleRate(sampleRate), _notified(false), _loop(false), _gain(0),
+    _strand(IoPool::service()), _ring(&circularBuffer), _prefetching(false), _fetched(false), _stopped(false),
+    _doneError(false), _spliceTimer(IoPool::service()) {}
   virtual ~AudioProducer() {}
 
   virtual void notifyDone(bool error, const std::string& errorMsg) {
-    if (!_notified) {
-      _notified = true;
-      if (_callback) _callback(error, errorMsg);
+    if (_notified) return;
+
+    /* a prefetched producer that is done is held back until the track splices it in */
+    if (_prefetching) {
+      _doneError = error;
+      _doneMsg = errorMsg;
+      _fetched = true;
+      return;
     }
+    _notified = true;
+    if (_callback) _callback(error, errorMsg);
   }
   virtual void start(std::function<void(bool, const std::string&)> callback) = 0;
   virtual void stop() = 0;
 
+  // the url or path the audio comes from
+  virtual const std::string& source() const = 0;
+
   bool isLoopedAudio() const { return _loop; }
 
+  /**
+   * starts fetching and decoding ahead of our turn, into a ring of our own holding up to samples,
+   * while the track plays what is queued before us.  Called under the track's lock; the start
+   * itself runs on our strand.
+   */
+  void prefetch(std::function<void(bool, const std::string&)> callback, size_t samples) {
+    _prefetchBuffer.reset(new CircularBuffer_t(samples));
+    _ring = _prefetchBuffer.get();
+    _prefetching = true;
+
+    auto self = shared_from_this();
+    _strand.post([self, callback]() {
+      try {
+        self->start(callback);
+      } catch (std::exception& e) {
+        self->_callback = callback;
+        self->notifyDone(true, e.what());
+      }
+    });
+  }
+
+  // hands a prefetched producer over to the track's ring once it is our turn to play
+  void splice() {
+    auto self = shared_from_this();
+    _strand.post([self]() { self->doSplice(); });
+  }
+
+  bool isPrefetched() const { return _prefetchBuffer != nullptr; }
+
+  // whether a prefetched producer has fetched all of its audio
+  bool isFetched() const { return _fetched; }
+
+  // the audio waiting in a prefetched producer's ring, in milliseconds
+  size_t prefetchedMs() const {
+    return _prefetchBuffer ? _prefetchBuffer->size() * 1000 / _sampleRate : 0;
+  }
+
 protected:
+  // a shared pointer to this producer as its concrete type, for binding to handlers
+  template <typename T> std::shared_ptr<T> self() {
+    return std::static_pointer_cast<T>(shared_from_this());
+  }
+
+  // the ring we are writing to: our own while prefetching, the track's otherwise
+  CircularBuffer_t& ring() const { return *_ring; }
+
+  /**
+   * called on our strand as we are stopped: a splice still to come must then leave the track
+   * alone, since its ring and callback may be gone by the time it runs.
+   */
+  void disarm() {
+    _stopped = true;
+    _spliceTimer.cancel();
+  }
+
+  // runs fn on our strand and waits for it, so that none of our handlers is still running once this returns
+  void runOnStrand(std::function<void()> fn) {
+    if (_strand.running_in_this_thread()) {
+      fn();
+      return;
+    }
+    std::promise<void> done;
+    _strand.dispatch([&fn, &done]() {
+      fn();
+      done.set_value();
+    });
+    done.get_future().wait();
+  }
+
+  // appends decoded audio to our ring, applying gain as it is copied in and holding back whatever does not fit
+  void pushAudio(const int16_t* data, size_t samples, int gain = 0) {
+    if (_capture && !AudioCache::admits(_capture->samples.size() + samples)) _capture.reset();
+
+    /* looped audio too large to replay from memory is replayed from its source, without a crossfade */
+    if (!_capture) _holdBack = 0;
+
+    if (0 == _holdBack && flushPending()) {
+      size_t avail;
+      int16_t* dst;
+      while (samples > 0 && (dst = ring().writeSpan(avail), avail > 0)) {
+        size_t n = std::min(avail, samples);
+        vector_copy_sln_volume_granular(dst, data, n, gain);
+        if (_capture) _capture->samples.insert(_capture->samples.end(), dst, dst + n);
+        ring().commit(n);
+        data += n;
+        samples -= n;
+      }
+    }
+    if (samples > 0) {
+      size_t offset = _pending.size();
+      _pending.resize(offset + samples);
+      vector_copy_sln_volume_granular(_pending.data() + offset, data, samples, gain);
+      if (_capture) _capture->samples.insert(_capture->samples.end(), _pending.begin() + offset, _pending.end());
+      if (_holdBack) flushPending();
+    }
+  }
+
+  // decodes mp3 a frame at a time, straight from the decoder into our ring
+  void pushMp3(Mp3Decoder& decoder, const uint8_t* data, size_t len) {
+    if (!decoder.feed(data, len)) return;
+
+    size_t samples;
+    while (const int16_t* frame = decoder.nextFrame(samples)) pushAudio(frame, samples, _gain);
+  }
+
+  // moves held back audio into the ring, bar the tail kept for a loop's crossfade; returns true once there is no more to move
+  bool flushPending() {
+    if (_pending.size() > _holdBack) {
+      size_t n = ring().write(_pending.data(), _pending.size() - _holdBack);
+      _pending.erase(_pending.begin(), _pending.begin() + n);
+    }
+    return _pending.size() <= _holdBack;
+  }
+
+  // hands the audio collected while decoding over to the cache, returning it so it can be replayed
+  AudioCache::EntryPtr commitCapture() {
+    AudioCache::EntryPtr entry = _capture;
+    if (_capture && !_cacheKey.empty()) AudioCache::insert(_cacheKey, entry);
+    _capture.reset();
+    return entry;
+  }
+
+  /**
+   * the number of samples of looped audio crossfaded from its end into its start each time round,
+   * set by DUB_LOOP_CROSSFADE_MS (default 0: a plain, but still gapless, wraparound).  It is at
+   * most half of a clip len samples long.
+   */
+  size_t loopCrossfade(size_t len = SIZE_MAX) const {
+    static const int ms = []() {
+      const char* env = std::getenv("DUB_LOOP_CROSSFADE_MS");
+      return env ? std::max(atoi(env), 0) : 0;
+    }();
+    return std::min(static_cast<size_t>(ms) * _sampleRate / 1000, len / 2);
+  }
+
+  // starts holding back the tail of looped audio as it is decoded, so that it can be crossfaded
+  void holdLoopTail() {
+    _holdBack = _loop && _capture ? loopCrossfade() : 0;
+  }
+
+  /**
+   * carries looped audio on from the copy we decoded, picking up with whatever part of it has not
+   * made it into the ring yet, so the first time round is crossfaded like the rest.
+   */
+  void loopFromMemory(AudioCache::EntryPtr entry) {
+    _cached = entry;
+    _cursor = entry->samples.size() - std::min(_pending.size(), entry->samples.size());
+    _pending.clear();
+    _holdBack = 0;
+  }
+
+  /**
+   * feeds the ring from cached audio, after any held back, until it holds highWater samples.
+   * Looped audio wraps around sample-accurately, its last samples fading out over the first ones
+   * fading in.  Returns true once all of it has been played out.
+   */
+  bool playCached(size_t highWater) {
+    if (!flushPending()) return false;
+
+    const std::vector<int16_t>& samples = _cached->samples;
+    size_t fade = _loop ? loopCrossfade(samples.size()) : 0;
+    size_t end = samples.size() - fade;
+
+    while (ring().size() < highWater) {
+      if (_cursor == samples.size()) {
+        if (!_loop || samples.empty()) break;
+
+        /* the start of the clip was played during the crossfade */
+        _cursor = fade;
+      }
+      size_t want = highWater - ring().size();
+      size_t n;
+      if (_cursor < end) {
+        n = ring().write(samples.data() + _cursor, std::min(end - _cursor, want));
+      }
+      else {
+        size_t avail;
+        int16_t* dst = ring().writeSpan(avail);
+        n = std::min(std::min(avail, want), samples.size() - _cursor);
+        for (size_t i = 0; i < n; i++) {
+          int64_t k = _cursor - end + i;
+          int64_t len = fade;
+          dst[i] = static_cast<int16_t>((samples[_cursor + i] * (len - k) + samples[k] * k) / len);
+        }
+        ring().commit(n);
+      }
+      if (0 == n) break;
+      _cursor += n;
+    }
+    return !_loop && _cursor == samples.size();
+  }
+
   std::mutex& _mutex;
-  CircularBuffer_t& _buffer;
+  CircularBuffer_t& _trackBuffer;
   int _sampleRate;
   int _gain;
   bool _loop;
   std::function<void(bool, const std::string&)> _callback;
   bool _notified;
+  std::vector<int16_t> _pending;
+
+  /* decoded audio is collected into _capture for the cache, and replayed from _cached */
+  std::string _cacheKey;
+  std::shared_ptr<AudioCache::Entry> _capture;
+  AudioCache::EntryPtr _cached;
+  size_t _cursor = 0;
+
+  /* samples at the end of _pending held back for a loop's crossfade */
+  size_t _holdBack = 0;
+
+  boost::asio::io_service::strand _strand;
+
+private:
+  /**
+   * moves what we prefetched over into the track's ring and carries on writing there.  Whatever
+   * the track's ring has no room for yet goes out ahead of the audio already held back.
+   */
+  void doSplice() {
+    if (_stopped) return;
+
+    size_t len;
+    const int16_t* span;
+    while (span = _prefetchBuffer->readSpan(len), len > 0) {
+      size_t n = _trackBuffer.write(span, len);
+      _prefetchBuffer->consume(n);
+      if (n < len) break;
+    }
+    if (!_prefetchBuffer->empty()) {
+      std::vector<int16_t> rest(_prefetchBuffer->size());
+      _prefetchBuffer->read(rest.data(), rest.size());
+      _pending.insert(_pending.begin(), rest.begin(), rest.end());
+    }
+    _ring = &_trackBuffer;
+    _prefetching = false;
+    if (_fetched) finishSplice(boost::system::error_code());
+  }
+
+  // passes on a completion held back while prefetching, once all of our audio is in the track's ring
+  void finishSplice(const boost::system::error_code& error) {
+    if (error || _stopped) return;
+    if (!flushPending()) {
+      auto self = shared_from_this();
+      _spliceTimer.expires_from_now(boost::posix_time::millisec(500));
+      _spliceTimer.async_wait(_strand.wrap([self](const boost::system::error_code& e) { self->finishSplice(e); }));
+      return;
+    }
+    notifyDone(_doneError, _doneMsg);
+  }
+
+  /* a prefetched producer writes to a ring of its own until it is spliced into the track */
+  std::atomic<CircularBuffer_t*> _ring;
+  std::unique_ptr<CircularBuffer_t> _prefetchBuffer;
+  std::atomic<bool> _prefetching;
+  std::atomic<bool> _fetched;
+  bool _stopped;
+  bool _doneError;
+  std::string _doneMsg;
+  boost::asio::deadline_timer _spliceTimer;
 };
 
 
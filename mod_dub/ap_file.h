@@ -58,6 +58,7 @@ public:
   virtual ~AudioProducerFile();
   virtual void start(std::function<void(bool, const std::string&)> callback);
   virtual void stop();
+  virtual const std::string& source() const { return _path; }
   void cleanup(Status_t status, std::string errMsg = "");
   void reset();
 
@@ -66,9 +67,6 @@ public:
   void read_cb(const boost::system::error_code& error);
 
   static bool initialized;
-  static std::thread worker_thread;
-  static boost::asio::io_service io_service;
-  static void threadFunc();
 
 private:
 
@@ -80,7 +78,7 @@ private:
   std::string _path;
   Status_t _status;
   FileType_t _type;
-  mpg123_handle *_mh;
+  std::unique_ptr<Mp3Decoder> _decoder;
   boost::asio::deadline_timer _timer;
   FILE* _fp;
 
@@ -11,36 +11,22 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/assign/list_of.hpp>
 
-#define BUFFER_GROW_SIZE (80000)
+/* the download is paused once the track's ring holds BUFFER_THROTTLE_HIGH samples, and resumed when it drains to BUFFER_THROTTLE_LOW */
 #define BUFFER_THROTTLE_LOW (40000)
 #define BUFFER_THROTTLE_HIGH (160000)
 
+/* mp3 waiting to be decoded; past this the download is paused too, so a busy io pool can't let it pile up */
+#define ENCODED_THROTTLE_HIGH (16384)
+
+/* bounds on how soon a paused download is checked again */
+#define THROTTLE_MIN_CHECK_MS (20)
+#define THROTTLE_MAX_CHECK_MS (2000)
+
 bool AudioProducerHttp::initialized = false;
-boost::asio::io_service AudioProducerHttp::io_service;
-std::thread AudioProducerHttp::worker_thread;
 GlobalInfo_t AudioProducerHttp::global;
 std::map<curl_socket_t, boost::asio::ip::tcp::socket *> AudioProducerHttp::socket_map;
-boost::asio::deadline_timer AudioProducerHttp::multi_timer(AudioProducerHttp::io_service);
-
-void AudioProducerHttp::threadFunc() {      
-  /* to make sure the event loop doesn't terminate when there is no work to do */
-  io_service.reset() ;
-  boost::asio::io_service::work work(io_service);
-  
-  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "ap_http threadFunc - starting\n");
-
-  for(;;) {
-      
-    try {
-      io_service.run() ;
-      break ;
-    }
-    catch( std::exception& e) {
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "ap_http threadFunc - Error: %s\n", e.what());
-    }
-  }
-  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "ap_http threadFunc - ending\n");
-}
+std::unique_ptr<boost::asio::io_service::strand> AudioProducerHttp::multi_strand;
+std::unique_ptr<boost::asio::deadline_timer> AudioProducerHttp::multi_timer;
 
 void AudioProducerHttp::_init() {
   if (!initialized) {
@@ -63,21 +49,26 @@ void AudioProducerHttp::_init() {
     curl_multi_setopt(global.multi, CURLMOPT_TIMERDATA, &global);
     curl_multi_setopt(global.multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
 
-    /* start worker thread */
-    std::thread t(threadFunc) ;
-    worker_thread.swap( t ) ;
+    /* the multi handle is not thread-safe, so everything that drives it runs on one strand of the io pool */
+    multi_strand.reset(new boost::asio::io_service::strand(IoPool::service()));
+    multi_timer.reset(new boost::asio::deadline_timer(IoPool::service()));
   }
 }
 
+/* called at unload, once the io pool has stopped, so that nothing bound to its io_service outlives it */
 void AudioProducerHttp::_deinit() {
   if (initialized) {
     initialized = false;
-    io_service.stop();
-    if (worker_thread.joinable()) {
-      worker_thread.join();
-    }
     /* cleanup curl multi handle*/
     curl_multi_cleanup(global.multi);
+    global.multi = nullptr;
+
+    /* sockets of connections curl had not closed */
+    for (auto& it : socket_map) delete it.second;
+    socket_map.clear();
+
+    multi_timer.reset();
+    multi_strand.reset();
 
     mpg123_exit();
   }
@@ -87,8 +78,9 @@ AudioProducerHttp::AudioProducerHttp(
     std::mutex& mutex,
     CircularBuffer_t& circularBuffer,
     int sampleRate
-) : AudioProducer(mutex, circularBuffer, sampleRate), _status(Status_t::STATUS_NONE), _mh(nullptr), _easy(nullptr), 
-    _error{0}, _response_code(0), _timer(io_service) {
+) : AudioProducer(mutex, circularBuffer, sampleRate), _status(Status_t::STATUS_NONE), _easy(nullptr), 
+    _error{0}, _response_code(0), _timer(IoPool::service()), _throttleTimer(IoPool::service()), _transfer(nullptr),
+    _decodeQueued(false), _backlogged(false) {
 
   AudioProducerHttp::_init();
 }
@@ -99,22 +91,36 @@ AudioProducerHttp::~AudioProducerHttp() {
 }
 
 void AudioProducerHttp::start(std::function<void(bool, const std::string&)> callback) {
-  int mhError = 0;
-
   _callback = callback;
   memset(_error, 0, sizeof(_error));
-
-  /* allocate handle for mpeg decoding */
-  _mh = mpg123_new("auto", &mhError);
-  if (!_mh) {
-    const char *mhErr = mpg123_plain_strerror(mhError);
-    throw std::runtime_error("Error allocating mpg123 handle! " + std::string(mhErr));
+  _etag.clear();
+  _lastModified.clear();
+
+  /**
+   * audio we have already fetched and decoded is played from the cache; if it is due for
+   * revalidation we make a conditional request, and fall back to it on a 304.
+   */
+  bool stale = false;
+  _cached.reset();
+  _cacheKey.clear();
+  if (_method == HttpMethod_t::HTTP_METHOD_GET) {
+    _cacheKey = AudioCache::key(_url, _sampleRate, _gain);
+    _cached = AudioCache::lookup(_cacheKey, stale);
+    if (_cached && !stale) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "AudioProducerHttp::start: playing %s from cache\n", _url.c_str());
+      _cursor = 0;
+      _status = Status_t::STATUS_DOWNLOAD_IN_PROGRESS;
+      _timer.expires_from_now(boost::posix_time::millisec(1));
+      _timer.async_wait(_strand.wrap(boost::bind(&AudioProducerHttp::cached_cb, self<AudioProducerHttp>(), boost::placeholders::_1)));
+      return;
+    }
   }
 
-  if (mpg123_open_feed(_mh) != MPG123_OK) throw std::runtime_error("Error mpg123_open_feed!\n");
-  if (mpg123_format_all(_mh) != MPG123_OK) throw std::runtime_error("Error mpg123_format_all!\n");
-  if (mpg123_param(_mh, MPG123_FORCE_RATE, _sampleRate, 0) != MPG123_OK) throw std::runtime_error("Error forcing resample to 8k!\n");
-  if (mpg123_param(_mh, MPG123_FLAGS, MPG123_MONO_MIX, 0) != MPG123_OK) throw std::runtime_error("Error forcing single channel!\n");
+  /* looped audio is kept so that it can be replayed from memory, even when it can't be cached */
+  if (_method == HttpMethod_t::HTTP_METHOD_GET || _loop) _capture = std::make_shared<AudioCache::Entry>();
+  holdLoopTail();
+
+  _decoder.reset(new Mp3Decoder(_sampleRate));
 
   _easy = createEasyHandle();
   if (!_easy) throw std::runtime_error("Error creating easy handle!\n");
@@ -141,8 +147,7 @@ void AudioProducerHttp::start(std::function<void(bool, const std::string&)> call
   const bool disable_http_2 = switch_true(std::getenv("DISABLE_HTTP2_FOR_TTS_STREAMING"));
   curl_easy_setopt(_easy, CURLOPT_HTTP_VERSION, disable_http_2 ? CURL_HTTP_VERSION_1_1 : CURL_HTTP_VERSION_2_0);
 
-  /* keep the speed down so we don't have to buffer large amounts*/
-  curl_easy_setopt(_easy, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)31415);
+  /* no cap on the transfer rate: initial buffering runs at line speed, and write_cb pauses the transfer once the ring is full enough */
   /*Add request body*/
   if (!_body.empty()) curl_easy_setopt(_easy, CURLOPT_POSTFIELDS, _body.c_str());
   /*Add request proxy*/
@@ -153,12 +158,14 @@ void AudioProducerHttp::start(std::function<void(bool, const std::string&)> call
   for(const auto& header : _headers) {
     hdr_list = curl_slist_append(hdr_list, header.c_str());
   }
+  if (stale && !_cached->etag.empty()) hdr_list = curl_slist_append(hdr_list, ("If-None-Match: " + _cached->etag).c_str());
+  if (stale && !_cached->lastModified.empty()) hdr_list = curl_slist_append(hdr_list, ("If-Modified-Since: " + _cached->lastModified).c_str());
   if (hdr_list) curl_easy_setopt(_easy, CURLOPT_HTTPHEADER, hdr_list);
 
   _status = Status_t::STATUS_AWAITING_RESTART;
 
-  _timer.expires_from_now(boost::posix_time::millisec(1));
-  _timer.async_wait(boost::bind(&AudioProducerHttp::addCurlHandle, this, boost::placeholders::_1));
+  IoPool::jobQueued();
+  multi_strand->post(boost::bind(&AudioProducerHttp::addCurlHandle, self<AudioProducerHttp>(), _easy));
 }
 void AudioProducerHttp::queueHttpGetAudio(const std::string& url, int gain, bool loop) {
   _method = HttpMethod_t::HTTP_METHOD_GET;
@@ -182,9 +189,12 @@ void AudioProducerHttp::queueHttpPostAudio(const std::string& url, const std::st
   _loop = loop;
 }
 
-void AudioProducerHttp::addCurlHandle(const boost::system::error_code& error) {
+/* runs on the multi strand */
+void AudioProducerHttp::addCurlHandle(CURL* easy) {
+  IoPool::jobStarted();
   if (_status == Status_t::STATUS_AWAITING_RESTART) {
-    auto rc = curl_multi_add_handle(global.multi, _easy);
+    _transfer = easy;
+    auto rc = curl_multi_add_handle(global.multi, easy);
     if (mcode_test("new_conn: curl_multi_add_handle", rc) < 0) {
       switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "AudioProducerHttp::addCurlHandle: Error adding easy handle to multi handle\n");
     }
@@ -215,12 +225,15 @@ size_t AudioProducerHttp::static_write_cb(char* ptr, size_t size, size_t nmemb,
   return static_cast<AudioProducerHttp*>(userdata)->write_cb(ptr, size, nmemb);
 }
 
+/**
+ * runs on the multi strand.  Decoding is left to our own strand, so that the socket i/o of
+ * every download on the box is not held up behind one expensive mp3 stream.
+ */
 size_t AudioProducerHttp::write_cb(void *ptr, size_t size, size_t nmemb) {
-  int8_t *data = (int8_t *) ptr;
+  uint8_t *data = (uint8_t *) ptr;
   size_t bytes_received = size * nmemb;
-  std::vector<int16_t> pcm_data;
-  if (_status == Status_t::STATUS_STOPPING || _status == Status_t::STATUS_STOPPED) {
-    _timer.cancel();
+  Status_t status = _status;
+  if (status == Status_t::STATUS_STOPPING || status == Status_t::STATUS_STOPPED) {
     //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, 
     //  "AudioProducerHttp::write_cb: aborting transfer, status %s, mutex %p, buffer %p\n", status2String(_status));
     /* this will abort the transfer */
@@ -230,40 +243,68 @@ size_t AudioProducerHttp::write_cb(void *ptr, size_t size, size_t nmemb) {
     std::string body((char *) ptr, bytes_received);
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "AudioProducerHttp::write_cb: received body %s\n", body.c_str());
     _err_msg = body;
-    _status = Status_t::STATUS_FAILED;
+    _status.compare_exchange_strong(status, Status_t::STATUS_FAILED);
     return 0;
   }
 
-  /* throttle after reaching high water mark */
-  size_t bufSize = _buffer.size();
-  if (bufSize > BUFFER_THROTTLE_HIGH) {
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "AudioProducerHttp::write_cb: throttling download, buffer size is %ld\n", _buffer.size());
-    
-    // check back in 2 seconds
-    _timer.expires_from_now(boost::posix_time::millisec(2000));
-    _timer.async_wait(boost::bind(&AudioProducerHttp::throttling_cb, this, boost::placeholders::_1));
+  /**
+   * pause the transfer after reaching the high water mark, while decoded audio is still held
+   * back, or while decoding is behind; curl hands us this data again once we unpause.
+   */
+  bool pause = ring().size() > BUFFER_THROTTLE_HIGH || _backlogged;
+  if (!pause) {
+    std::lock_guard<std::mutex> lock(_encodedMutex);
+    pause = !_encoded.empty() && _encoded.size() + bytes_received > ENCODED_THROTTLE_HIGH;
+    if (!pause) _encoded.insert(_encoded.end(), data, data + bytes_received);
+  }
+  if (pause) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "AudioProducerHttp::write_cb: throttling download, buffer size is %ld\n", ring().size());
+
+    _throttleTimer.expires_from_now(boost::posix_time::millisec(throttleCheckMs()));
+    _throttleTimer.async_wait(multi_strand->wrap(
+      boost::bind(&AudioProducerHttp::throttling_cb, self<AudioProducerHttp>(), boost::placeholders::_1, _transfer)));
 
-    _status = Status_t::STATUS_DOWNLOAD_PAUSED;
+    _status.compare_exchange_strong(status, Status_t::STATUS_DOWNLOAD_PAUSED);
     return CURL_WRITEFUNC_PAUSE;
   }
 
-  pcm_data = convert_mp3_to_linear(_mh, _gain, data, bytes_received);
-  size_t samples = pcm_data.size();
-  std::lock_guard<std::mutex> lock(_mutex); 
+  if (!_decodeQueued.exchange(true)) {
+    IoPool::jobQueued();
+    _strand.post(boost::bind(&AudioProducerHttp::decode_cb, self<AudioProducerHttp>()));
+  }
+  return bytes_received;
+}
 
-  // Resize the buffer if necessary
-  if (_buffer.capacity() - bufSize < samples) {
-    //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "AudioProducerHttp::write_cb growing buffer, size now %ld\n", _buffer.size()); 
+void AudioProducerHttp::decode_cb() {
+  IoPool::jobStarted();
 
-    //TODO: if buffer exceeds some max size, return CURL_WRITEFUNC_ERROR to abort the transfer
-    _buffer.set_capacity(_buffer.size() + std::max(samples, (size_t)BUFFER_GROW_SIZE));
+  /* anything that arrives from here on gets a decode of its own */
+  _decodeQueued = false;
+  {
+    std::lock_guard<std::mutex> lock(_encodedMutex);
+    _decoding.swap(_encoded);
+  }
+  if (_decoder && _status != Status_t::STATUS_STOPPING && _status != Status_t::STATUS_STOPPED) {
+    /* Push the data into the buffer */
+    pushMp3(*_decoder, _decoding.data(), _decoding.size());
+    if (!flushPending() && !_backlogged) {
+      _backlogged = true;
+      _timer.expires_from_now(boost::posix_time::millisec(500));
+      _timer.async_wait(_strand.wrap(boost::bind(&AudioProducerHttp::flush_cb, self<AudioProducerHttp>(), boost::placeholders::_1)));
+    }
   }
-  //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "AudioProducerHttp::write_cb: writing %ld samples to buffer\n", pcm_data.size());
-  
-  /* Push the data into the buffer */
-  _buffer.insert(_buffer.end(), pcm_data.data(), pcm_data.data() + pcm_data.size());
-  return bytes_received;
+  _decoding.clear();
+}
 
+/* moves audio held back by decode_cb into the ring as it drains, holding the download until it is all in */
+void AudioProducerHttp::flush_cb(const boost::system::error_code& error) {
+  if (error || _status == Status_t::STATUS_STOPPING || _status == Status_t::STATUS_STOPPED) return;
+  if (flushPending()) {
+    _backlogged = false;
+    return;
+  }
+  _timer.expires_from_now(boost::posix_time::millisec(500));
+  _timer.async_wait(_strand.wrap(boost::bind(&AudioProducerHttp::flush_cb, self<AudioProducerHttp>(), boost::placeholders::_1)));
 }
 
 size_t AudioProducerHttp::static_header_callback(char *buffer, size_t size, size_t nitems, void* userdata) {
@@ -277,13 +318,19 @@ size_t AudioProducerHttp::header_callback(char *buffer, size_t size, size_t nite
   std::string input(buffer, bytes_received);
   if (parseHeader(input, header, value)) {
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "header_callback: %s with value %s\n", header.c_str(), value.c_str());
+
+    /* validators, so a cached copy of this audio can be revalidated later */
+    if (boost::iequals(header, "ETag")) _etag = value;
+    else if (boost::iequals(header, "Last-Modified")) _lastModified = value;
   }
   else {
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "header_callback: %s\n", input.c_str());
     if (input.rfind(prefix, 0) == 0) {
       try {
         _response_code = extract_response_code(input);
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "header_callback: parsed response code: %ld\n", _response_code);
+        _etag.clear();
+        _lastModified.clear();
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "header_callback: parsed response code: %d\n", _response_code.load());
       } catch (const std::invalid_argument& e) {
         switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "header_callback: invalid response code %s\n", input.substr(prefix.length()).c_str());
       }
@@ -292,27 +339,40 @@ size_t AudioProducerHttp::header_callback(char *buffer, size_t size, size_t nite
   return bytes_received;
 }
 
-void AudioProducerHttp::throttling_cb(const boost::system::error_code& error) {
-  if (_status == Status_t::STATUS_STOPPING) {
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "throttling_cb: session gone, resume download so we can complete\n");
-    curl_easy_pause(_easy, CURLPAUSE_CONT);
+/* how long until the track will have played its ring down to the low water mark */
+long AudioProducerHttp::throttleCheckMs() const {
+  size_t size = ring().size();
+  long ms = size > BUFFER_THROTTLE_LOW ? static_cast<long>((size - BUFFER_THROTTLE_LOW) * 1000 / _sampleRate) : 0;
+  return std::min(std::max(ms, (long) THROTTLE_MIN_CHECK_MS), (long) THROTTLE_MAX_CHECK_MS);
+}
+
+/* runs on the multi strand */
+void AudioProducerHttp::throttling_cb(const boost::system::error_code& error, CURL* easy) {
+  if (_status == Status_t::STATUS_STOPPING || _status == Status_t::STATUS_STOPPED || easy != _transfer) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "throttling_cb: session gone, transfer is being removed\n");
     return;
   }
   //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "throttling_cb: status is %s\n", status2String(_status));
 
   if (!error) {
-    auto size = _buffer.size();
+    auto size = ring().size();
 
     //switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "throttling_cb: size is now %ld\n", size);
-    if (size < BUFFER_THROTTLE_LOW) {
+    bool decoded;
+    {
+      std::lock_guard<std::mutex> lock(_encodedMutex);
+      decoded = _encoded.empty();
+    }
+    if (size <= BUFFER_THROTTLE_LOW && !_backlogged && decoded) {
       switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "throttling_cb: resuming download\n");
-      curl_easy_pause(_easy, CURLPAUSE_CONT);
+      curl_easy_pause(easy, CURLPAUSE_CONT);
      return;
     }
 
-    // check back in 2 seconds
-    _timer.expires_from_now(boost::posix_time::millisec(2000));
-    _timer.async_wait(boost::bind(&AudioProducerHttp::throttling_cb, this, boost::placeholders::_1));
+    // check back once the ring should have drained to the low water mark
+    _throttleTimer.expires_from_now(boost::posix_time::millisec(throttleCheckMs()));
+    _throttleTimer.async_wait(multi_strand->wrap(
+      boost::bind(&AudioProducerHttp::throttling_cb, self<AudioProducerHttp>(), boost::placeholders::_1, easy)));
 
   } else if (125 == error.value()) {
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "throttling_cb: timer canceled\n");
@@ -356,12 +416,12 @@ void AudioProducerHttp::timer_cb(const boost::system::error_code & error, Global
 int AudioProducerHttp::multi_timer_cb(CURLM *multi, long timeout_ms, GlobalInfo_t *g) {
 
   /* cancel running timer */
-  multi_timer.cancel();
+  multi_timer->cancel();
 
   if(timeout_ms >= 0) {
     // from libcurl 7.88.1-10+deb12u4 does not allow call curl_multi_socket_action or curl_multi_perform in curl_multi callback directly
-    multi_timer.expires_from_now(boost::posix_time::millisec(timeout_ms ? timeout_ms : 1));
-    multi_timer.async_wait(boost::bind(&timer_cb, boost::placeholders::_1, g));
+    multi_timer->expires_from_now(boost::posix_time::millisec(timeout_ms ? timeout_ms : 1));
+    multi_timer->async_wait(multi_strand->wrap(boost::bind(&timer_cb, boost::placeholders::_1, g)));
   }
 
   return 0;
@@ -373,7 +433,7 @@ curl_socket_t AudioProducerHttp::open_socket(void *clientp, curlsocktype purpose
   /* restrict to IPv4 */
   if(purpose == CURLSOCKTYPE_IPCXN && address->family == AF_INET) {
     /* create a tcp socket object */
-    boost::asio::ip::tcp::socket *tcp_socket = new boost::asio::ip::tcp::socket(io_service);
+    boost::asio::ip::tcp::socket *tcp_socket = new boost::asio::ip::tcp::socket(IoPool::service());
 
     /* open it and get the native handle*/
     boost::system::error_code ec;
@@ -442,15 +502,14 @@ int AudioProducerHttp::mcode_test(const char *where, CURLMcode code) {
 }
 
 bool AudioProducerHttp::parseHeader(const std::string& str, std::string& header, std::string& value) {
-  std::vector<std::string> parts;
-  boost::split(parts, str, boost::is_any_of(":"), boost::token_compress_on);
-
-  if (parts.size() != 2)
+  /* only the first colon separates the name; values such as Last-Modified have their own */
+  std::size_t colon = str.find(':');
+  if (colon == std::string::npos)
       return false;
 
-  header = boost::trim_copy(parts[0]);
-  value = boost::trim_copy(parts[1]);
-  return true;
+  header = boost::trim_copy(str.substr(0, colon));
+  value = boost::trim_copy(str.substr(colon + 1));
+  return !header.empty();
 }
 
 int AudioProducerHttp::extract_response_code(const std::string& input) {
@@ -485,27 +544,27 @@ void AudioProducerHttp::setsock(int *fdp, curl_socket_t s, CURL *e, int act, int
   if(act == CURL_POLL_IN) {
     if(oldact != CURL_POLL_IN && oldact != CURL_POLL_INOUT) {
       tcp_socket->async_read_some(boost::asio::null_buffers(),
-                                  boost::bind(&event_cb, g, s,
-                                  CURL_POLL_IN, boost::placeholders::_1, fdp));
+                                  multi_strand->wrap(boost::bind(&event_cb, g, s,
+                                  CURL_POLL_IN, boost::placeholders::_1, fdp)));
     }
   }
   else if(act == CURL_POLL_OUT) {
     if(oldact != CURL_POLL_OUT && oldact != CURL_POLL_INOUT) {
       tcp_socket->async_write_some(boost::asio::null_buffers(),
-                                    boost::bind(&event_cb, g, s,
-                                    CURL_POLL_OUT, boost::placeholders::_1, fdp));
+                                    multi_strand->wrap(boost::bind(&event_cb, g, s,
+                                    CURL_POLL_OUT, boost::placeholders::_1, fdp)));
     }
   }
   else if(act == CURL_POLL_INOUT) {
     if(oldact != CURL_POLL_IN && oldact != CURL_POLL_INOUT) {
       tcp_socket->async_read_some(boost::asio::null_buffers(),
-                                  boost::bind(&event_cb, g, s,
-                                  CURL_POLL_IN, boost::placeholders::_1, fdp));
+                                  multi_strand->wrap(boost::bind(&event_cb, g, s,
+                                  CURL_POLL_IN, boost::placeholders::_1, fdp)));
     }
     if(oldact != CURL_POLL_OUT && oldact != CURL_POLL_INOUT) {
       tcp_socket->async_write_some(boost::asio::null_buffers(),
-                                    boost::bind(&event_cb, g, s,
-                                    CURL_POLL_OUT, boost::placeholders::_1, fdp));
+                                    multi_strand->wrap(boost::bind(&event_cb, g, s,
+                                    CURL_POLL_OUT, boost::placeholders::_1, fdp)));
     }
   }
 }
@@ -536,7 +595,7 @@ void AudioProducerHttp::event_cb(GlobalInfo_t *g, curl_socket_t s, int action, c
     check_multi_info(g);
 
     if(g->still_running <= 0) {
-      multi_timer.cancel();
+      multi_timer->cancel();
     }
 
     /* keep on watching.
@@ -548,13 +607,13 @@ void AudioProducerHttp::event_cb(GlobalInfo_t *g, curl_socket_t s, int action, c
 
       if(action == CURL_POLL_IN) {
         tcp_socket->async_read_some(boost::asio::null_buffers(),
-                                    boost::bind(&event_cb, g, s,
-                                                action, boost::placeholders::_1, fdp));
+                                    multi_strand->wrap(boost::bind(&event_cb, g, s,
+                                                action, boost::placeholders::_1, fdp)));
       }
       if(action == CURL_POLL_OUT) {
         tcp_socket->async_write_some(boost::asio::null_buffers(),
-                                      boost::bind(&event_cb, g, s,
-                                                  action, boost::placeholders::_1, fdp));
+                                      multi_strand->wrap(boost::bind(&event_cb, g, s,
+                                                  action, boost::placeholders::_1, fdp)));
       } 
     }
   }
@@ -601,25 +660,44 @@ void AudioProducerHttp::check_multi_info(GlobalInfo_t *g) {
 
       switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "curl done, response code %d, status %s\n", response_code, status2String(ap->getStatus()));
 
-      bool restart = ap->isLoopedAudio() && ap->getStatus() != Status_t::STATUS_STOPPING && response_code == 200;
-      if (restart) {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "restarting looped audio\n");
-        ap->getTimer().expires_from_now(boost::posix_time::millisec(1000));
-        ap->getTimer().async_wait(boost::bind(&AudioProducerHttp::static_restart_cb, boost::placeholders::_1, ap));
-      }
-      else {
-        ap->cleanup(Status_t::STATUS_DOWNLOAD_COMPLETE, (int) response_code);
-      }
+      /* the rest happens on the producer's strand, after it has decoded everything we handed it */
+      IoPool::jobQueued();
+      ap->_strand.post(boost::bind(&AudioProducerHttp::done_cb, ap->self<AudioProducerHttp>(), res, response_code));
     }
   }
 }
 
-void AudioProducerHttp::static_restart_cb(const boost::system::error_code& error, void* userdata) {
-  static_cast<AudioProducerHttp*>(userdata)->restart_cb(error);
+void AudioProducerHttp::done_cb(CURLcode res, long response_code) {
+  IoPool::jobStarted();
+  if (_status == Status_t::STATUS_STOPPING || _status == Status_t::STATUS_STOPPED) return;
+
+  /* the server confirmed our cached copy is current */
+  if (response_code == 304 && resumeFromCache()) return;
+
+  /* keep a complete, successful download for next time; looped audio then carries on from it without a gap */
+  if (res == CURLE_OK && response_code == 200 && _capture) {
+    _capture->etag = _etag;
+    _capture->lastModified = _lastModified;
+    auto decoded = commitCapture();
+    if (decoded && _loop) {
+      resumeFromCache(decoded);
+      return;
+    }
+  }
+
+  bool restart = _loop && response_code == 200;
+  if (restart) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "restarting looped audio\n");
+    _timer.expires_from_now(boost::posix_time::millisec(1000));
+    _timer.async_wait(_strand.wrap(boost::bind(&AudioProducerHttp::restart_cb, self<AudioProducerHttp>(), boost::placeholders::_1)));
+  }
+  else {
+    cleanup(Status_t::STATUS_DOWNLOAD_COMPLETE, (int) response_code);
+  }
 }
 
 void AudioProducerHttp::restart_cb(const boost::system::error_code& error) {
-  if (_status == Status_t::STATUS_STOPPING) {
+  if (_status == Status_t::STATUS_STOPPING || _status == Status_t::STATUS_STOPPED) {
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "restart_cb: session gone\n");
     return;
   }
@@ -636,27 +714,69 @@ void AudioProducerHttp::restart_cb(const boost::system::error_code& error) {
 }
 
 
+bool AudioProducerHttp::resumeFromCache(AudioCache::EntryPtr entry) {
+  if (entry) {
+    loopFromMemory(entry);
+  }
+  else if (_cached) {
+    AudioCache::revalidated(_cacheKey);
+    _cursor = 0;
+  }
+  else return false;
+
+  reset();
+  _capture.reset();
+  _status = Status_t::STATUS_DOWNLOAD_IN_PROGRESS;
+  _timer.expires_from_now(boost::posix_time::millisec(1));
+  _timer.async_wait(_strand.wrap(boost::bind(&AudioProducerHttp::cached_cb, self<AudioProducerHttp>(), boost::placeholders::_1)));
+  return true;
+}
+
+void AudioProducerHttp::cached_cb(const boost::system::error_code& error) {
+  if (error || _status == Status_t::STATUS_STOPPING || _status == Status_t::STATUS_STOPPED) return;
+
+  /* anything decoded before we switched over goes first */
+  if (flushPending() && playCached(BUFFER_THROTTLE_HIGH)) {
+    cleanup(Status_t::STATUS_DOWNLOAD_COMPLETE, 200);
+  }
+  else {
+    _timer.expires_from_now(boost::posix_time::millisec(1000));
+    _timer.async_wait(_strand.wrap(boost::bind(&AudioProducerHttp::cached_cb, self<AudioProducerHttp>(), boost::placeholders::_1)));
+  }
+}
+
 void AudioProducerHttp::stop() {
-  cleanup(Status_t::STATUS_STOPPED, 0);
+  runOnStrand([this]() {
+    disarm();
+    cleanup(Status_t::STATUS_STOPPED, 0);
+  });
   return;
 }
 
 void AudioProducerHttp::reset() {
-  {
-    std::lock_guard<std::mutex> lock(_mutex);
-    if (_easy) {
-      curl_multi_remove_handle(global.multi, _easy);
-      curl_easy_cleanup(_easy);
-      _easy = nullptr;
-    }
-    if (_mh) {
-      mpg123_close(_mh);
-      mpg123_delete(_mh);
-      _mh = nullptr;
-    }
+  /**
+   * the easy handle can only be removed on the multi strand.  Until that has happened curl may
+   * still call us back, so the removal holds a reference to keep us alive (unless we are already
+   * being destroyed, in which case the transfer has long finished or been stopped).
+   */
+  if (_easy) {
+    CURL* easy = _easy;
+    auto ap = std::static_pointer_cast<AudioProducerHttp>(weak_from_this().lock());
+    _easy = nullptr;
+    multi_strand->post([ap, easy]() {
+      curl_multi_remove_handle(global.multi, easy);
+      curl_easy_cleanup(easy);
+      if (ap && ap->_transfer == easy) {
+        ap->_transfer = nullptr;
+        ap->_throttleTimer.cancel();
+      }
+    });
   }
+  /* runs on our strand, or from the destructor once no handler holds us, so needs no lock */
+  _decoder.reset();
   _err_msg.clear();
   _response_code = 0;
+  _backlogged = false;
   _timer.cancel();
   _status = Status_t::STATUS_NONE;
 }
@@ -665,5 +785,18 @@ void AudioProducerHttp::cleanup(Status_t status, int response_code) {
   std::string errMsg = response_code > 200 ? "http response: " + std::to_string(response_code) : "";
   reset();
   _status = status;
+
+  /* don't hand the track over to the next producer until all of our audio is in the ring */
+  if (status == Status_t::STATUS_DOWNLOAD_COMPLETE && !flushPending()) {
+    _timer.expires_from_now(boost::posix_time::millisec(500));
+    _timer.async_wait(_strand.wrap(boost::bind(&AudioProducerHttp::drain_cb, self<AudioProducerHttp>(), boost::placeholders::_1, response_code)));
+    return;
+  }
   notifyDone(!errMsg.empty(), errMsg);
+}
+
+/* the timer may already have fired when stop() cancels it, so this must not outlive the track's audio */
+void AudioProducerHttp::drain_cb(const boost::system::error_code& error, int response_code) {
+  if (error || _status == Status_t::STATUS_STOPPING || _status == Status_t::STATUS_STOPPED) return;
+  cleanup(Status_t::STATUS_DOWNLOAD_COMPLETE, response_code);
 }
\ No newline at end of file
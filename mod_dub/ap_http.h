@@ -2,6 +2,9 @@
 #define __AP_HTTP_H__
 
 #include "ap.h"
+#include <map>
+#include <atomic>
+#include <memory>
 #include <curl/curl.h>
 #include <mpg123.h>
 #include <boost/asio.hpp>
@@ -61,8 +64,9 @@ public:
   virtual ~AudioProducerHttp();
 
   virtual void start(std::function<void(bool, const std::string&)> callback);
-  void addCurlHandle(const boost::system::error_code& error);
+  void addCurlHandle(CURL* easy);
   virtual void stop();
+  virtual const std::string& source() const { return _url; }
   void cleanup(Status_t status, int response_code);
   void reset();
 
@@ -73,14 +77,10 @@ public:
   Status_t getStatus() const { return _status; }
   void setStatus(Status_t status) { _status = status; }
 
-  boost::asio::deadline_timer& getTimer() { return _timer; }
-  
   static bool initialized;
-  static std::thread worker_thread;
-  static boost::asio::io_service io_service;
-  static void threadFunc();
   static std::map<curl_socket_t, boost::asio::ip::tcp::socket *> socket_map;
-  static boost::asio::deadline_timer multi_timer;
+  static std::unique_ptr<boost::asio::io_service::strand> multi_strand;
+  static std::unique_ptr<boost::asio::deadline_timer> multi_timer;
 
 
   static GlobalInfo_t global;
@@ -101,18 +101,29 @@ public:
   static size_t static_header_callback(char *buffer, size_t size, size_t nitems, void* userdata);
   size_t header_callback(char *buffer, size_t size, size_t nitems);
 
-  void throttling_cb(const boost::system::error_code& error);
+  void throttling_cb(const boost::system::error_code& error, CURL* easy);
+  long throttleCheckMs() const;
 
-  static void static_restart_cb(const boost::system::error_code& error, void* userdata);
+  void decode_cb();
+  void flush_cb(const boost::system::error_code& error);
+  void done_cb(CURLcode res, long response_code);
   void restart_cb(const boost::system::error_code& error);
 
+  void drain_cb(const boost::system::error_code& error, int response_code);
+
+  // plays the revalidated cached audio after a 304, or carries looped audio on from the copy just decoded
+  bool resumeFromCache(AudioCache::EntryPtr entry = nullptr);
+  void cached_cb(const boost::system::error_code& error);
+
   static int close_socket(void *clientp, curl_socket_t item);
   static curl_socket_t open_socket(void *clientp, curlsocktype purpose, struct curl_sockaddr *address);
 
+  // releases the multi handle and everything bound to the io pool, at module unload
+  static void _deinit();
+
 private:
 
   static void _init();
-  static void _deinit();
 
   CURL* createEasyHandle();
   bool parseHeader(const std::string& str, std::string& header, std::string& value);
@@ -123,13 +134,29 @@ private:
   std::string _body;
   std::string _proxy;
   std::vector<std::string> _headers;
-  Status_t _status;
-  mpg123_handle *_mh;
+  std::atomic<Status_t> _status;
+  std::unique_ptr<Mp3Decoder> _decoder;
   CURL *_easy;
   char _error[CURL_ERROR_SIZE]; // curl error buffer
   std::string _err_msg;
-  int _response_code;
+  std::atomic<int> _response_code;
   boost::asio::deadline_timer _timer;
+
+  /**
+   * state of the transfer, touched only on the multi strand.  The ETag and Last-Modified
+   * headers are read from there too, but only once the transfer is done.
+   */
+  boost::asio::deadline_timer _throttleTimer;
+  CURL *_transfer;
+  std::string _etag;
+  std::string _lastModified;
+
+  /* mp3 handed from the multi strand to ours for decoding */
+  std::mutex _encodedMutex;
+  std::vector<uint8_t> _encoded;
+  std::vector<uint8_t> _decoding;
+  std::atomic<bool> _decodeQueued;
+  std::atomic<bool> _backlogged;
 };
 
 #endif
\ No newline at end of file
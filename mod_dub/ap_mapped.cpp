@@ -0,0 +1,352 @@
+#include "switch.h"
+#include "ap_mapped.h"
+#include "vector_math.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BUFFER_THROTTLE_HIGH (160000)
+
+/* stereo files are mixed down this many frames at a time */
+#define MIXDOWN_FRAMES (4096)
+
+/* files up to this size are read into memory when opened, larger ones as they play */
+#define COPY_MAX_BYTES (1024 * 1024)
+
+/* files not held in memory are read this many frames at a time, unless read straight into the ring */
+#define READ_FRAMES (4096)
+
+/* looped audio collected for its crossfade goes through this many samples at a time */
+#define SCRATCH_SAMPLES (8192)
+
+std::mutex SharedFile::mutex;
+std::unordered_map<std::string, std::weak_ptr<SharedFile>> SharedFile::files;
+
+
+std::shared_ptr<SharedFile> SharedFile::open(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error("Error opening file " + path);
+
+  struct stat st;
+  if (0 != ::fstat(fd, &st)) {
+    ::close(fd);
+    throw std::runtime_error("Error reading size of file " + path);
+  }
+
+  /* reuse the file another call has open, unless it has since been replaced or changed */
+  auto it = files.find(path);
+  if (it != files.end()) {
+    auto existing = it->second.lock();
+    if (existing && existing->_dev == st.st_dev && existing->_ino == st.st_ino &&
+      existing->_mtime == st.st_mtime && existing->_size == static_cast<size_t>(st.st_size)) {
+      ::close(fd);
+      return existing;
+    }
+  }
+
+  std::shared_ptr<SharedFile> file(new SharedFile());
+  file->_size = st.st_size;
+  file->_dev = st.st_dev;
+  file->_ino = st.st_ino;
+  file->_mtime = st.st_mtime;
+  file->_fd = fd;
+  if (file->_size <= COPY_MAX_BYTES) {
+    file->_copy.resize(file->_size);
+    size_t n = file->pread(file->_copy.data(), file->_size, 0);
+    ::close(fd);
+    file->_fd = -1;
+    if (n != file->_size) throw std::runtime_error("Error reading file " + path);
+    file->_data = file->_copy.data();
+  }
+  else {
+    /* kept open, and read from as the calls playing it need more */
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  /* drop registrations of files nobody is using any more */
+  for (auto i = files.begin(); i != files.end();) {
+    if (i->second.expired()) i = files.erase(i);
+    else ++i;
+  }
+  files[path] = file;
+  return file;
+}
+
+SharedFile::~SharedFile() {
+  if (_fd >= 0) ::close(_fd);
+}
+
+size_t SharedFile::read(void* buf, size_t len, size_t offset) const {
+  if (!_data) return pread(buf, len, offset);
+  if (offset >= _size) return 0;
+  len = std::min(len, _size - offset);
+  memcpy(buf, _data + offset, len);
+  return len;
+}
+
+/* comes up short, rather than faulting, if the file has been truncated since it was opened */
+size_t SharedFile::pread(void* buf, size_t len, size_t offset) const {
+  size_t total = 0;
+  while (total < len) {
+    ssize_t n = ::pread(_fd, static_cast<uint8_t*>(buf) + total, len - total, offset + total);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    total += n;
+  }
+  return total;
+}
+
+AudioProducerMapped::AudioProducerMapped(
+  std::mutex& mutex,
+  CircularBuffer_t& circularBuffer,
+  int sampleRate
+) : AudioProducer(mutex, circularBuffer, sampleRate), _status(Status_t::STATUS_NONE), _samples(nullptr), _frames(0),
+  _channels(1), _fileRate(sampleRate), _resampler(nullptr), _dataOffset(0), _timer(IoPool::service()) {
+}
+
+AudioProducerMapped::~AudioProducerMapped() {
+  reset();
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "AudioProducerMapped::~AudioProducerMapped %p\n", (void *)this);
+}
+
+bool AudioProducerMapped::handles(const std::string& path) {
+  size_t pos = path.find_last_of('.');
+  if (pos == std::string::npos) return false;
+  auto filetype = path.substr(pos + 1);
+  return 0 == filetype.compare("r8") || 0 == filetype.compare("r16") || 0 == filetype.compare("wav");
+}
+
+void AudioProducerMapped::queueFileAudio(const std::string& path, int gain, bool loop) {
+  _path = path;
+  _gain = gain;
+  _loop = loop;
+
+  _file = SharedFile::open(path);
+
+  auto filetype = path.substr(path.find_last_of('.') + 1);
+  if (0 == filetype.compare("wav")) {
+    parseWave();
+  }
+  else {
+    _samples = reinterpret_cast<const int16_t*>(_file->data());
+    _frames = _file->size() / sizeof(int16_t);
+    _dataOffset = 0;
+    _channels = 1;
+    _fileRate = 0 == filetype.compare("r8") ? 8000 : 16000;
+  }
+}
+
+static uint32_t read_le32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static uint16_t read_le16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+/* finds the fmt and data chunks of a RIFF/WAVE file; only 16-bit linear PCM, mono or stereo, is supported */
+void AudioProducerMapped::parseWave() {
+  size_t len = _file->size();
+  uint8_t riff[12];
+  uint8_t chunk[8 + 16];
+  bool haveFormat = false;
+
+  if (_file->read(riff, sizeof(riff), 0) != sizeof(riff) || 0 != memcmp(riff, "RIFF", 4) || 0 != memcmp(riff + 8, "WAVE", 4)) {
+    throw std::runtime_error("file " + _path + " is not a wave file");
+  }
+
+  size_t offset = 12;
+  while (offset + 8 <= len && _file->read(chunk, 8, offset) == 8) {
+    size_t chunkLen = read_le32(chunk + 4);
+    offset += 8;
+
+    if (0 == memcmp(chunk, "fmt ", 4) && chunkLen >= 16 && _file->read(chunk + 8, 16, offset) == 16) {
+      uint16_t format = read_le16(chunk + 8);
+      _channels = read_le16(chunk + 10);
+      _fileRate = read_le32(chunk + 12);
+      uint16_t bitsPerSample = read_le16(chunk + 22);
+
+      /* 0xFFFE is WAVE_FORMAT_EXTENSIBLE; we take its subformat to be PCM, as it is for 16-bit audio in practice */
+      if ((format != 1 && format != 0xFFFE) || bitsPerSample != 16 || _channels < 1 || _channels > 2 || _fileRate <= 0) {
+        throw std::runtime_error("file " + _path + " is not 16-bit linear PCM, mono or stereo");
+      }
+      haveFormat = true;
+    }
+    else if (0 == memcmp(chunk, "data", 4)) {
+      if (!haveFormat) break;
+      _samples = _file->data() ? reinterpret_cast<const int16_t*>(_file->data() + offset) : nullptr;
+      _dataOffset = offset;
+      _frames = std::min(chunkLen, len - offset) / (sizeof(int16_t) * _channels);
+      return;
+    }
+
+    /* chunks are padded to an even length */
+    offset += chunkLen + (chunkLen & 1);
+  }
+  throw std::runtime_error("file " + _path + " has no audio");
+}
+
+void AudioProducerMapped::start(std::function<void(bool, const std::string&)> callback) {
+  _callback = callback;
+  _cursor = 0;
+
+  if (_fileRate != _sampleRate) {
+    int err;
+    _resampler = speex_resampler_init(1, _fileRate, _sampleRate, SWITCH_RESAMPLE_QUALITY, &err);
+    if (0 != err) throw std::runtime_error("Error initializing resampler: " + std::string(speex_resampler_strerror(err)));
+  }
+  if (2 == _channels) _mixdown.resize(MIXDOWN_FRAMES);
+
+  /* looped audio is collected the first time round, so that it can be crossfaded from memory */
+  if (_loop && loopCrossfade() > 0) {
+    _capture = std::make_shared<AudioCache::Entry>();
+    holdLoopTail();
+    _scratch.resize(SCRATCH_SAMPLES);
+  }
+
+  _status = Status_t::STATUS_IN_PROGRESS;
+
+  /* fill the ring on the io pool so we don't block here */
+  _timer.expires_from_now(boost::posix_time::millisec(1));
+  _timer.async_wait(_strand.wrap(boost::bind(&AudioProducerMapped::feed_cb, self<AudioProducerMapped>(), boost::placeholders::_1)));
+}
+
+/* reads up to frames of audio at the cursor into dst, returning how many were read */
+size_t AudioProducerMapped::readFrames(int16_t* dst, size_t frames) {
+  size_t frameBytes = sizeof(int16_t) * _channels;
+  return _file->read(dst, frames * frameBytes, _dataOffset + _cursor * frameBytes) / frameBytes;
+}
+
+/* the audio at the cursor, up to frames of it: straight from memory if the file is held there, otherwise read from it */
+const int16_t* AudioProducerMapped::audioAt(size_t& frames) {
+  if (_samples) return _samples + _cursor * _channels;
+
+  frames = std::min(frames, (size_t) READ_FRAMES);
+  _readBuffer.resize(frames * _channels);
+  frames = readFrames(_readBuffer.data(), frames);
+  return _readBuffer.data();
+}
+
+/* converts audio from the cursor into dst, returning the number of samples produced */
+size_t AudioProducerMapped::feed(int16_t* dst, size_t len) {
+  size_t frames = _frames - _cursor;
+  if (0 == frames || 0 == len) return 0;
+
+  /* mono audio at the track's rate needs no converting, so a file not held in memory is read straight into place */
+  bool direct = !_samples && !_resampler && 1 == _channels;
+  const int16_t* src = dst;
+  if (direct) frames = readFrames(dst, std::min(frames, len));
+  else src = audioAt(frames);
+
+  /* a file cut short ends where it now ends */
+  if (0 == frames) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "AudioProducerMapped: %s was cut short during playback\n", _path.c_str());
+    _frames = _cursor;
+    return 0;
+  }
+
+  if (2 == _channels) {
+    frames = std::min(frames, _mixdown.size());
+    for (size_t i = 0; i < frames; i++) _mixdown[i] = (src[2 * i] + src[2 * i + 1]) / 2;
+    src = _mixdown.data();
+  }
+
+  if (_resampler) {
+    spx_uint32_t in_len = frames;
+    spx_uint32_t out_len = len;
+    speex_resampler_process_int(_resampler, 0, src, &in_len, dst, &out_len);
+    _cursor += in_len;
+    return out_len;
+  }
+
+  size_t n = std::min(frames, len);
+  if (src != dst) memcpy(dst, src, n * sizeof(int16_t));
+  _cursor += n;
+  return n;
+}
+
+void AudioProducerMapped::feed_cb(const boost::system::error_code& error) {
+  if (_status == Status_t::STATUS_STOPPED) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "feed_cb: session gone\n");
+    return;
+  }
+  if (error) {
+    cleanup(Status_t::STATUS_FAILED, error.message());
+    return;
+  }
+
+  /* looped audio carries on from the copy collected the first time round */
+  if (_cached) {
+    playCached(BUFFER_THROTTLE_HIGH);
+    _timer.expires_from_now(boost::posix_time::millisec(1000));
+    _timer.async_wait(_strand.wrap(boost::bind(&AudioProducerMapped::feed_cb, self<AudioProducerMapped>(), boost::placeholders::_1)));
+    return;
+  }
+
+  /* audio held back when we were spliced in from a prefetch goes first */
+  while (flushPending() && ring().size() < BUFFER_THROTTLE_HIGH) {
+    if (_cursor == _frames) {
+      if (!_loop || 0 == _frames) break;
+
+      /* unless it was too large to keep, in which case it wraps around without a crossfade */
+      auto collected = commitCapture();
+      if (collected) {
+        loopFromMemory(collected);
+        playCached(BUFFER_THROTTLE_HIGH);
+        break;
+      }
+      _cursor = 0;
+    }
+    size_t cursor = _cursor;
+    size_t produced;
+    if (_capture) {
+      produced = feed(_scratch.data(), _scratch.size());
+      pushAudio(_scratch.data(), produced, _gain);
+    }
+    else {
+      size_t avail;
+      int16_t* dst = ring().writeSpan(avail);
+      avail = std::min(avail, BUFFER_THROTTLE_HIGH - ring().size());
+      if (0 == avail) break;
+
+      produced = feed(dst, avail);
+      if (_gain != 0) vector_change_sln_volume_granular(dst, produced, _gain);
+      ring().commit(produced);
+    }
+    if (0 == produced && cursor == _cursor) break;
+  }
+
+  if (!_loop && _cursor == _frames && _pending.empty()) {
+    cleanup(Status_t::STATUS_COMPLETE);
+  }
+  else {
+    _timer.expires_from_now(boost::posix_time::millisec(1000));
+    _timer.async_wait(_strand.wrap(boost::bind(&AudioProducerMapped::feed_cb, self<AudioProducerMapped>(), boost::placeholders::_1)));
+  }
+}
+
+void AudioProducerMapped::stop() {
+  runOnStrand([this]() {
+    disarm();
+    cleanup(Status_t::STATUS_STOPPED, "");
+  });
+}
+
+void AudioProducerMapped::reset() {
+  /* runs on our strand, or from the destructor once no handler holds us, so needs no lock */
+  if (_resampler) {
+    speex_resampler_destroy(_resampler);
+    _resampler = nullptr;
+  }
+  _timer.cancel();
+  _status = Status_t::STATUS_NONE;
+}
+
+void AudioProducerMapped::cleanup(Status_t status, std::string errMsg) {
+  reset();
+  _status = status;
+  notifyDone(status != Status_t::STATUS_COMPLETE, errMsg);
+}
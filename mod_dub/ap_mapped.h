@@ -0,0 +1,115 @@
+#ifndef __AP_MAPPED_H__
+#define __AP_MAPPED_H__
+
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+#include <sys/types.h>
+#include <speex/speex_resampler.h>
+
+#include "ap.h"
+
+/**
+ * a file opened once and shared by the calls playing it.  Small files are read into memory, larger
+ * ones are read as they play, with pread on the shared descriptor, out of the page cache.
+ *
+ * Larger files are deliberately not mapped: touching a mapping past the end of a file that has since
+ * been truncated raises SIGBUS, and no check made before the access can rule out the file being cut
+ * short in between.  A read of a truncated file just comes up short, and playback ends there.
+ */
+class SharedFile {
+public:
+  static std::shared_ptr<SharedFile> open(const std::string& path);
+  ~SharedFile();
+
+  // the file's contents if it is held in memory, otherwise null
+  const uint8_t* data() const { return _data; }
+  size_t size() const { return _size; }
+
+  // reads from the file, or its copy in memory, returning the number of bytes read
+  size_t read(void* buf, size_t len, size_t offset) const;
+
+  // no copying
+  SharedFile(const SharedFile&) = delete;
+  void operator=(const SharedFile&) = delete;
+
+private:
+  SharedFile() : _data(nullptr), _size(0), _fd(-1) {}
+
+  size_t pread(void* buf, size_t len, size_t offset) const;
+
+  const uint8_t* _data;
+  size_t _size;
+  int _fd;
+  std::vector<uint8_t> _copy;
+  dev_t _dev;
+  ino_t _ino;
+  time_t _mtime;
+
+  static std::mutex mutex;
+  static std::unordered_map<std::string, std::weak_ptr<SharedFile>> files;
+};
+
+/**
+ * plays linear PCM files (.r8, .r16, and 16-bit .wav) out of a shared file.  There is nothing
+ * to decode: when the file's rate matches the track's, samples are copied or read straight into
+ * the track's ring, otherwise they are resampled into it.  Looped audio is
+ * crossfaded like the other producers': the first time round is collected and the rest played
+ * from memory.
+ */
+class AudioProducerMapped : public AudioProducer {
+public:
+
+  typedef enum
+  {
+    STATUS_NONE = 0,
+    STATUS_FAILED,
+    STATUS_IN_PROGRESS,
+    STATUS_COMPLETE,
+    STATUS_STOPPED
+  } Status_t;
+
+  AudioProducerMapped(
+    std::mutex& mutex,
+    CircularBuffer_t& circularBuffer,
+    int sampleRate
+  );
+  virtual ~AudioProducerMapped();
+  virtual void start(std::function<void(bool, const std::string&)> callback);
+  virtual void stop();
+  virtual const std::string& source() const { return _path; }
+  void cleanup(Status_t status, std::string errMsg = "");
+  void reset();
+
+  // whether the file is one this producer plays, judging by its extension
+  static bool handles(const std::string& path);
+
+  void queueFileAudio(const std::string& path, int gain = 0, bool loop = false);
+
+  void feed_cb(const boost::system::error_code& error);
+
+private:
+
+  void parseWave();
+  size_t readFrames(int16_t* dst, size_t frames);
+  const int16_t* audioAt(size_t& frames);
+  size_t feed(int16_t* dst, size_t len);
+
+  std::string _path;
+  Status_t _status;
+  std::shared_ptr<SharedFile> _file;
+  const int16_t* _samples;
+  size_t _frames;
+  int _channels;
+  int _fileRate;
+  SpeexResamplerState* _resampler;
+  std::vector<int16_t> _mixdown;
+  size_t _dataOffset;
+  std::vector<int16_t> _readBuffer;
+  std::vector<int16_t> _scratch;
+  boost::asio::deadline_timer _timer;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include "audio_cache.h"
+#include "switch.h"
+#include <cstdlib>
+
+#define DEFAULT_CACHE_MB (64)
+#define DEFAULT_CACHE_TTL_SECS (300)
+
+std::mutex AudioCache::mutex;
+std::list<std::string> AudioCache::lru;
+std::unordered_map<std::string, AudioCache::Node> AudioCache::entries;
+size_t AudioCache::bytes = 0;
+size_t AudioCache::budget = 0;
+std::chrono::seconds AudioCache::ttl(DEFAULT_CACHE_TTL_SECS);
+AudioCache::Stats AudioCache::counters = {};
+
+static size_t entry_bytes(const AudioCache::EntryPtr& entry) {
+  return entry->samples.size() * sizeof(int16_t);
+}
+
+void AudioCache::_init() {
+  static std::once_flag once;
+  std::call_once(once, []() {
+    const char* mb = std::getenv("DUB_AUDIO_CACHE_MB");
+    const char* secs = std::getenv("DUB_AUDIO_CACHE_TTL");
+    budget = static_cast<size_t>(mb ? std::max(atoi(mb), 0) : DEFAULT_CACHE_MB) * 1024 * 1024;
+    if (secs) ttl = std::chrono::seconds(std::max(atoi(secs), 0));
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "AudioCache: budget %lu bytes, http entries revalidated after %ld secs\n",
+      budget, (long) ttl.count());
+  });
+}
+
+std::string AudioCache::key(const std::string& source, int sampleRate, int gain) {
+  return source + "|" + std::to_string(sampleRate) + "|" + std::to_string(gain);
+}
+
+AudioCache::EntryPtr AudioCache::lookup(const std::string& key, bool& stale) {
+  _init();
+  std::lock_guard<std::mutex> lock(mutex);
+
+  stale = false;
+  auto it = entries.find(key);
+  if (it == entries.end()) {
+    counters.misses++;
+    return nullptr;
+  }
+
+  Node& node = it->second;
+  if (0 == key.compare(0, 4, "http") && Clock::now() - node.validated > ttl) {
+    if (node.entry->etag.empty() && node.entry->lastModified.empty()) {
+      /* nothing to revalidate with, so it has to be fetched again */
+      bytes -= entry_bytes(node.entry);
+      lru.erase(node.lru);
+      entries.erase(it);
+      counters.misses++;
+      return nullptr;
+    }
+    stale = true;
+  }
+
+  lru.splice(lru.begin(), lru, node.lru);
+  counters.hits++;
+  return node.entry;
+}
+
+void AudioCache::insert(const std::string& key, EntryPtr entry) {
+  _init();
+  if (!entry || entry->samples.empty() || !admits(entry->samples.size())) return;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = entries.find(key);
+  if (it != entries.end()) {
+    bytes -= entry_bytes(it->second.entry);
+    lru.erase(it->second.lru);
+    entries.erase(it);
+  }
+  evict(budget - entry_bytes(entry));
+
+  lru.push_front(key);
+  entries[key] = Node{entry, Clock::now(), lru.begin()};
+  bytes += entry_bytes(entry);
+  counters.inserts++;
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "AudioCache::insert: %s, %lu samples, cache now holds %lu bytes\n",
+    key.c_str(), entry->samples.size(), bytes);
+}
+
+void AudioCache::revalidated(const std::string& key) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = entries.find(key);
+  if (it != entries.end()) {
+    it->second.validated = Clock::now();
+    counters.revalidations++;
+  }
+}
+
+bool AudioCache::admits(size_t samples) {
+  _init();
+
+  /* a single entry may take up to a quarter of the budget, so that one long file can't flush everything else */
+  return samples * sizeof(int16_t) <= budget / 4;
+}
+
+/* called with the mutex held */
+void AudioCache::evict(size_t target) {
+  while (bytes > target && !lru.empty()) {
+    auto it = entries.find(lru.back());
+    bytes -= entry_bytes(it->second.entry);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "AudioCache::evict: %s\n", lru.back().c_str());
+    entries.erase(it);
+    lru.pop_back();
+    counters.evictions++;
+  }
+}
+
+AudioCache::Stats AudioCache::stats() {
+  _init();
+  std::lock_guard<std::mutex> lock(mutex);
+  Stats s = counters;
+  s.entries = entries.size();
+  s.bytes = bytes;
+  s.budget = budget;
+  return s;
+}
+
+void AudioCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.clear();
+  lru.clear();
+  bytes = 0;
+}
@@ -0,0 +1,83 @@
+#ifndef __AUDIO_CACHE_H__
+#define __AUDIO_CACHE_H__
+
+#include <list>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+/**
+ * process-wide cache of decoded audio, shared by the tracks of every session.
+ *
+ * Entries are keyed by source (url or file path), sample rate and gain, and hold the fully
+ * decoded, gain-adjusted PCM.  They are immutable once inserted and are handed out as shared
+ * pointers, so a producer that is playing an entry keeps it alive even if the cache evicts it.
+ * The cache is an LRU bounded by a byte budget, DUB_AUDIO_CACHE_MB (default 64; 0 disables it).
+ *
+ * Entries record the validators their source was served with.  HTTP entries older than
+ * DUB_AUDIO_CACHE_TTL seconds (default 300) are reported as stale, for the caller to revalidate
+ * with a conditional GET; those that have no validators are simply dropped.
+ */
+class AudioCache {
+public:
+  struct Entry {
+    std::vector<int16_t> samples;
+    std::string etag;
+    std::string lastModified;
+  };
+  typedef std::shared_ptr<const Entry> EntryPtr;
+
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t revalidations;
+    uint64_t inserts;
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+  };
+
+  static std::string key(const std::string& source, int sampleRate, int gain);
+
+  // returns the cached audio or nullptr; stale is set if it must be revalidated before it is played
+  static EntryPtr lookup(const std::string& key, bool& stale);
+
+  // adds (or replaces) an entry, evicting the least recently used ones to stay within the budget
+  static void insert(const std::string& key, EntryPtr entry);
+
+  // restarts the freshness lifetime of an entry once its source has confirmed it is unchanged
+  static void revalidated(const std::string& key);
+
+  // whether audio of this many samples would be accepted, so producers can stop collecting it early
+  static bool admits(size_t samples);
+
+  static Stats stats();
+  static void clear();
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Node {
+    EntryPtr entry;
+    Clock::time_point validated;
+    std::list<std::string>::iterator lru;
+  };
+
+  static void _init();
+  static void evict(size_t budget);
+
+  static std::mutex mutex;
+  static std::list<std::string> lru;
+  static std::unordered_map<std::string, Node> entries;
+  static size_t bytes;
+  static size_t budget;
+  static std::chrono::seconds ttl;
+  static Stats counters;
+};
+
+#endif
@@ -1,9 +1,9 @@
 #ifndef _COMMON_H_
 #define _COMMON_H_
 
-#include <boost/circular_buffer.hpp>
+#include "pcm_ring.h"
 
-typedef boost::circular_buffer<int16_t> CircularBuffer_t;
+typedef PcmRing CircularBuffer_t;
 
 
 #endif
\ No newline at end of file
@@ -1,6 +1,10 @@
 #include "mod_dub.h"
 #include "tts_vendor_parser.h"
 #include "track.h"
+#include "audio_cache.h"
+#include "ap_http.h"
+#include "io_pool.h"
+#include "mpg_decode.h"
 #include "vector_math.h"
 #include <string>
 #include <queue>
@@ -9,10 +13,9 @@
 
 #include <curl/curl.h>
 
-#include <boost/circular_buffer.hpp>
-
-typedef boost::circular_buffer<int16_t> CircularBuffer_t;
-#define INIT_BUFFER_SIZE (80000)
+#if MAX_DUB_TRACKS > VECTOR_MIX_MAX_SOURCES
+#error "MAX_DUB_TRACKS exceeds the number of sources the mixer can sum"
+#endif
 
 extern "C" {
 
@@ -96,6 +99,55 @@ extern "C" {
     return SWITCH_STATUS_SUCCESS;
   }
 
+  switch_status_t set_dub_track_gain(struct cap_cb* cb, char* trackName, int gain, int rampMs) {
+    Track* track = find_track_by_name(cb->tracks, trackName);
+
+    if (!track) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "set_dub_track_gain: track %s not found\n", trackName);
+      return SWITCH_STATUS_FALSE;
+    }
+    track->setGain(gain, rampMs);
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  switch_status_t duck_dub_track(struct cap_cb* cb, char* trackName, int gain, int rampMs, char* triggerTrack) {
+    Track* track = find_track_by_name(cb->tracks, trackName);
+
+    if (!track) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "duck_dub_track: track %s not found\n", trackName);
+      return SWITCH_STATUS_FALSE;
+    }
+    track->duck(gain, rampMs, triggerTrack ? triggerTrack : "");
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  switch_status_t unduck_dub_track(struct cap_cb* cb, char* trackName) {
+    Track* track = find_track_by_name(cb->tracks, trackName);
+
+    if (!track) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "unduck_dub_track: track %s not found\n", trackName);
+      return SWITCH_STATUS_FALSE;
+    }
+    track->unduck();
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  /* one line per queued item: its position, state, audio prefetched (ms) and source */
+  switch_status_t dub_track_queue_status(struct cap_cb* cb, char* trackName, switch_stream_handle_t *stream) {
+    Track* track = find_track_by_name(cb->tracks, trackName);
+
+    if (!track) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "dub_track_queue_status: track %s not found\n", trackName);
+      return SWITCH_STATUS_FALSE;
+    }
+    std::vector<Track::QueuedAudio> items;
+    track->getQueueStatus(items);
+    for (size_t i = 0; i < items.size(); i++) {
+      stream->write_function(stream, "%lu %s %lu %s\n", i, items[i].state, items[i].bufferedMs, items[i].source.c_str());
+    }
+    return SWITCH_STATUS_SUCCESS;
+  }
+
   switch_status_t say_dub_track(struct cap_cb* cb, char* trackName, char* text, int gain) {
     std::vector<std::string> headers;
     std::string url, body, proxy;
@@ -120,9 +172,32 @@ extern "C" {
   }
 
   switch_status_t dub_cleanup() {
+    /* the http producers' multi handle, timer and strand are bound to the io pool, so go once it has stopped */
+    IoPool::shutdown();
+    AudioProducerHttp::_deinit();
+    AudioCache::clear();
     return SWITCH_STATUS_SUCCESS;
   }
 
+  void dub_io_pool_stats(switch_stream_handle_t *stream) {
+    IoPool::Stats stats = IoPool::stats();
+    stream->write_function(stream, "threads: %lu\nqueued: %lu\nmax_queued: %lu\njobs: %lu\nloop_lag_us: %lu\navg_loop_lag_us: %lu\nmax_loop_lag_us: %lu\n",
+      stats.threads, stats.queued, stats.maxQueued, stats.jobs, stats.lagUs, stats.avgLagUs, stats.maxLagUs);
+
+    Mp3Decoder::Stats decoded = Mp3Decoder::totals();
+    stream->write_function(stream, "mp3_decoded_samples: %lu\nmp3_decode_us: %lu\n", decoded.samples, decoded.decodeUs);
+  }
+
+  void dub_audio_cache_stats(switch_stream_handle_t *stream) {
+    AudioCache::Stats stats = AudioCache::stats();
+    stream->write_function(stream, "entries: %lu\nbytes: %lu\nbudget: %lu\nhits: %lu\nmisses: %lu\nrevalidations: %lu\ninserts: %lu\nevictions: %lu\n",
+      stats.entries, stats.bytes, stats.budget, stats.hits, stats.misses, stats.revalidations, stats.inserts, stats.evictions);
+  }
+
+  void dub_audio_cache_flush() {
+    AudioCache::clear();
+  }
+
   switch_status_t dub_session_cleanup(switch_core_session_t *session, int channelIsClosing, switch_media_bug_t *bug) {
     switch_channel_t *channel = switch_core_session_get_channel(session);
 
@@ -165,21 +240,34 @@ extern "C" {
     if (switch_mutex_trylock(cb->mutex) == SWITCH_STATUS_SUCCESS) {
 
       /* check if any tracks have audio to contribute */
-      std::vector<Track*> activeTracks;
-      activeTracks.reserve(MAX_DUB_TRACKS);
+      Track* activeTracks[MAX_DUB_TRACKS];
+      int numActive = 0;
       for (int i = 0; i < MAX_DUB_TRACKS; i++) {
         if (cb->tracks[i]) {
           auto track = static_cast<Track*>(cb->tracks[i]);
-          if (track->hasAudio_NoLock()) activeTracks.push_back(static_cast<Track*>(cb->tracks[i]));
+          if (track->hasAudio_NoLock()) activeTracks[numActive++] = track;
+        }
+      }
+
+      /* duck tracks while their trigger has audio; the ramp starts with this frame */
+      switch_frame_t* rframe = switch_core_media_bug_get_write_replace_frame(bug);
+      for (int i = 0; i < MAX_DUB_TRACKS; i++) {
+        auto track = static_cast<Track*>(cb->tracks[i]);
+        if (track && track->isDucking()) {
+          const std::string& trigger = track->getDuckTrigger();
+          bool triggered = false;
+          for (int j = 0; j < numActive && !triggered; j++) {
+            triggered = activeTracks[j] != track && (trigger.empty() || trigger == activeTracks[j]->getTrackName());
+          }
+          track->updateDucking(triggered, rframe->samples);
         }
       }
 
-      if (activeTracks.size() == 0 && cb->gain == 0) {
+      if (numActive == 0 && cb->gain == 0) {
         switch_mutex_unlock(cb->mutex);
         return SWITCH_TRUE;
       }
 
-      switch_frame_t* rframe = switch_core_media_bug_get_write_replace_frame(bug);
       int16_t *fp = reinterpret_cast<int16_t*>(rframe->data);
 
       rframe->channels = 1;
@@ -190,16 +278,19 @@ extern "C" {
         vector_change_sln_volume_granular(fp, rframe->samples, cb->gain);
       }
 
-      /* now mux in the data from tracks */
-      for (auto track : activeTracks) {
-        int16_t data[SWITCH_RECOMMENDED_BUFFER_SIZE];
-        memset(data, 0, sizeof(data));
-        auto samples = track->retrieveAndClearAudio(data, rframe->samples);
-        if (samples > 0) {
-          vector_add(fp, data, rframe->samples);
+      /* now mix in the data from tracks, gain ramps and all, in one pass */
+      if (numActive > 0) {
+        vector_mix_source_t sources[MAX_DUB_TRACKS];
+        size_t samples[MAX_DUB_TRACKS];
+        for (int i = 0; i < numActive; i++) {
+          sources[i].samples = activeTracks[i]->peekAudio(rframe->samples, samples[i]);
+          activeTracks[i]->getMixGain(rframe->samples, sources[i]);
+        }
+        vector_mix(fp, sources, numActive, rframe->samples);
+        for (int i = 0; i < numActive; i++) {
+          activeTracks[i]->consumeAudio(samples[i]);
         }
       }
-      vector_normalize(fp, rframe->samples);
 
       switch_core_media_bug_set_write_replace_frame(bug, rframe);
       switch_mutex_unlock(cb->mutex);
@@ -3,12 +3,19 @@
 
 switch_status_t dub_init();
 switch_status_t dub_cleanup();
+void dub_audio_cache_stats(switch_stream_handle_t *stream);
+void dub_audio_cache_flush();
+void dub_io_pool_stats(switch_stream_handle_t *stream);
 
 switch_status_t add_track(struct cap_cb* cb, char* trackName, int sampleRate);
 switch_status_t silence_dub_track(struct cap_cb* cb, char* trackName);
 switch_status_t remove_dub_track(struct cap_cb* cb, char* trackName);
 switch_status_t play_dub_track(struct cap_cb* cb, char* trackName, char* url, int loop, int gain);
 switch_status_t say_dub_track(struct cap_cb* cb, char* trackName, char* text, int gain);
+switch_status_t set_dub_track_gain(struct cap_cb* cb, char* trackName, int gain, int rampMs);
+switch_status_t duck_dub_track(struct cap_cb* cb, char* trackName, int gain, int rampMs, char* triggerTrack);
+switch_status_t unduck_dub_track(struct cap_cb* cb, char* trackName);
+switch_status_t dub_track_queue_status(struct cap_cb* cb, char* trackName, switch_stream_handle_t *stream);
 
 switch_status_t dub_session_cleanup(switch_core_session_t *session, int channelIsClosing, switch_media_bug_t *bug);
 switch_bool_t dub_speech_frame(switch_media_bug_t *bug, void* user_data);
@@ -0,0 +1,114 @@
+#include "io_pool.h"
+#include "switch.h"
+#include <cstdlib>
+#include <algorithm>
+
+#define MIN_IO_THREADS (2)
+#define MAX_IO_THREADS (8)
+
+/* how often the loop lag is sampled */
+#define PROBE_INTERVAL_MS (100)
+
+std::once_flag IoPool::once;
+boost::asio::io_service IoPool::io_service;
+std::unique_ptr<boost::asio::io_service::work> IoPool::work;
+std::vector<std::thread> IoPool::threads;
+std::unique_ptr<boost::asio::deadline_timer> IoPool::probe_timer;
+boost::posix_time::ptime IoPool::probe_due;
+
+std::atomic<size_t> IoPool::queued(0);
+std::atomic<size_t> IoPool::maxQueued(0);
+std::atomic<uint64_t> IoPool::jobs(0);
+std::atomic<uint64_t> IoPool::lagUs(0);
+std::atomic<uint64_t> IoPool::avgLagUs(0);
+std::atomic<uint64_t> IoPool::maxLagUs(0);
+
+void IoPool::threadFunc() {
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "io_pool threadFunc - starting\n");
+
+  for(;;) {
+
+    try {
+      io_service.run() ;
+      break ;
+    }
+    catch( std::exception& e) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "io_pool threadFunc - Error: %s\n", e.what());
+    }
+  }
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "io_pool threadFunc - ending\n");
+}
+
+void IoPool::_init() {
+  const char* env = std::getenv("DUB_IO_THREADS");
+  int count = env ? atoi(env) : static_cast<int>(std::thread::hardware_concurrency());
+  if (!env) count = std::min(std::max(count, MIN_IO_THREADS), MAX_IO_THREADS);
+  count = std::max(count, 1);
+
+  /* to make sure the event loop doesn't terminate when there is no work to do */
+  io_service.reset();
+  work.reset(new boost::asio::io_service::work(io_service));
+
+  probe_timer.reset(new boost::asio::deadline_timer(io_service));
+  probe_due = boost::asio::deadline_timer::traits_type::now() + boost::posix_time::millisec(PROBE_INTERVAL_MS);
+  probe_timer->expires_at(probe_due);
+  probe_timer->async_wait(&IoPool::probe_cb);
+
+  for (int i = 0; i < count; i++) threads.emplace_back(threadFunc);
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "IoPool: started %d threads\n", count);
+}
+
+boost::asio::io_service& IoPool::service() {
+  std::call_once(once, _init);
+  return io_service;
+}
+
+void IoPool::shutdown() {
+  if (threads.empty()) return;
+  work.reset();
+  io_service.stop();
+  for (auto& t : threads) {
+    if (t.joinable()) t.join();
+  }
+  threads.clear();
+  probe_timer.reset();
+}
+
+void IoPool::jobQueued() {
+  size_t depth = ++queued;
+  size_t max = maxQueued.load(std::memory_order_relaxed);
+  while (depth > max && !maxQueued.compare_exchange_weak(max, depth, std::memory_order_relaxed));
+}
+
+void IoPool::jobStarted() {
+  --queued;
+  ++jobs;
+}
+
+/* a timer that fires late means handlers are waiting for a free thread */
+void IoPool::probe_cb(const boost::system::error_code& error) {
+  if (error) return;
+
+  auto now = boost::asio::deadline_timer::traits_type::now();
+  int64_t late = (now - probe_due).total_microseconds();
+  uint64_t lag = late > 0 ? late : 0;
+  lagUs = lag;
+  avgLagUs = (avgLagUs.load(std::memory_order_relaxed) * 7 + lag) / 8;
+  if (lag > maxLagUs.load(std::memory_order_relaxed)) maxLagUs = lag;
+
+  probe_due = now + boost::posix_time::millisec(PROBE_INTERVAL_MS);
+  probe_timer->expires_at(probe_due);
+  probe_timer->async_wait(&IoPool::probe_cb);
+}
+
+IoPool::Stats IoPool::stats() {
+  Stats s;
+  s.threads = threads.size();
+  s.queued = queued;
+  s.maxQueued = maxQueued;
+  s.jobs = jobs;
+  s.lagUs = lagUs;
+  s.avgLagUs = avgLagUs;
+  s.maxLagUs = maxLagUs;
+  return s;
+}
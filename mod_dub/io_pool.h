@@ -0,0 +1,63 @@
+#ifndef __IO_POOL_H__
+#define __IO_POOL_H__
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <boost/asio.hpp>
+
+/**
+ * the worker threads that run every audio producer.
+ *
+ * All producers share one io_service, run by DUB_IO_THREADS threads (by default one per core,
+ * from 2 to 8).  Each producer posts its work through its own strand, so a producer's handlers
+ * never run concurrently with one another while different producers run in parallel.
+ *
+ * The pool also keeps the numbers that tell whether it is keeping up: how many jobs are queued
+ * waiting for a thread, and how late a probe timer fires (the loop lag).
+ */
+class IoPool {
+public:
+  struct Stats {
+    size_t threads;
+    size_t queued;
+    size_t maxQueued;
+    uint64_t jobs;
+    uint64_t lagUs;
+    uint64_t avgLagUs;
+    uint64_t maxLagUs;
+  };
+
+  static boost::asio::io_service& service();
+  static void shutdown();
+
+  // bracket a queued job, for the queue depth metrics
+  static void jobQueued();
+  static void jobStarted();
+
+  static Stats stats();
+
+private:
+  static void _init();
+  static void threadFunc();
+  static void probe_cb(const boost::system::error_code& error);
+
+  static std::once_flag once;
+  static boost::asio::io_service io_service;
+  static std::unique_ptr<boost::asio::io_service::work> work;
+  static std::vector<std::thread> threads;
+  static std::unique_ptr<boost::asio::deadline_timer> probe_timer;
+  static boost::posix_time::ptime probe_due;
+
+  static std::atomic<size_t> queued;
+  static std::atomic<size_t> maxQueued;
+  static std::atomic<uint64_t> jobs;
+  static std::atomic<uint64_t> lagUs;
+  static std::atomic<uint64_t> avgLagUs;
+  static std::atomic<uint64_t> maxLagUs;
+};
+
+#endif
@@ -12,6 +12,28 @@
 
 /* Prototypes */
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_dub_shutdown);
+#define DUB_CACHE_API_SYNTAX "[stats|flush]"
+SWITCH_STANDARD_API(dub_cache_function)
+{
+  if (zstr(cmd) || 0 == strcmp(cmd, "stats")) {
+    dub_audio_cache_stats(stream);
+  }
+  else if (0 == strcmp(cmd, "flush")) {
+    dub_audio_cache_flush();
+    stream->write_function(stream, "+OK Success\n");
+  }
+  else {
+    stream->write_function(stream, "-USAGE: %s\n", DUB_CACHE_API_SYNTAX);
+  }
+	return SWITCH_STATUS_SUCCESS;
+}
+
+SWITCH_STANDARD_API(dub_io_pool_function)
+{
+  dub_io_pool_stats(stream);
+	return SWITCH_STATUS_SUCCESS;
+}
+
 SWITCH_MODULE_LOAD_FUNCTION(mod_dub_load);
 
 SWITCH_MODULE_DEFINITION(mod_dub, mod_dub_load, mod_dub_shutdown, NULL);
@@ -209,7 +231,61 @@ static switch_status_t dub_say_on_track(switch_core_session_t *session, char* tr
   return status;
 }
 
-#define DUB_API_SYNTAX "<uuid> [addTrack|removeTrack|silenceTrack|playOnTrack|sayOnTrack|setGain] track [url|text|gain] [gain] [loop]"
+static switch_status_t dub_set_track_gain(switch_core_session_t *session, char* trackName, int gain, int rampMs) {
+  switch_channel_t *channel = switch_core_session_get_channel(session);
+  switch_media_bug_t *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
+  switch_status_t status = SWITCH_STATUS_FALSE;
+
+  if (bug) {
+    struct cap_cb *cb =(struct cap_cb *) switch_core_media_bug_get_user_data(bug);
+
+    switch_mutex_lock(cb->mutex);
+    status = set_dub_track_gain(cb, trackName, gain, rampMs);
+    switch_mutex_unlock(cb->mutex);
+  }
+  else {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "dub_set_track_gain: bug not found\n");
+  }
+  return status;
+}
+
+static switch_status_t dub_duck_track(switch_core_session_t *session, char* trackName, int duck, int gain, int rampMs, char* triggerTrack) {
+  switch_channel_t *channel = switch_core_session_get_channel(session);
+  switch_media_bug_t *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
+  switch_status_t status = SWITCH_STATUS_FALSE;
+
+  if (bug) {
+    struct cap_cb *cb =(struct cap_cb *) switch_core_media_bug_get_user_data(bug);
+
+    switch_mutex_lock(cb->mutex);
+    status = duck ? duck_dub_track(cb, trackName, gain, rampMs, triggerTrack) : unduck_dub_track(cb, trackName);
+    switch_mutex_unlock(cb->mutex);
+  }
+  else {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "dub_duck_track: bug not found\n");
+  }
+  return status;
+}
+
+static switch_status_t dub_queue_status(switch_core_session_t *session, char* trackName, switch_stream_handle_t *stream) {
+  switch_channel_t *channel = switch_core_session_get_channel(session);
+  switch_media_bug_t *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
+  switch_status_t status = SWITCH_STATUS_FALSE;
+
+  if (bug) {
+    struct cap_cb *cb =(struct cap_cb *) switch_core_media_bug_get_user_data(bug);
+
+    switch_mutex_lock(cb->mutex);
+    status = dub_track_queue_status(cb, trackName, stream);
+    switch_mutex_unlock(cb->mutex);
+  }
+  else {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "dub_queue_status: bug not found\n");
+  }
+  return status;
+}
+
+#define DUB_API_SYNTAX "<uuid> [addTrack|removeTrack|silenceTrack|playOnTrack|sayOnTrack|setGain|setTrackGain|duckTrack|unduckTrack|queueStatus] track [url|text|gain] [gain|rampMs] [loop|triggerTrack]"
 #define MAX_PARAMS 6
 SWITCH_STANDARD_API(dub_function)
 {
@@ -264,6 +340,39 @@ SWITCH_STANDARD_API(dub_function)
           status = dub_play_on_track(session, track, url, loop, gain);
         }
       }
+      else if (0 == strcmp(action, "setTrackGain")) {
+        if (argc < 4) {
+          stream->write_function(stream, "-USAGE: %s\n", DUB_API_SYNTAX);
+          error_written = 1;
+        }
+        else {
+          int gain = atoi(argv[3]);
+          int rampMs = argc > 4 ? atoi(argv[4]) : 0;
+          switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "setTrackGain %s %d over %d ms\n", track, gain, rampMs);
+          status = dub_set_track_gain(session, track, gain, rampMs);
+        }
+      }
+      else if (0 == strcmp(action, "duckTrack")) {
+        if (argc < 4) {
+          stream->write_function(stream, "-USAGE: %s\n", DUB_API_SYNTAX);
+          error_written = 1;
+        }
+        else {
+          int gain = atoi(argv[3]);
+          int rampMs = argc > 4 ? atoi(argv[4]) : 0;
+          char* trigger = argc > 5 ? argv[5] : NULL;
+          switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "duckTrack %s to %d over %d ms when %s plays\n",
+            track, gain, rampMs, trigger ? trigger : "any track");
+          status = dub_duck_track(session, track, 1, gain, rampMs, trigger);
+        }
+      }
+      else if (0 == strcmp(action, "unduckTrack")) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "unduckTrack %s\n", track);
+        status = dub_duck_track(session, track, 0, 0, 0, NULL);
+      }
+      else if (0 == strcmp(action, "queueStatus")) {
+        status = dub_queue_status(session, track, stream);
+      }
       else if (0 == strcmp(action, "sayOnTrack")) {
         if (argc < 4) {
           stream->write_function(stream, "-USAGE: %s\n", DUB_API_SYNTAX);
@@ -316,8 +425,18 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_dub_load)
 	switch_console_set_complete("add uuid_dub silenceTrack <trackname>");
 	switch_console_set_complete("add uuid_dub playOnTrack <trackname> <url|file> [loop|once] [gain]");
 	switch_console_set_complete("add uuid_dub setGain <gain>");
+	switch_console_set_complete("add uuid_dub setTrackGain <trackname> <gain> [rampMs]");
+	switch_console_set_complete("add uuid_dub duckTrack <trackname> <gain> [rampMs] [triggerTrack]");
+	switch_console_set_complete("add uuid_dub unduckTrack <trackname>");
+	switch_console_set_complete("add uuid_dub queueStatus <trackname>");
 	switch_console_set_complete("add uuid_dub stop ");
 
+	SWITCH_ADD_API(api_interface, "dub_audio_cache", "mod_dub decoded audio cache", dub_cache_function, DUB_CACHE_API_SYNTAX);
+	switch_console_set_complete("add dub_audio_cache stats");
+	switch_console_set_complete("add dub_audio_cache flush");
+
+	SWITCH_ADD_API(api_interface, "dub_io_pool", "mod_dub producer thread pool metrics", dub_io_pool_function, "");
+
 	/* indicate that the module should continue to be loaded */
 	return SWITCH_STATUS_SUCCESS;
 }
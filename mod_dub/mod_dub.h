@@ -12,7 +12,10 @@
 #define MAX_SESSION_ID (256)
 #define MAX_BUG_LEN (64)
 #define MAX_URL_LEN (1024)
-#define MAX_DUB_TRACKS (2)
+/* may be overridden at build time; the mixer has headroom for up to 31 tracks */
+#ifndef MAX_DUB_TRACKS
+#define MAX_DUB_TRACKS (8)
+#endif
 
 /* per-channel data */
 typedef void (*responseHandler_t)(switch_core_session_t* session, const char* json, const char* bugname, const char* details);
@@ -1,58 +1,85 @@
 
 #include "mpg_decode.h"
-#include "vector_math.h"
-
-std::vector<int16_t> convert_mp3_to_linear(mpg123_handle *mh, int gain, int8_t *data, size_t len) {
-  std::vector<int16_t> linear_data;
-  int eof = 0;
-  int mp3err = 0;
-
-  if(mpg123_feed(mh, (const unsigned char*) data, len) == MPG123_OK) {
-    while(!eof) {
-      size_t usedlen = 0;
-      off_t frame_offset;
-      unsigned char* audio;
-
-      int decode_status = mpg123_decode_frame(mh, &frame_offset, &audio, &usedlen);
-
-      switch(decode_status) {
-        case MPG123_NEW_FORMAT:
-          continue;
-
-        case MPG123_OK:
-          {
-            size_t samples = usedlen / sizeof(int16_t);
-            linear_data.insert(linear_data.end(), reinterpret_cast<int16_t*>(audio), reinterpret_cast<int16_t*>(audio) + samples);
-          }
-          break;
-
-        case MPG123_DONE:
-        case MPG123_NEED_MORE:
-          eof = 1;
-          break;
-
-        case MPG123_ERR:
-        default:
-          if(++mp3err >= 5) {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Decoder Error!\n");
-            eof = 1;
-          }
-      }
-
-      if (eof)
-        break;
-
-      mp3err = 0;
-    }
+#include <chrono>
+#include <stdexcept>
+#include <string>
 
-    if (gain != 0) {
-      vector_change_sln_volume_granular(linear_data.data(), linear_data.size(), gain);
-    }
+/* consecutive decode errors after which the rest of the data fed is given up on */
+#define MAX_DECODE_ERRORS (5)
+
+std::atomic<uint64_t> Mp3Decoder::totalSamples(0);
+std::atomic<uint64_t> Mp3Decoder::totalDecodeUs(0);
+
+Mp3Decoder::Mp3Decoder(int sampleRate) : _mh(nullptr), _samples(0), _decodeUs(0) {
+  int mhError = 0;
+
+  _mh = mpg123_new("auto", &mhError);
+  if (!_mh) {
+    const char *mhErr = mpg123_plain_strerror(mhError);
+    throw std::runtime_error("Error allocating mpg123 handle! " + std::string(mhErr));
   }
-  else {
+
+  if (mpg123_open_feed(_mh) != MPG123_OK || mpg123_format_all(_mh) != MPG123_OK ||
+    mpg123_param(_mh, MPG123_FORCE_RATE, sampleRate, 0) != MPG123_OK ||
+    mpg123_param(_mh, MPG123_FLAGS, MPG123_MONO_MIX, 0) != MPG123_OK) {
+    mpg123_delete(_mh);
+    throw std::runtime_error("Error configuring mpg123 for mono at " + std::to_string(sampleRate) + "Hz");
+  }
+}
+
+Mp3Decoder::~Mp3Decoder() {
+  mpg123_close(_mh);
+  mpg123_delete(_mh);
+}
+
+bool Mp3Decoder::feed(const uint8_t* data, size_t len) {
+  if (mpg123_feed(_mh, data, len) != MPG123_OK) {
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Error feeding data to mpg123\n");
+    return false;
+  }
+  return true;
+}
+
+const int16_t* Mp3Decoder::nextFrame(size_t& samples) {
+  const int16_t* frame = nullptr;
+  int errors = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  samples = 0;
+  while (!frame) {
+    size_t usedlen = 0;
+    off_t frame_offset;
+    unsigned char* audio;
+
+    int decode_status = mpg123_decode_frame(_mh, &frame_offset, &audio, &usedlen);
+    if (decode_status == MPG123_OK) {
+      if (0 == usedlen) continue;
+      frame = reinterpret_cast<const int16_t*>(audio);
+      samples = usedlen / sizeof(int16_t);
+    }
+    else if (decode_status == MPG123_NEW_FORMAT) {
+      continue;
+    }
+    else if (decode_status == MPG123_DONE || decode_status == MPG123_NEED_MORE) {
+      break;
+    }
+    else if (++errors >= MAX_DECODE_ERRORS) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Decoder Error!\n");
+      break;
+    }
   }
 
+  uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  _samples += samples;
+  _decodeUs += us;
+  totalSamples.fetch_add(samples, std::memory_order_relaxed);
+  totalDecodeUs.fetch_add(us, std::memory_order_relaxed);
+  return frame;
+}
 
-  return linear_data;
+Mp3Decoder::Stats Mp3Decoder::totals() {
+  Stats s;
+  s.samples = totalSamples;
+  s.decodeUs = totalDecodeUs;
+  return s;
 }
@@ -1,11 +1,52 @@
-
 #ifndef MPG_DECODE_H
 #define MPG_DECODE_H
 
-#include <vector>
+#include <atomic>
+#include <cstdint>
 #include <mpg123.h>
 #include "switch.h"
 
-std::vector<int16_t> convert_mp3_to_linear(mpg123_handle *mh, int gain, int8_t *data, size_t len);
+/**
+ * streaming mp3 decoder, producing mono audio at the track's sample rate.
+ *
+ * Encoded data is fed in as it arrives and handed back a frame at a time, straight out of
+ * mpg123's own output buffer, so the decoded audio is copied only once: into its destination.
+ * Decoders keep count of what they have decoded and how long it took, as do the totals shared
+ * by all of them.
+ */
+class Mp3Decoder {
+public:
+  struct Stats {
+    uint64_t samples;
+    uint64_t decodeUs;
+  };
+
+  explicit Mp3Decoder(int sampleRate);
+  ~Mp3Decoder();
+
+  // queues encoded data for decoding; returns false if mpg123 would not take it
+  bool feed(const uint8_t* data, size_t len);
+
+  // the next decoded frame, or nullptr once the data fed so far is used up; valid until the next call
+  const int16_t* nextFrame(size_t& samples);
+
+  uint64_t samples() const { return _samples; }
+  uint64_t decodeUs() const { return _decodeUs; }
+
+  static Stats totals();
+
+  // no copying
+  Mp3Decoder(const Mp3Decoder&) = delete;
+  void operator=(const Mp3Decoder&) = delete;
+
+private:
+  mpg123_handle* _mh;
+  uint64_t _samples;
+  uint64_t _decodeUs;
+
+  static std::atomic<uint64_t> totalSamples;
+  static std::atomic<uint64_t> totalDecodeUs;
+};
 
 #endif
+
@@ -0,0 +1,116 @@
+#ifndef __PCM_RING_H__
+#define __PCM_RING_H__
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+/**
+ * single-producer / single-consumer lock-free ring of 16-bit samples.
+ *
+ * An audio producer's worker thread appends decoded audio and the media thread drains it in
+ * dub_speech_frame, neither side taking a lock.  Both sides work on contiguous spans, so data
+ * is copied straight in and out of the ring.  The capacity is fixed (rounded up to a power of
+ * two); producers hold on to whatever does not fit until the consumer has made room.
+ *
+ * Only one producer may write at a time, which holds because a track runs its producers one
+ * after another; those prefetched ahead of their turn write to rings of their own until then.
+ */
+class PcmRing {
+public:
+  explicit PcmRing(size_t capacity) : _readPos(0), _writePos(0) {
+    size_t n = 1;
+    while (n < capacity) n <<= 1;
+    _data.reset(new int16_t[n]);
+    _mask = n - 1;
+  }
+
+  size_t capacity() const { return _mask + 1; }
+  size_t size() const {
+    size_t r = _readPos.load(std::memory_order_acquire);
+    return _writePos.load(std::memory_order_acquire) - r;
+  }
+  bool empty() const { return 0 == size(); }
+
+  /* producer side */
+
+  // the contiguous free space following the last sample written
+  int16_t* writeSpan(size_t& len) {
+    size_t w = _writePos.load(std::memory_order_relaxed);
+    size_t free = capacity() - (w - _readPos.load(std::memory_order_acquire));
+    size_t offset = w & _mask;
+    len = std::min(free, capacity() - offset);
+    return _data.get() + offset;
+  }
+
+  // publishes len samples written into the span returned by writeSpan
+  void commit(size_t len) {
+    _writePos.store(_writePos.load(std::memory_order_relaxed) + len, std::memory_order_release);
+  }
+
+  // appends as many of len samples as there is room for, returning how many were written
+  size_t write(const int16_t* data, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+      size_t avail;
+      int16_t* dst = writeSpan(avail);
+      if (0 == avail) break;
+      size_t n = std::min(avail, len - written);
+      memcpy(dst, data + written, n * sizeof(int16_t));
+      commit(n);
+      written += n;
+    }
+    return written;
+  }
+
+  /* consumer side */
+
+  // the oldest contiguous run of samples
+  const int16_t* readSpan(size_t& len) const {
+    size_t r = _readPos.load(std::memory_order_relaxed);
+    size_t used = _writePos.load(std::memory_order_acquire) - r;
+    size_t offset = r & _mask;
+    len = std::min(used, capacity() - offset);
+    return _data.get() + offset;
+  }
+
+  // releases len samples of the span returned by readSpan back to the producer
+  void consume(size_t len) {
+    _readPos.store(_readPos.load(std::memory_order_relaxed) + len, std::memory_order_release);
+  }
+
+  // copies out up to len of the oldest samples without consuming them, returning how many were copied
+  size_t peek(int16_t* dst, size_t len) const {
+    size_t r = _readPos.load(std::memory_order_relaxed);
+    len = std::min(len, _writePos.load(std::memory_order_acquire) - r);
+    size_t offset = r & _mask;
+    size_t first = std::min(len, capacity() - offset);
+    memcpy(dst, _data.get() + offset, first * sizeof(int16_t));
+    memcpy(dst + first, _data.get(), (len - first) * sizeof(int16_t));
+    return len;
+  }
+
+  // copies out and discards up to len of the oldest samples, returning how many were read
+  size_t read(int16_t* dst, size_t len) {
+    len = peek(dst, len);
+    consume(len);
+    return len;
+  }
+
+  // no copying
+  PcmRing(const PcmRing&) = delete;
+  void operator=(const PcmRing&) = delete;
+
+private:
+  std::unique_ptr<int16_t[]> _data;
+  size_t _mask;
+
+  // free-running sample counts, kept on separate cache lines so the two threads do not contend
+  alignas(64) std::atomic<size_t> _readPos;
+  alignas(64) std::atomic<size_t> _writePos;
+};
+
+#endif
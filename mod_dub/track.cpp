@@ -1,12 +1,24 @@
 #include "track.h"
 #include "ap_file.h"
 #include "ap_http.h"
+#include "ap_mapped.h"
 #include "switch.h"
+#include <cmath>
+#include <cstdlib>
 
-#define INIT_BUFFER_SIZE (80000)
+/* samples the ring holds; producers throttle well below this, and hold back any overshoot */
+#define RING_BUFFER_SIZE (262144)
+
+/* queued items fetched ahead of their turn while the track plays (DUB_PREFETCH_COUNT overrides) */
+#define DEFAULT_PREFETCH_COUNT (1)
+
+/* a ducked track stays down until its trigger has been quiet this long, so gaps in streamed audio don't pump it */
+#define DUCK_RELEASE_MS (300)
 
 Track::Track(const std::string& trackName, int sampleRate) : _trackName(trackName), _sampleRate(sampleRate), 
-  _buffer(INIT_BUFFER_SIZE), _stopping(false)
+  _buffer(RING_BUFFER_SIZE), _stopping(false), _gain(VECTOR_MIX_UNITY << VECTOR_MIX_RAMP_BITS), _gainStep(0),
+  _gainTarget(VECTOR_MIX_UNITY << VECTOR_MIX_RAMP_BITS), _baseGain(VECTOR_MIX_UNITY), _duck(false), _ducked(false),
+  _duckGain(VECTOR_MIX_UNITY), _duckRampMs(0), _duckReleaseSamples(0)
 {
 }
 
@@ -17,7 +29,7 @@ Track::~Track() {
 
 /**
  * @brief called when an audio producer has finished retrieving the audio.
- * If we have another producer queued, then start it.
+ * If we have another producer queued, then start it, or splice it in if it was prefetched.
  * 
  * @param hasError 
  * @param errMsg 
@@ -27,20 +39,29 @@ void Track::onPlayDone(bool hasError, const std::string& errMsg) {
 
   if (!_stopping) {
     std::shared_ptr<AudioProducer> apDone, apNext;  // to retain a ref so the ap is not destroyed while under lock below -- avoid deadlock
+    bool prefetched = false;
   
     if (hasError) switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "onPlayDone: error: %s\n", errMsg.c_str());
     {
       std::lock_guard<std::mutex> lock(_mutex);
       if (!_apQueue.empty()) {
         apDone = _apQueue.front();
-        _apQueue.pop();
+        _apQueue.pop_front();
+      }
+      if (!_apQueue.empty()) {
+        apNext = _apQueue.front();
+        prefetched = apNext->isPrefetched();
       }
-       if (!_apQueue.empty()) apNext = _apQueue.front();      
     }
-    if (apNext) {
+    if (apNext && prefetched) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "onPlayDone: splicing in prefetched audio on track %s\n", _trackName.c_str());
+      apNext->splice();
+    }
+    else if (apNext) {
       switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "onPlayDone: starting queued audio on track %s\n", _trackName.c_str());
       apNext->start(std::bind(&Track::onPlayDone, this, std::placeholders::_1, std::placeholders::_2));
     }
+    prefetchQueued();
   }
   else {
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "onPlayDone: track %s stopping\n", _trackName.c_str());
@@ -51,11 +72,21 @@ void Track::queueFileAudio(const std::string& path, int gain, bool loop) {
   bool startIt = false;
   if (_stopping) return;
 
-  auto ap = std::make_shared<AudioProducerFile>(_mutex, _buffer, _sampleRate);
-  ap->queueFileAudio(path, gain, loop);
+  /* linear PCM is played from a file shared between calls, anything else is decoded */
+  std::shared_ptr<AudioProducer> ap;
+  if (AudioProducerMapped::handles(path)) {
+    auto mapped = std::make_shared<AudioProducerMapped>(_mutex, _buffer, _sampleRate);
+    mapped->queueFileAudio(path, gain, loop);
+    ap = mapped;
+  }
+  else {
+    auto file = std::make_shared<AudioProducerFile>(_mutex, _buffer, _sampleRate);
+    file->queueFileAudio(path, gain, loop);
+    ap = file;
+  }
   {
     std::lock_guard<std::mutex> lock(_mutex);
-    _apQueue.push(ap);
+    _apQueue.push_back(ap);
     startIt = _apQueue.size() == 1;
   }
   switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, 
@@ -72,6 +103,9 @@ void Track::queueFileAudio(const std::string& path, int gain, bool loop) {
       onPlayDone(true, e.what());
     }
   }
+  else {
+    prefetchQueued();
+  }
 }
 
 void Track::queueHttpGetAudio(const std::string& url, int gain, bool loop) {
@@ -81,7 +115,7 @@ void Track::queueHttpGetAudio(const std::string& url, int gain, bool loop) {
   ap->queueHttpGetAudio(url, gain, loop);
   {
     std::lock_guard<std::mutex> lock(_mutex);
-    _apQueue.push(ap);
+    _apQueue.push_back(ap);
     startIt = _apQueue.size() == 1;
   }
 
@@ -92,6 +126,9 @@ void Track::queueHttpGetAudio(const std::string& url, int gain, bool loop) {
       onPlayDone(true, e.what());
     }
   }
+  else {
+    prefetchQueued();
+  }
 }
 
 void Track::queueHttpPostAudio(const std::string& url, int gain, bool loop) {
@@ -101,7 +138,7 @@ void Track::queueHttpPostAudio(const std::string& url, int gain, bool loop) {
   ap->queueHttpPostAudio(url, gain, loop);
   {
     std::lock_guard<std::mutex> lock(_mutex);
-    _apQueue.push(ap);
+    _apQueue.push_back(ap);
     startIt = _apQueue.size() == 1;
   }
 
@@ -112,6 +149,9 @@ void Track::queueHttpPostAudio(const std::string& url, int gain, bool loop) {
       onPlayDone(true, e.what());
     }
   }
+  else {
+    prefetchQueued();
+  }
 }
 
 void Track::queueHttpPostAudio(const std::string& url, const std::string& body, std::vector<std::string>& headers, const std::string& proxy, int gain, bool loop) {
@@ -121,7 +161,7 @@ void Track::queueHttpPostAudio(const std::string& url, const std::string& body,
     ap->queueHttpPostAudio(url, body, headers, proxy, gain, loop);
   {
     std::lock_guard<std::mutex> lock(_mutex);
-    _apQueue.push(ap);
+    _apQueue.push_back(ap);
     startIt = _apQueue.size() == 1;
   }
 
@@ -132,26 +172,143 @@ void Track::queueHttpPostAudio(const std::string& url, const std::string& body,
       onPlayDone(true, e.what());
     }
   }
+  else {
+    prefetchQueued();
+  }
+}
+
+/* same range as the granular volume used elsewhere: -50 dB is silence, and boost tops out at the mixer's limit */
+static int32_t mix_gain_from_db(int gain) {
+  if (gain <= -50) return 0;
+  double linear = std::pow(10.0, std::min(gain, 50) / 20.0);
+  return static_cast<int32_t>(std::min(std::lround(linear * VECTOR_MIX_UNITY), (long) VECTOR_MIX_MAX_GAIN));
+}
+
+void Track::rampTo(int32_t gain, int rampMs) {
+  int64_t samples = static_cast<int64_t>(std::max(rampMs, 0)) * _sampleRate / 1000;
+
+  _gainTarget = gain << VECTOR_MIX_RAMP_BITS;
+  if (0 == samples || _gain == _gainTarget) {
+    _gain = _gainTarget;
+    _gainStep = 0;
+    return;
+  }
+  samples = std::max(samples, (int64_t) VECTOR_MIX_MIN_RAMP);
+  _gainStep = static_cast<int32_t>((static_cast<int64_t>(_gainTarget) - _gain) / samples);
+  if (0 == _gainStep) _gainStep = _gainTarget > _gain ? 1 : -1;
+}
+
+void Track::setGain(int gain, int rampMs) {
+  _baseGain = mix_gain_from_db(gain);
+  if (!_ducked) rampTo(_baseGain, rampMs);
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Track::setGain: track %s gain %d dB over %d ms\n",
+    _trackName.c_str(), gain, rampMs);
+}
+
+void Track::duck(int gain, int rampMs, const std::string& triggerTrack) {
+  _duck = true;
+  _duckGain = mix_gain_from_db(gain);
+  _duckRampMs = rampMs;
+  _duckTrigger = triggerTrack;
+  if (_ducked) rampTo(_duckGain, rampMs);
+  switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Track::duck: track %s ducks to %d dB over %d ms when %s has audio\n",
+    _trackName.c_str(), gain, rampMs, triggerTrack.empty() ? "any other track" : triggerTrack.c_str());
+}
+
+void Track::unduck() {
+  if (_ducked) rampTo(_baseGain, _duckRampMs);
+  _duck = _ducked = false;
+  _duckTrigger.clear();
+}
+
+void Track::updateDucking(bool triggered, size_t samples) {
+  if (triggered) {
+    _duckReleaseSamples = 0;
+    if (!_ducked) {
+      _ducked = true;
+      rampTo(_duckGain, _duckRampMs);
+    }
+  }
+  else if (_ducked) {
+    _duckReleaseSamples += samples;
+    if (_duckReleaseSamples >= static_cast<size_t>(DUCK_RELEASE_MS * _sampleRate / 1000)) {
+      _ducked = false;
+      rampTo(_baseGain, _duckRampMs);
+    }
+  }
+}
+
+void Track::getMixGain(size_t samples, vector_mix_source_t& source) {
+  source.gain = _gain;
+  source.step = _gainStep;
+  source.target = _gainTarget;
+  if (0 != _gainStep) {
+    int64_t gain = static_cast<int64_t>(_gain) + static_cast<int64_t>(_gainStep) * samples;
+    if ((_gainStep > 0 && gain >= _gainTarget) || (_gainStep < 0 && gain <= _gainTarget)) {
+      _gain = _gainTarget;
+      _gainStep = 0;
+    }
+    else {
+      _gain = static_cast<int32_t>(gain);
+    }
+  }
 }
 
  bool Track::hasAudio() {
-  if (_stopping) return false;
-  std::lock_guard<std::mutex> lock(_mutex); 
   return hasAudio_NoLock();
 }
 
 void Track::removeAllAudio() {
   _stopping = true;
-  std::queue<std::shared_ptr<AudioProducer>> apQueueCopy;
+  std::deque<std::shared_ptr<AudioProducer>> apQueueCopy;
   {
     std::lock_guard<std::mutex> lock(_mutex); 
-    apQueueCopy = _apQueue;
-    _apQueue = std::queue<std::shared_ptr<AudioProducer>>();
+    apQueueCopy.swap(_apQueue);
   }
   
-  while (!apQueueCopy.empty()) {
-    auto ap = apQueueCopy.front();
-    apQueueCopy.pop();
-    ap->stop();
+  for (auto& ap : apQueueCopy) ap->stop();
+}
+
+static size_t prefetch_count() {
+  static const size_t count = []() {
+    const char* env = std::getenv("DUB_PREFETCH_COUNT");
+    return static_cast<size_t>(env ? std::max(atoi(env), 0) : DEFAULT_PREFETCH_COUNT);
+  }();
+  return count;
+}
+
+/**
+ * starts the items queued behind the one playing, up to DUB_PREFETCH_COUNT of them, fetching and
+ * decoding into rings of their own.  Each is spliced into the track's ring when its turn comes,
+ * so it plays straight on from the one before.
+ */
+void Track::prefetchQueued() {
+  if (_stopping) return;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  size_t n = std::min(_apQueue.size(), prefetch_count() + 1);
+  for (size_t i = 1; i < n; i++) {
+    auto& ap = _apQueue[i];
+    if (ap->isPrefetched()) continue;
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Track::prefetchQueued: track %s prefetching %s\n",
+      _trackName.c_str(), ap->source().c_str());
+    ap->prefetch(std::bind(&Track::onPlayDone, this, std::placeholders::_1, std::placeholders::_2), RING_BUFFER_SIZE);
+  }
+}
+
+void Track::getQueueStatus(std::vector<QueuedAudio>& items) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (size_t i = 0; i < _apQueue.size(); i++) {
+    auto& ap = _apQueue[i];
+    QueuedAudio item;
+    item.source = ap->source();
+    item.bufferedMs = 0;
+    if (0 == i) item.state = "playing";
+    else if (!ap->isPrefetched()) item.state = "queued";
+    else {
+      item.state = ap->isFetched() ? "fetched" : "prefetching";
+      item.bufferedMs = ap->prefetchedMs();
+    }
+    items.push_back(item);
   }
 }
\ No newline at end of file
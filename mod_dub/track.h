@@ -2,12 +2,24 @@
 #define __TRACK_H__
 
 #include <mutex>
-#include <queue>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+#include <algorithm>
 #include "common.h"
 #include "ap.h"
+#include "vector_math.h"
 
 class Track {
 public:
+  /* where a queued item is at: the head of the queue plays, the next few are prefetched */
+  struct QueuedAudio {
+    std::string source;
+    const char* state;    // playing, prefetching, fetched or queued
+    size_t bufferedMs;    // audio a prefetched item has waiting to be spliced in
+  };
+
   Track(const std::string& trackName, int sampleRate);
   ~Track();
 
@@ -18,23 +30,57 @@ public:
   void queueFileAudio(const std::string& path, int gain = 0, bool loop = false);
   void removeAllAudio();
 
+  // the items on the track's queue, in order
+  void getQueueStatus(std::vector<QueuedAudio>& items);
+
+  /**
+   * gain in dB applied when the track is mixed, on top of any gain given when audio was queued.
+   * Changes ramp over rampMs.  Gain and ducking are set under the session's lock, which the
+   * mixer also holds, so none of this state needs to be atomic.
+   */
+  void setGain(int gain, int rampMs = 0);
+
+  /* while the trigger track (or any other track, if none is named) has audio, ramp down to gain */
+  void duck(int gain, int rampMs, const std::string& triggerTrack);
+  void unduck();
+  bool isDucking() const { return _duck; }
+  const std::string& getDuckTrigger() const { return _duckTrigger; }
+  void updateDucking(bool triggered, size_t samples);
+
+  /* the gain to mix the next samples at, advancing any ramp in progress past them */
+  void getMixGain(size_t samples, vector_mix_source_t& source);
+
   void onPlayDone(bool hasError, const std::string& errMsg);
 
   std::string& getTrackName() { return _trackName; }
 
-  /* audio playout methods */
+  /* audio playout methods; these do not lock, the ring is safe to drain while a producer fills it */
   bool hasAudio();
   inline bool hasAudio_NoLock() const {
     return !_stopping && !_buffer.empty();
   }
 
 
-  int retrieveAndClearAudio(int16_t* buf, int desiredSamples) {
-    std::lock_guard<std::mutex> lock(_mutex);
-    int samplesToCopy = std::min(static_cast<int>(_buffer.size()), desiredSamples);
-    std::copy_n(_buffer.begin(), samplesToCopy, buf);
-    _buffer.erase(_buffer.begin(), _buffer.begin() + samplesToCopy);
-    return samplesToCopy;
+  /**
+   * returns a frame of desiredSamples for the mixer, padded out with silence if the track has
+   * less than that.  The frame is read in place from the ring when it is contiguous there;
+   * either way, samples is set to how much audio it holds, to be released with consumeAudio.
+   */
+  const int16_t* peekAudio(size_t desiredSamples, size_t& samples) {
+    size_t len;
+    const int16_t* span = _buffer.readSpan(len);
+    if (len >= desiredSamples) {
+      samples = desiredSamples;
+      return span;
+    }
+    if (_frame.size() < desiredSamples) _frame.resize(desiredSamples);
+    samples = _buffer.peek(_frame.data(), desiredSamples);
+    std::fill(_frame.begin() + samples, _frame.begin() + desiredSamples, 0);
+    return _frame.data();
+  }
+
+  void consumeAudio(size_t samples) {
+    _buffer.consume(samples);
   }
 
 private:
@@ -42,8 +88,27 @@ private:
   int _sampleRate;
   std::mutex _mutex;
   CircularBuffer_t _buffer;
-  std::queue<std::shared_ptr<AudioProducer>> _apQueue;
-  bool _stopping;
+  std::deque<std::shared_ptr<AudioProducer>> _apQueue;
+  std::atomic<bool> _stopping;
+  std::vector<int16_t> _frame;
+
+  void rampTo(int32_t gain, int rampMs);
+  void prefetchQueued();
+
+  /* mix gain and ramp, with VECTOR_MIX_RAMP_BITS of fraction */
+  int32_t _gain;
+  int32_t _gainStep;
+  int32_t _gainTarget;
+
+  /* gain (Q12) the track sits at when not ducked */
+  int32_t _baseGain;
+
+  bool _duck;
+  bool _ducked;
+  int32_t _duckGain;
+  int _duckRampMs;
+  size_t _duckReleaseSamples;
+  std::string _duckTrigger;
 };
 
 
@@ -10,6 +10,63 @@
 #define normalize_to_16bit_basic(n) if (n > SMAX) n = SMAX; else if (n < SMIN) n = SMIN;
 #define normalize_volume_granular(x) if (x > GRANULAR_VOLUME_MAX) x = GRANULAR_VOLUME_MAX; if (x < -GRANULAR_VOLUME_MAX) x = -GRANULAR_VOLUME_MAX;
 
+/*
+ * mixing: gains are Q12, so a 16x16-bit product is Q12 too.  Products are accumulated at Q8
+ * and the sum is rounded back down to Q0 before it is saturated; that leaves room in 32 bits
+ * for VECTOR_MIX_MAX_SOURCES at the maximum gain of 8x on top of the channel audio.
+ */
+#define MIX_PRE_SHIFT (4)
+#define MIX_POST_SHIFT (8)
+
+/* the gain of a source i samples into the frame, still carrying its ramp fraction */
+static inline int32_t vector_mix_gain_at(const vector_mix_source_t* src, size_t i) {
+  int64_t gain = (int64_t) src->gain + (int64_t) src->step * (int64_t) i;
+  if ((src->step > 0 && gain > src->target) || (src->step < 0 && gain < src->target)) gain = src->target;
+  return (int32_t) gain;
+}
+
+static inline void vector_mix_scalar(int16_t* dst, const vector_mix_source_t* srcs, size_t nsrcs, size_t from, size_t len) {
+  for (size_t i = from; i < len; i++) {
+    int32_t acc = (int32_t) dst[i] * (1 << MIX_POST_SHIFT);
+    for (size_t k = 0; k < nsrcs; k++) {
+      int32_t gain = vector_mix_gain_at(srcs + k, i) >> VECTOR_MIX_RAMP_BITS;
+      acc += ((int32_t) srcs[k].samples[i] * gain) >> MIX_PRE_SHIFT;
+    }
+    acc = (acc + (1 << (MIX_POST_SHIFT - 1))) >> MIX_POST_SHIFT;
+    normalize_to_16bit_basic(acc);
+    dst[i] = (int16_t) acc;
+  }
+}
+
+/* where a ramp has got to after another n samples, clamped at its target so it cannot overflow */
+static inline int32_t vector_mix_advance(int32_t gain, const vector_mix_source_t* src, int n) {
+  gain += src->step * n;
+  if ((src->step > 0 && gain > src->target) || (src->step < 0 && gain < src->target)) gain = src->target;
+  return gain;
+}
+
+/* the scale factor for a granular volume change of vol dB, from -50 (silence) to +50 */
+static float granular_volume_rate(int32_t vol) {
+  static const float pos[GRANULAR_VOLUME_MAX] = {
+		1.122018,   1.258925,   1.412538,   1.584893,   1.778279,   1.995262,   2.238721,   2.511887,   2.818383,   3.162278,
+		3.548134,   3.981072,   4.466835,   5.011872,   5.623413,   6.309574,   7.079458,   7.943282,   8.912509,  10.000000,
+		11.220183,  12.589254,  14.125375,  15.848933,  17.782795,  19.952621,  22.387213,  25.118862,  28.183832,  31.622776,
+		35.481335,  39.810719,  44.668358,  50.118729,  56.234131,  63.095726,  70.794586,  79.432816,  89.125107, 100.000000,
+		112.201836, 125.892517, 141.253784, 158.489334, 177.827942, 199.526215, 223.872070, 251.188705, 281.838318, 316.227753
+  };
+  static const float neg[GRANULAR_VOLUME_MAX] = {
+		0.891251, 0.794328, 0.707946, 0.630957, 0.562341, 0.501187, 0.446684, 0.398107, 0.354813, 0.316228,
+		0.281838, 0.251189, 0.223872, 0.199526, 0.177828, 0.158489, 0.141254, 0.125893, 0.112202, 0.100000,
+		0.089125, 0.079433, 0.070795, 0.063096, 0.056234, 0.050119, 0.044668, 0.039811, 0.035481, 0.031623,
+		0.028184, 0.025119, 0.022387, 0.019953, 0.017783, 0.015849, 0.014125, 0.012589, 0.011220, 0.010000,
+		0.008913, 0.007943, 0.007079, 0.006310, 0.005623, 0.005012, 0.004467, 0.003981, 0.003548, 0.000000  // NOTE mapped -50 dB ratio to total silence instead of 0.003162
+  };
+
+  if (vol == 0) return 1.0f;
+  normalize_volume_granular(vol);
+  return vol > 0 ? pos[vol - 1] : neg[-vol - 1];
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -49,6 +106,70 @@ void vector_normalize(int16_t* a, size_t len) {
       else if (a[i] < SMIN) a[i] = SMIN;
   }
 }
+/*
+ * the per-sample gains of a ramping source for the next 16 samples, from where the ramp has got to.
+ * They are worked out in the order unpacklo/unpackhi leave the samples in, so that packing them
+ * back down to 16 bits puts them in sample order.
+ */
+static inline __m256i vector_mix_ramp_avx2(int32_t gain, const vector_mix_source_t* src) {
+  const int32_t s = src->step;
+  __m256i base = _mm256_set1_epi32(gain);
+  __m256i target = _mm256_set1_epi32(src->target);
+  __m256i lo = _mm256_add_epi32(base, _mm256_setr_epi32(0, s, 2 * s, 3 * s, 8 * s, 9 * s, 10 * s, 11 * s));
+  __m256i hi = _mm256_add_epi32(base, _mm256_setr_epi32(4 * s, 5 * s, 6 * s, 7 * s, 12 * s, 13 * s, 14 * s, 15 * s));
+  if (s > 0) {
+    lo = _mm256_min_epi32(lo, target);
+    hi = _mm256_min_epi32(hi, target);
+  }
+  else {
+    lo = _mm256_max_epi32(lo, target);
+    hi = _mm256_max_epi32(hi, target);
+  }
+  return _mm256_packs_epi32(_mm256_srai_epi32(lo, VECTOR_MIX_RAMP_BITS), _mm256_srai_epi32(hi, VECTOR_MIX_RAMP_BITS));
+}
+
+/* 
+ * sums the sources into dst (taken at unity gain), 16 samples at a time in 32-bit accumulators,
+ * applying each source's gain - ramping or not - as it goes.  Each 16x16-bit product is scaled
+ * down by MIX_PRE_SHIFT as it is accumulated, and the total is saturated back to 16 bits once.
+ */
+void vector_mix(int16_t* dst, const vector_mix_source_t* srcs, size_t nsrcs, size_t len) {
+  const __m256i round = _mm256_set1_epi32(1 << (MIX_POST_SHIFT - 1));
+  int32_t ramp[VECTOR_MIX_MAX_SOURCES];
+  size_t i = 0;
+
+  assert(nsrcs <= VECTOR_MIX_MAX_SOURCES);
+  for (size_t k = 0; k < nsrcs; k++) ramp[k] = srcs[k].gain;
+
+  for (; i + 15 < len; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(dst + i));
+    __m256i acc_lo = _mm256_slli_epi32(_mm256_srai_epi32(_mm256_unpacklo_epi16(v, v), 16), MIX_POST_SHIFT);
+    __m256i acc_hi = _mm256_slli_epi32(_mm256_srai_epi32(_mm256_unpackhi_epi16(v, v), 16), MIX_POST_SHIFT);
+
+    for (size_t k = 0; k < nsrcs; k++) {
+      __m256i g;
+      if (0 == srcs[k].step) {
+        g = _mm256_set1_epi16((int16_t) (srcs[k].gain >> VECTOR_MIX_RAMP_BITS));
+      }
+      else {
+        g = vector_mix_ramp_avx2(ramp[k], srcs + k);
+        ramp[k] = vector_mix_advance(ramp[k], srcs + k, 16);
+      }
+      __m256i s = _mm256_loadu_si256((const __m256i*)(srcs[k].samples + i));
+      __m256i p_lo = _mm256_mullo_epi16(s, g);
+      __m256i p_hi = _mm256_mulhi_epi16(s, g);
+      acc_lo = _mm256_add_epi32(acc_lo, _mm256_srai_epi32(_mm256_unpacklo_epi16(p_lo, p_hi), MIX_PRE_SHIFT));
+      acc_hi = _mm256_add_epi32(acc_hi, _mm256_srai_epi32(_mm256_unpackhi_epi16(p_lo, p_hi), MIX_PRE_SHIFT));
+    }
+
+    /* unpack and pack both work within 128-bit lanes, so the samples come back out in order */
+    acc_lo = _mm256_srai_epi32(_mm256_add_epi32(acc_lo, round), MIX_POST_SHIFT);
+    acc_hi = _mm256_srai_epi32(_mm256_add_epi32(acc_hi, round), MIX_POST_SHIFT);
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_packs_epi32(acc_lo, acc_hi));
+  }
+  vector_mix_scalar(dst, srcs, nsrcs, i, len);
+}
+
 typedef union {
     int16_t* data;
     __m256i* fp_avx2;
@@ -111,6 +232,31 @@ void vector_change_sln_volume_granular(int16_t* data, uint32_t samples, int32_t
     }
   }
 }
+/* vector_change_sln_volume_granular, copying from src to dst as it goes */
+void vector_copy_sln_volume_granular(int16_t* dst, const int16_t* src, uint32_t samples, int32_t vol) {
+  float newrate = granular_volume_rate(vol);
+  uint32_t i = 0;
+
+  /* as in place, a rate of 0 leaves the audio as it is */
+  if (vol == 0 || newrate == 0) {
+    memmove(dst, src, samples * sizeof(int16_t));
+    return;
+  }
+
+  __m256 scale_factor_reg = _mm256_set1_ps(newrate);
+  for (; i + 7 < samples; i += 8) {
+    __m256i data_32 = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+    __m256i result_32 = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(data_32), scale_factor_reg));
+
+    /* packs saturates to 16 bits */
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(_mm256_castsi256_si128(result_32), _mm256_extractf128_si256(result_32, 1)));
+  }
+  for (; i < samples; i++) {
+    int32_t tmp = (int32_t)(src[i] * newrate);
+    normalize_to_16bit_basic(tmp);
+    dst[i] = (int16_t)tmp;
+  }
+}
 #elif defined(USE_SSE2)
 #include <emmintrin.h>
 #pragma message("Using SSE2 SIMD.")
@@ -149,11 +295,93 @@ void vector_normalize(int16_t* a, size_t len) {
   }
 }
 
+/* the per-sample gains of a ramping source for the next 8 samples; SSE2 has no 32-bit min/max, so clamp by hand */
+static inline __m128i vector_mix_ramp_sse2(int32_t gain, const vector_mix_source_t* src) {
+  const int32_t s = src->step;
+  __m128i base = _mm_set1_epi32(gain);
+  __m128i target = _mm_set1_epi32(src->target);
+  __m128i lo = _mm_add_epi32(base, _mm_setr_epi32(0, s, 2 * s, 3 * s));
+  __m128i hi = _mm_add_epi32(base, _mm_setr_epi32(4 * s, 5 * s, 6 * s, 7 * s));
+  __m128i past_lo = s > 0 ? _mm_cmpgt_epi32(lo, target) : _mm_cmpgt_epi32(target, lo);
+  __m128i past_hi = s > 0 ? _mm_cmpgt_epi32(hi, target) : _mm_cmpgt_epi32(target, hi);
+  lo = _mm_or_si128(_mm_and_si128(past_lo, target), _mm_andnot_si128(past_lo, lo));
+  hi = _mm_or_si128(_mm_and_si128(past_hi, target), _mm_andnot_si128(past_hi, hi));
+  return _mm_packs_epi32(_mm_srai_epi32(lo, VECTOR_MIX_RAMP_BITS), _mm_srai_epi32(hi, VECTOR_MIX_RAMP_BITS));
+}
+
+/* as the AVX2 version, 8 samples at a time */
+void vector_mix(int16_t* dst, const vector_mix_source_t* srcs, size_t nsrcs, size_t len) {
+  const __m128i round = _mm_set1_epi32(1 << (MIX_POST_SHIFT - 1));
+  int32_t ramp[VECTOR_MIX_MAX_SOURCES];
+  size_t i = 0;
+
+  assert(nsrcs <= VECTOR_MIX_MAX_SOURCES);
+  for (size_t k = 0; k < nsrcs; k++) ramp[k] = srcs[k].gain;
+
+  for (; i + 7 < len; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(dst + i));
+    __m128i acc_lo = _mm_slli_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16), MIX_POST_SHIFT);
+    __m128i acc_hi = _mm_slli_epi32(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16), MIX_POST_SHIFT);
+
+    for (size_t k = 0; k < nsrcs; k++) {
+      __m128i g;
+      if (0 == srcs[k].step) {
+        g = _mm_set1_epi16((int16_t) (srcs[k].gain >> VECTOR_MIX_RAMP_BITS));
+      }
+      else {
+        g = vector_mix_ramp_sse2(ramp[k], srcs + k);
+        ramp[k] = vector_mix_advance(ramp[k], srcs + k, 8);
+      }
+      __m128i s = _mm_loadu_si128((const __m128i*)(srcs[k].samples + i));
+      __m128i p_lo = _mm_mullo_epi16(s, g);
+      __m128i p_hi = _mm_mulhi_epi16(s, g);
+      acc_lo = _mm_add_epi32(acc_lo, _mm_srai_epi32(_mm_unpacklo_epi16(p_lo, p_hi), MIX_PRE_SHIFT));
+      acc_hi = _mm_add_epi32(acc_hi, _mm_srai_epi32(_mm_unpackhi_epi16(p_lo, p_hi), MIX_PRE_SHIFT));
+    }
+
+    acc_lo = _mm_srai_epi32(_mm_add_epi32(acc_lo, round), MIX_POST_SHIFT);
+    acc_hi = _mm_srai_epi32(_mm_add_epi32(acc_hi, round), MIX_POST_SHIFT);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(acc_lo, acc_hi));
+  }
+  vector_mix_scalar(dst, srcs, nsrcs, i, len);
+}
+
 typedef union {
     int16_t* data;
     __m128i* fp_sse2;
 } vector_data_t;
 
+/* as the AVX2 version, 8 samples at a time; SSE2 can't widen 16-bit samples itself, so they are unpacked and shifted */
+void vector_copy_sln_volume_granular(int16_t* dst, const int16_t* src, uint32_t samples, int32_t vol) {
+  float newrate = granular_volume_rate(vol);
+  uint32_t i = 0;
+
+  /* as in place, a rate of 0 leaves the audio as it is */
+  if (vol == 0 || newrate == 0) {
+    memmove(dst, src, samples * sizeof(int16_t));
+    return;
+  }
+
+  __m128 scale_factor_reg = _mm_set1_ps(newrate);
+  for (; i + 7 < samples; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo), scale_factor_reg));
+    hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi), scale_factor_reg));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(lo, hi));
+  }
+  for (; i < samples; i++) {
+    int32_t tmp = (int32_t)(src[i] * newrate);
+    normalize_to_16bit_basic(tmp);
+    dst[i] = (int16_t)tmp;
+  }
+}
+
+void vector_change_sln_volume_granular(int16_t* data, uint32_t samples, int32_t vol) {
+  vector_copy_sln_volume_granular(data, data, samples, vol);
+}
+
 #else
 #pragma message("Building without vector math support")
 void vector_add(int16_t* a, int16_t* b, size_t len) {
@@ -161,6 +389,9 @@ void vector_add(int16_t* a, int16_t* b, size_t len) {
         a[i] += b[i];
     }
 }
+void vector_mix(int16_t* dst, const vector_mix_source_t* srcs, size_t nsrcs, size_t len) {
+  vector_mix_scalar(dst, srcs, nsrcs, 0, len);
+}
 void vector_normalize(int16_t* a, size_t len) {
   for (size_t i = 0; i < len; i++) {
     normalize_to_16bit_basic(a[i]);
@@ -207,6 +438,21 @@ void vector_change_sln_volume_granular(int16_t* data, uint32_t samples, int32_t
   }
 }
 
+void vector_copy_sln_volume_granular(int16_t* dst, const int16_t* src, uint32_t samples, int32_t vol) {
+  float newrate = granular_volume_rate(vol);
+
+  /* as in place, a rate of 0 leaves the audio as it is */
+  if (vol == 0 || newrate == 0) {
+    memmove(dst, src, samples * sizeof(int16_t));
+    return;
+  }
+  for (uint32_t x = 0; x < samples; x++) {
+    int32_t tmp = (int32_t) (src[x] * newrate);
+    normalize_to_16bit_basic(tmp);
+    dst[x] = (int16_t) tmp;
+  }
+}
+
 #endif
 
 #ifdef __cplusplus
@@ -5,13 +5,36 @@
 #include <stdint.h>
 
 
+/* mixer gains are Q12 fixed point, and may boost by up to 8x */
+#define VECTOR_MIX_UNITY (4096)
+#define VECTOR_MIX_MAX_GAIN (32767)
+
+/* gains handed to vector_mix carry this many more bits of fraction, so that slow ramps still move */
+#define VECTOR_MIX_RAMP_BITS (12)
+
+/* ramps must take at least this many samples, which keeps the mixer's ramp arithmetic inside 32 bits */
+#define VECTOR_MIX_MIN_RAMP (16)
+
+/* the mixer has headroom for this many sources at full gain */
+#define VECTOR_MIX_MAX_SOURCES (31)
+
+/* a source for vector_mix: its gain moves by step every sample until it reaches target */
+typedef struct {
+  const int16_t* samples;
+  int32_t gain;
+  int32_t step;
+  int32_t target;
+} vector_mix_source_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void vector_add(int16_t* a, int16_t* b, size_t len);
+void vector_mix(int16_t* dst, const vector_mix_source_t* srcs, size_t nsrcs, size_t len);
 void vector_normalize(int16_t* a, size_t len);
 void vector_change_sln_volume_granular(int16_t* data, uint32_t samples, int32_t vol);
+void vector_copy_sln_volume_granular(int16_t* dst, const int16_t* src, uint32_t samples, int32_t vol);
 
 #ifdef __cplusplus
 }
@@ -1,7 +1,7 @@
 #ifndef __ELEVENLABS_GLUE_H__
 #define __ELEVENLABS_GLUE_H__
 
-switch_status_t elevenlabs_speech_load();
+switch_status_t elevenlabs_speech_load(switch_loadable_module_interface_t **module_interface);
 switch_status_t elevenlabs_speech_open(elevenlabs_t* elevenlabs);
 switch_status_t elevenlabs_speech_feed_tts(elevenlabs_t* elevenlabs, char* text, switch_speech_flag_t *flags);
 switch_status_t elevenlabs_speech_read_tts(elevenlabs_t* elevenlabs, void *data, size_t *datalen, switch_speech_flag_t *flags);
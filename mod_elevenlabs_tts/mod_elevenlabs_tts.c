@@ -220,7 +220,7 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_elevenlabs_tts_load)
 	speech_interface->speech_numeric_param_tts = ell_numeric_param_tts;
 	speech_interface->speech_float_param_tts = ell_float_param_tts;
 
-	return elevenlabs_speech_load();
+	return elevenlabs_speech_load(module_interface);
 }
 
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_elevenlabs_tts_shutdown)
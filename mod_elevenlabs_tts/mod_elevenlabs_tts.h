@@ -38,6 +38,7 @@ struct elevenlabs_data {
 	FILE *file;
   switch_mutex_t *mutex;
   void *circularBuffer;
+  void *prebuffer;
   int draining;
   int reads;
   int cache_audio;
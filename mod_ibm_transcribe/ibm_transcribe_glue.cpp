@@ -162,7 +162,7 @@ namespace {
     return path;
   }
 
-  static void eventCallback(const char* sessionId, const char* bugname, ibm::AudioPipe::NotifyEvent_t event, const char* message, bool finished, bool wantsInterim) {
+  static void eventCallback(const char* sessionId, const char* bugname, ibm::AudioPipe::NotifyEvent_t event, const char* message, size_t message_len, bool finished, bool wantsInterim) {
     switch_core_session_t* session = switch_core_session_locate(sessionId);
     if (session) {
       bool releaseAudioPipe = false;
@@ -212,7 +212,7 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_playht_tts_load)
 	speech_interface->speech_text_param_tts = p_text_param_tts;
 	speech_interface->speech_numeric_param_tts = p_numeric_param_tts;
 	speech_interface->speech_float_param_tts = p_float_param_tts;
-  return playht_speech_load();
+  return playht_speech_load(module_interface);
 }
 
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_playht_tts_shutdown)
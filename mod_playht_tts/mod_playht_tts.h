@@ -39,6 +39,7 @@ typedef struct playht_data {
 
 	void *conn;
   void *circularBuffer;
+  void *prebuffer;
   switch_mutex_t *mutex;
   FILE *file;
 } playht_t;
@@ -29,6 +29,7 @@ typedef struct rimelabs_data {
 
 	void *conn;
   void *circularBuffer;
+  void *prebuffer;
   switch_mutex_t *mutex;
   FILE *file;
   SpeexResamplerState *resampler;
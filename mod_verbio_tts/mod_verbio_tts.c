@@ -144,7 +144,7 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_verbio_tts_load)
 	speech_interface->speech_text_param_tts = v_text_param_tts;
 	speech_interface->speech_numeric_param_tts = v_numeric_param_tts;
 	speech_interface->speech_float_param_tts = v_float_param_tts;
-  return verbio_speech_load();
+  return verbio_speech_load(module_interface);
 }
 
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_verbio_tts_shutdown)
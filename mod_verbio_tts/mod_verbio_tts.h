@@ -25,6 +25,7 @@ typedef struct verbio_data {
 
 	void *conn;
   void *circularBuffer;
+  void *prebuffer;
   switch_mutex_t *mutex;
   FILE *file;
   SpeexResamplerState *resampler;
@@ -165,7 +165,7 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_whisper_tts_load)
 	speech_interface->speech_text_param_tts = w_text_param_tts;
 	speech_interface->speech_numeric_param_tts = w_numeric_param_tts;
 	speech_interface->speech_float_param_tts = w_float_param_tts;
-  return whisper_speech_load();
+  return whisper_speech_load(module_interface);
 }
 
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_whisper_tts_shutdown)
@@ -39,6 +39,7 @@ typedef struct whisper_data {
 
 	void *conn;
   void *circularBuffer;
+  void *prebuffer;
   switch_mutex_t *mutex;
   FILE *file;
 } whisper_t;
@@ -1,7 +1,7 @@
 #ifndef __WHISPER_GLUE_H__
 #define __WHISPER_GLUE_H__
 
-switch_status_t whisper_speech_load();
+switch_status_t whisper_speech_load(switch_loadable_module_interface_t **module_interface);
 switch_status_t whisper_speech_open(whisper_t* whisper);
 switch_status_t whisper_speech_feed_tts(whisper_t* whisper, char* text, switch_speech_flag_t *flags);
 switch_status_t whisper_speech_read_tts(whisper_t* whisper, void *data, size_t *datalen, switch_speech_flag_t *flags);